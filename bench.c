@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <zlib.h>
+
+#define SERVER_IP "127.0.0.1" // localhost
+#define PORT 8888
+#define MAXDATASIZE 1024
+#define ARCHIVE_MAGIC "\0W24TGZ\n"
+#define ARCHIVE_MAGIC_LENGTH 8
+#define ARCHIVE_CHUNK_SIZE 65536
+#define FILE_MAGIC "\0W24FIL\n"
+#define FILE_MAGIC_LENGTH 8
+#define PROTOCOL_FRAMED 2
+#define FRAME_HEADER_SIZE 12
+#define FRAME_END 0x1
+#define OP_W24FN 3
+
+// Shared state for the connection benchmark
+static atomic_long completed_connections;
+static atomic_long failed_connections;
+static volatile int benchmark_running = 1;
+static const char *benchmark_command = "dirlist -a";
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to_server(void) {
+    int client_socket;
+    struct sockaddr_in server_addr;
+
+    if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    memset(&(server_addr.sin_zero), '\0', 8);
+
+    if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
+        close(client_socket);
+        return -1;
+    }
+    return client_socket;
+}
+
+// Each client thread repeatedly connects, issues one command, reads the reply and disconnects
+static void *connection_client(void *arg) {
+    char buffer[MAXDATASIZE];
+    (void)arg;
+
+    while (benchmark_running) {
+        int client_socket = connect_to_server();
+        if (client_socket == -1) {
+            atomic_fetch_add(&failed_connections, 1);
+            continue;
+        }
+        if (send(client_socket, benchmark_command, strlen(benchmark_command), 0) <= 0 ||
+            recv(client_socket, buffer, sizeof(buffer), 0) <= 0) {
+            atomic_fetch_add(&failed_connections, 1);
+        } else {
+            atomic_fetch_add(&completed_connections, 1);
+        }
+        close(client_socket);
+    }
+    return NULL;
+}
+
+// Read the VmRSS line (in kB) of a process from /proc
+static long process_rss_kb(int pid) {
+    char path[64];
+    char line[256];
+    long rss = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            sscanf(line + 6, "%ld", &rss);
+            break;
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+// Sum the RSS of a process and its direct children (the forked connection handlers)
+static long server_rss_kb(int server_pid, int *process_count) {
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    long total = process_rss_kb(server_pid);
+
+    *process_count = 1;
+    if (proc == NULL) {
+        return total;
+    }
+    while ((entry = readdir(proc)) != NULL) {
+        char path[300];
+        char stat_line[512];
+        int pid, ppid;
+        FILE *stat_file;
+
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        stat_file = fopen(path, "r");
+        if (stat_file == NULL) {
+            continue;
+        }
+        if (fgets(stat_line, sizeof(stat_line), stat_file)) {
+            // The command name may contain spaces, so parse after the closing parenthesis
+            char *close_paren = strrchr(stat_line, ')');
+            pid = atoi(stat_line);
+            if (close_paren && sscanf(close_paren + 2, "%*c %d", &ppid) == 1 && ppid == server_pid) {
+                total += process_rss_kb(pid);
+                (*process_count)++;
+            }
+        }
+        fclose(stat_file);
+    }
+    closedir(proc);
+    return total;
+}
+
+static int run_connection_benchmark(int clients, int seconds, int server_pid) {
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    long peak_rss = 0;
+    int peak_processes = 0;
+
+    if (threads == NULL) {
+        return 1;
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < clients; i++) {
+        pthread_create(&threads[i], NULL, connection_client, NULL);
+    }
+
+    // Sample server memory while the load is running
+    while (now_seconds() - start < seconds) {
+        usleep(100000);
+        if (server_pid > 0) {
+            int processes;
+            long rss = server_rss_kb(server_pid, &processes);
+            if (rss > peak_rss) {
+                peak_rss = rss;
+                peak_processes = processes;
+            }
+        }
+    }
+    benchmark_running = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("clients=%d seconds=%.2f completed=%ld failed=%ld connections_per_sec=%.1f\n",
+           clients, elapsed, atomic_load(&completed_connections), atomic_load(&failed_connections),
+           atomic_load(&completed_connections) / elapsed);
+    if (server_pid > 0) {
+        printf("server_peak_rss_kb=%ld processes=%d\n", peak_rss, peak_processes);
+    }
+    free(threads);
+    return 0;
+}
+
+static int receive_all(int client_socket, void *buffer, size_t length) {
+    size_t received = 0;
+
+    while (received < length) {
+        ssize_t n = recv(client_socket, (char *)buffer + received, length - received, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+// Read one framed archive and inflate it, which also checks the gzip CRC and length.
+// Reports the compressed and uncompressed byte counts.
+static int receive_and_inflate(int client_socket, uint64_t *compressed, uint64_t *uncompressed) {
+    static unsigned char chunk[ARCHIVE_CHUNK_SIZE];
+    static unsigned char output[4 * ARCHIVE_CHUNK_SIZE];
+    char magic[ARCHIVE_MAGIC_LENGTH];
+    z_stream zs;
+    int status = Z_OK;
+
+    if (receive_all(client_socket, magic, sizeof(magic)) == -1 || memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0) {
+        return -1;
+    }
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 accepts only the gzip wrapper
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        return -1;
+    }
+    *compressed = 0;
+    *uncompressed = 0;
+    while (1) {
+        uint32_t prefix;
+        if (receive_all(client_socket, &prefix, sizeof(prefix)) == -1) {
+            status = Z_DATA_ERROR;
+            break;
+        }
+        uint32_t length = ntohl(prefix);
+        if (length == 0) {
+            break;
+        }
+        if (length > ARCHIVE_CHUNK_SIZE || receive_all(client_socket, chunk, length) == -1) {
+            status = Z_DATA_ERROR;
+            break;
+        }
+        *compressed += length;
+        zs.next_in = chunk;
+        zs.avail_in = length;
+        while (zs.avail_in > 0 && status == Z_OK) {
+            zs.next_out = output;
+            zs.avail_out = sizeof(output);
+            status = inflate(&zs, Z_NO_FLUSH);
+            *uncompressed += sizeof(output) - zs.avail_out;
+        }
+        if (status != Z_OK && status != Z_STREAM_END) {
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    return status == Z_STREAM_END ? 0 : -1;
+}
+
+// Issue an archive command a number of times and report throughput in MB/s of tar data.
+// Run it against servers started with different --gzip-threads to see how compression scales.
+static int run_archive_benchmark(const char *command, int repeats) {
+    uint64_t total_compressed = 0;
+    uint64_t total_uncompressed = 0;
+
+    double start = now_seconds();
+    for (int i = 0; i < repeats; i++) {
+        uint64_t compressed, uncompressed;
+        int client_socket = connect_to_server();
+        if (client_socket == -1) {
+            fprintf(stderr, "Connection to server failed\n");
+            return 1;
+        }
+        if (send(client_socket, command, strlen(command), 0) <= 0 ||
+            receive_and_inflate(client_socket, &compressed, &uncompressed) == -1) {
+            fprintf(stderr, "Archive %d was not a valid gzip stream\n", i);
+            close(client_socket);
+            return 1;
+        }
+        close(client_socket);
+        total_compressed += compressed;
+        total_uncompressed += uncompressed;
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("command=\"%s\" repeats=%d seconds=%.2f ms_per_request=%.2f tar_bytes=%llu gzip_bytes=%llu ratio=%.3f tar_mb_per_sec=%.1f\n",
+           command, repeats, elapsed, elapsed * 1000 / repeats, (unsigned long long)total_uncompressed, (unsigned long long)total_compressed,
+           total_uncompressed > 0 ? (double)total_compressed / total_uncompressed : 0.0,
+           total_uncompressed / elapsed / (1024 * 1024));
+    return 0;
+}
+
+// CPU time (user + system, in clock ticks) consumed so far by every thread of a process
+static long process_cpu_ticks(int pid) {
+    char path[64];
+    char stat_line[1024];
+    unsigned long utime = 0, stime = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *stat_file = fopen(path, "r");
+    if (stat_file == NULL) {
+        return 0;
+    }
+    if (fgets(stat_line, sizeof(stat_line), stat_file)) {
+        char *close_paren = strrchr(stat_line, ')');
+        // utime and stime are fields 14 and 15; the scan starts at field 3
+        if (close_paren == NULL ||
+            sscanf(close_paren + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+            utime = stime = 0;
+        }
+    }
+    fclose(stat_file);
+    return utime + stime;
+}
+
+// Download a file with "w24fn --content" a number of times and report MB/s. With the
+// server PID (of an epoll-mode server, whose threads do all the work) it also reports
+// the server CPU time per GB, to compare --copy-path sendfile against --copy-path read.
+static int run_download_benchmark(const char *file_name, int repeats, int server_pid) {
+    static char buffer[ARCHIVE_CHUNK_SIZE];
+    char command[MAXDATASIZE];
+    uint64_t total = 0;
+
+    snprintf(command, sizeof(command), "w24fn --content %s", file_name);
+    long start_ticks = server_pid > 0 ? process_cpu_ticks(server_pid) : 0;
+    double start = now_seconds();
+    for (int i = 0; i < repeats; i++) {
+        unsigned char header[FILE_MAGIC_LENGTH + 8];
+        uint64_t remaining = 0;
+        int client_socket = connect_to_server();
+        if (client_socket == -1) {
+            fprintf(stderr, "Connection to server failed\n");
+            return 1;
+        }
+        if (send(client_socket, command, strlen(command), 0) <= 0 ||
+            receive_all(client_socket, header, sizeof(header)) == -1 || memcmp(header, FILE_MAGIC, FILE_MAGIC_LENGTH) != 0) {
+            fprintf(stderr, "Download %d failed\n", i);
+            close(client_socket);
+            return 1;
+        }
+        for (int j = 0; j < 8; j++) {
+            remaining = (remaining << 8) | header[FILE_MAGIC_LENGTH + j];
+        }
+        total += remaining;
+        while (remaining > 0) {
+            ssize_t n = recv(client_socket, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer), 0);
+            if (n <= 0) {
+                fprintf(stderr, "Download %d was cut short\n", i);
+                close(client_socket);
+                return 1;
+            }
+            remaining -= n;
+        }
+        close(client_socket);
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("file=%s repeats=%d seconds=%.2f bytes=%llu mb_per_sec=%.1f\n", file_name, repeats, elapsed,
+           (unsigned long long)total, total / elapsed / (1024 * 1024));
+    if (server_pid > 0 && total > 0) {
+        double cpu_seconds = (double)(process_cpu_ticks(server_pid) - start_ticks) / sysconf(_SC_CLK_TCK);
+        printf("server_cpu_seconds=%.2f server_cpu_ms_per_gb=%.1f\n", cpu_seconds,
+               cpu_seconds * 1000 / (total / (1024.0 * 1024 * 1024)));
+    }
+    return 0;
+}
+
+static int send_frame(int client_socket, unsigned char opcode, uint32_t request_id, const char *payload) {
+    unsigned char frame[FRAME_HEADER_SIZE + MAXDATASIZE] = { opcode };
+    uint32_t length = strlen(payload);
+    uint32_t id = htonl(request_id);
+    uint32_t prefix = htonl(length);
+
+    memcpy(frame + 4, &id, 4);
+    memcpy(frame + 8, &prefix, 4);
+    memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    return send(client_socket, frame, FRAME_HEADER_SIZE + length, 0) == (ssize_t)(FRAME_HEADER_SIZE + length) ? 0 : -1;
+}
+
+// Issue w24fn lookups over one framed connection, keeping up to depth of them in
+// flight, and report lookups/sec. Depth 1 is the request/response lockstep of the
+// text protocol.
+static int run_pipeline_benchmark(const char *file_name, int requests, int depth) {
+    static char payload[ARCHIVE_CHUNK_SIZE];
+    unsigned char version = PROTOCOL_FRAMED;
+    int sent = 0, completed = 0;
+    int client_socket = connect_to_server();
+
+    if (client_socket == -1) {
+        fprintf(stderr, "Connection to server failed\n");
+        return 1;
+    }
+    if (send(client_socket, &version, 1, 0) != 1 || receive_all(client_socket, &version, 1) == -1 || version != PROTOCOL_FRAMED) {
+        fprintf(stderr, "Server does not speak the framed protocol\n");
+        close(client_socket);
+        return 1;
+    }
+
+    double start = now_seconds();
+    while (completed < requests) {
+        while (sent < requests && sent - completed < depth) {
+            if (send_frame(client_socket, OP_W24FN, sent, file_name) == -1) {
+                fprintf(stderr, "Send failed\n");
+                close(client_socket);
+                return 1;
+            }
+            sent++;
+        }
+        unsigned char header[FRAME_HEADER_SIZE];
+        uint32_t length;
+        if (receive_all(client_socket, header, sizeof(header)) == -1) {
+            fprintf(stderr, "Connection closed after %d responses\n", completed);
+            close(client_socket);
+            return 1;
+        }
+        memcpy(&length, header + 8, 4);
+        length = ntohl(length);
+        if (length > sizeof(payload) || receive_all(client_socket, payload, length) == -1) {
+            fprintf(stderr, "Malformed frame\n");
+            close(client_socket);
+            return 1;
+        }
+        if (header[1] & FRAME_END) {
+            completed++;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    close(client_socket);
+
+    printf("file=%s requests=%d depth=%d seconds=%.3f lookups_per_sec=%.1f\n", file_name, requests, depth, elapsed,
+           requests / elapsed);
+    return 0;
+}
+
+// Settings and results of the mixed-workload benchmark
+static int mixed_heavy_percent;
+static const char *mixed_light_command;
+static const char *mixed_heavy_command;
+
+struct latency_samples {
+    double *values;
+    size_t count;
+    size_t capacity;
+};
+
+struct mixed_client {
+    pthread_t thread;
+    unsigned int seed;
+    int heavy_percent;
+    struct latency_samples light;
+    struct latency_samples heavy;
+    long failed;
+    long refused;
+};
+
+static void latency_push(struct latency_samples *samples, double value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        double *values = realloc(samples->values, capacity * sizeof(double));
+        if (values == NULL) {
+            return;
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(struct latency_samples *samples, int pct) {
+    if (samples->count == 0) {
+        return 0;
+    }
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    size_t index = samples->count * pct / 100;
+    return samples->values[index < samples->count ? index : samples->count - 1];
+}
+
+// Read one whole reply: an archive stream up to its empty chunk, or one text message.
+// Returns 1 if the server refused the command as busy.
+static int receive_reply(int client_socket) {
+    char buffer[ARCHIVE_CHUNK_SIZE];
+    char first;
+
+    if (recv(client_socket, &first, 1, MSG_PEEK) != 1) {
+        return -1;
+    }
+    if (first != '\0') {
+        ssize_t length = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (length <= 0) {
+            return -1;
+        }
+        return length >= 4 && memcmp(buffer, "Busy", 4) == 0 ? 1 : 0;
+    }
+    if (receive_all(client_socket, buffer, ARCHIVE_MAGIC_LENGTH) == -1) {
+        return -1;
+    }
+    while (1) {
+        uint32_t prefix;
+        if (receive_all(client_socket, &prefix, sizeof(prefix)) == -1) {
+            return -1;
+        }
+        uint32_t length = ntohl(prefix);
+        if (length == 0) {
+            return 0;
+        }
+        if (length > sizeof(buffer) || receive_all(client_socket, buffer, length) == -1) {
+            return -1;
+        }
+    }
+}
+
+static void *mixed_client_main(void *arg) {
+    struct mixed_client *client = arg;
+
+    while (benchmark_running) {
+        bool heavy = (int)(rand_r(&client->seed) % 100) < client->heavy_percent;
+        const char *command = heavy ? mixed_heavy_command : mixed_light_command;
+        double start = now_seconds();
+        int client_socket = connect_to_server();
+        if (client_socket == -1) {
+            client->failed++;
+            continue;
+        }
+        int result = send(client_socket, command, strlen(command), 0) <= 0 ? -1 : receive_reply(client_socket);
+        if (result == -1) {
+            client->failed++;
+        } else if (result == 1) {
+            client->refused++;
+            usleep(10000);
+        } else {
+            latency_push(heavy ? &client->heavy : &client->light, (now_seconds() - start) * 1000);
+        }
+        close(client_socket);
+    }
+    return NULL;
+}
+
+// Run the clients for the given time and merge their latencies into light and heavy.
+// Each client draws its commands by its own heavy_percent.
+static double run_mixed_clients(struct mixed_client *threads, int clients, int seconds, struct latency_samples *light,
+                                struct latency_samples *heavy, long *failed, long *refused) {
+    double start = now_seconds();
+    for (int i = 0; i < clients; i++) {
+        threads[i].seed = i + 1;
+        pthread_create(&threads[i].thread, NULL, mixed_client_main, &threads[i]);
+    }
+    while (now_seconds() - start < seconds) {
+        usleep(100000);
+    }
+    benchmark_running = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (size_t j = 0; j < threads[i].light.count; j++) {
+            latency_push(light, threads[i].light.values[j]);
+        }
+        for (size_t j = 0; j < threads[i].heavy.count; j++) {
+            latency_push(heavy, threads[i].heavy.values[j]);
+        }
+        *failed += threads[i].failed;
+        *refused += threads[i].refused;
+        free(threads[i].light.values);
+        free(threads[i].heavy.values);
+    }
+    return now_seconds() - start;
+}
+
+// Run a skewed mix of cheap and expensive commands and report the latency of each
+// class. Run it against servers started with each --routing policy to compare them.
+static int run_mixed_benchmark(int clients, int seconds) {
+    struct mixed_client *threads = calloc(clients, sizeof(struct mixed_client));
+    struct latency_samples light = { 0 }, heavy = { 0 };
+    long failed = 0, refused = 0;
+
+    if (threads == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < clients; i++) {
+        threads[i].heavy_percent = mixed_heavy_percent;
+    }
+    double elapsed = run_mixed_clients(threads, clients, seconds, &light, &heavy, &failed, &refused);
+
+    printf("clients=%d seconds=%.2f heavy_percent=%d completed=%zu failed=%ld refused=%ld requests_per_sec=%.1f\n", clients,
+           elapsed, mixed_heavy_percent, light.count + heavy.count, failed, refused, (light.count + heavy.count) / elapsed);
+    printf("light: count=%zu p50_ms=%.2f p99_ms=%.2f\n", light.count, percentile(&light, 50), percentile(&light, 99));
+    printf("heavy: count=%zu p50_ms=%.2f p99_ms=%.2f\n", heavy.count, percentile(&heavy, 50), percentile(&heavy, 99));
+    free(light.values);
+    free(heavy.values);
+    free(threads);
+    return 0;
+}
+
+// Keep N archive jobs running back to back while one client issues interactive commands
+// one after another, and report the interactive latency. Compare against jobs=0.
+static int run_background_benchmark(int jobs, int seconds) {
+    struct mixed_client *threads = calloc(jobs + 1, sizeof(struct mixed_client));
+    struct latency_samples light = { 0 }, heavy = { 0 };
+    long failed = 0, refused = 0;
+
+    if (threads == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < jobs; i++) {
+        threads[i].heavy_percent = 100;
+    }
+    double elapsed = run_mixed_clients(threads, jobs + 1, seconds, &light, &heavy, &failed, &refused);
+
+    printf("jobs=%d seconds=%.2f archives=%zu refused=%ld failed=%ld\n", jobs, elapsed, heavy.count, refused, failed);
+    printf("interactive: count=%zu p50_ms=%.2f p99_ms=%.2f max_ms=%.2f\n", light.count, percentile(&light, 50),
+           percentile(&light, 99), percentile(&light, 100));
+    printf("archive: p50_ms=%.2f p99_ms=%.2f\n", percentile(&heavy, 50), percentile(&heavy, 99));
+    free(light.values);
+    free(heavy.values);
+    free(threads);
+    return 0;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s conn <clients> <seconds> [server_pid] [command]\n", program);
+    fprintf(stderr, "       %s archive <command> [repeats]\n", program);
+    fprintf(stderr, "       %s download <filename> [repeats] [server_pid]\n", program);
+    fprintf(stderr, "       %s pipeline <filename> <requests> <depth>\n", program);
+    fprintf(stderr, "       %s mixed <clients> <seconds> <heavy_percent> <light_command> <heavy_command>\n", program);
+    fprintf(stderr, "       %s background <archive_jobs> <seconds> <interactive_command> <archive_command>\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 4 && strcmp(argv[1], "conn") == 0) {
+        int server_pid = argc >= 5 ? atoi(argv[4]) : 0;
+        if (argc >= 6) {
+            benchmark_command = argv[5];
+        }
+        return run_connection_benchmark(atoi(argv[2]), atoi(argv[3]), server_pid);
+    }
+    if (argc >= 3 && strcmp(argv[1], "archive") == 0) {
+        return run_archive_benchmark(argv[2], argc >= 4 ? atoi(argv[3]) : 1);
+    }
+    if (argc >= 3 && strcmp(argv[1], "download") == 0) {
+        return run_download_benchmark(argv[2], argc >= 4 ? atoi(argv[3]) : 1, argc >= 5 ? atoi(argv[4]) : 0);
+    }
+    if (argc >= 5 && strcmp(argv[1], "pipeline") == 0) {
+        return run_pipeline_benchmark(argv[2], atoi(argv[3]), atoi(argv[4]));
+    }
+    if (argc >= 7 && strcmp(argv[1], "mixed") == 0) {
+        mixed_heavy_percent = atoi(argv[4]);
+        mixed_light_command = argv[5];
+        mixed_heavy_command = argv[6];
+        return run_mixed_benchmark(atoi(argv[2]), atoi(argv[3]));
+    }
+    if (argc >= 6 && strcmp(argv[1], "background") == 0) {
+        mixed_light_command = argv[4];
+        mixed_heavy_command = argv[5];
+        return run_background_benchmark(atoi(argv[2]), atoi(argv[3]));
+    }
+
+    print_usage(argv[0]);
+    return 1;
+}
@@ -10,6 +10,190 @@
 #define SERVER_IP "127.0.0.1" // localhost
 #define PORT 8888
 #define MAXDATASIZE 1024
+#define STATS_MAXSIZE 4096
+#define ARCHIVE_MAGIC "\0W24TGZ\n"
+#define ARCHIVE_MAGIC_LENGTH 8
+#define ARCHIVE_FILE "temp.tar.gz"
+#define FILE_MAGIC "\0W24FIL\n"
+#define FILE_MAGIC_LENGTH 8
+#define LISTING_MAGIC "\0W24LST\n"
+#define LISTING_MAGIC_LENGTH 8
+#define NAME_MAX_LENGTH 255
+
+// Bytes already received from the server but not yet consumed
+struct receive_buffer {
+    char data[MAXDATASIZE];
+    int length;
+    int offset;
+};
+
+// Read exactly length bytes, draining the receive buffer before the socket
+int receive_exact(int client_socket, struct receive_buffer *pending, void *out, size_t length) {
+    char *dest = out;
+
+    while (length > 0) {
+        if (pending->offset == pending->length) {
+            pending->length = recv(client_socket, pending->data, sizeof(pending->data), 0);
+            pending->offset = 0;
+            if (pending->length <= 0) {
+                pending->length = 0;
+                return -1;
+            }
+        }
+        size_t available = pending->length - pending->offset;
+        size_t take = available < length ? available : length;
+        memcpy(dest, pending->data + pending->offset, take);
+        pending->offset += take;
+        dest += take;
+        length -= take;
+    }
+    return 0;
+}
+
+// Save a chunked archive stream (magic, then length-prefixed chunks ending with an empty one)
+int receive_archive(int client_socket, const char *first, int first_length, const char *file_name) {
+    struct receive_buffer pending;
+    char magic[ARCHIVE_MAGIC_LENGTH];
+    char chunk[MAXDATASIZE];
+    unsigned char prefix[4];
+
+    memcpy(pending.data, first, first_length);
+    pending.length = first_length;
+    pending.offset = 0;
+
+    if (receive_exact(client_socket, &pending, magic, sizeof(magic)) == -1 || memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "Malformed archive response\n");
+        return -1;
+    }
+
+    FILE *archive = fopen(file_name, "wb");
+    if (archive == NULL) {
+        perror("Failed to create archive file");
+    }
+
+    while (1) {
+        if (receive_exact(client_socket, &pending, prefix, sizeof(prefix)) == -1) {
+            perror("Failed to receive");
+            break;
+        }
+        size_t remaining = ((size_t)prefix[0] << 24) | (prefix[1] << 16) | (prefix[2] << 8) | prefix[3];
+        if (remaining == 0) {
+            if (archive != NULL) {
+                fclose(archive);
+            }
+            return archive != NULL ? 0 : -1;
+        }
+        while (remaining > 0) {
+            size_t take = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+            if (receive_exact(client_socket, &pending, chunk, take) == -1) {
+                perror("Failed to receive");
+                remaining = 0;
+                break;
+            }
+            if (archive != NULL) {
+                fwrite(chunk, 1, take, archive);
+            }
+            remaining -= take;
+        }
+    }
+
+    if (archive != NULL) {
+        fclose(archive);
+    }
+    return -1;
+}
+
+// Save a downloaded file (magic, 64-bit big-endian size, then the raw contents)
+int receive_file(int client_socket, const char *first, int first_length, const char *file_name) {
+    struct receive_buffer pending;
+    unsigned char header[FILE_MAGIC_LENGTH + 8];
+    char chunk[MAXDATASIZE];
+
+    memcpy(pending.data, first, first_length);
+    pending.length = first_length;
+    pending.offset = 0;
+
+    if (receive_exact(client_socket, &pending, header, sizeof(header)) == -1 || memcmp(header, FILE_MAGIC, FILE_MAGIC_LENGTH) != 0) {
+        fprintf(stderr, "Malformed file response\n");
+        return -1;
+    }
+    unsigned long long remaining = 0;
+    for (int i = 0; i < 8; i++) {
+        remaining = (remaining << 8) | header[FILE_MAGIC_LENGTH + i];
+    }
+
+    // The whole body still has to be drained so the connection stays usable
+    FILE *file = fopen(file_name, "wb");
+    if (file == NULL) {
+        perror("Failed to create file");
+    }
+    while (remaining > 0) {
+        size_t take = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+        if (receive_exact(client_socket, &pending, chunk, take) == -1) {
+            perror("Failed to receive");
+            break;
+        }
+        if (file != NULL) {
+            fwrite(chunk, 1, take, file);
+        }
+        remaining -= take;
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return file != NULL && remaining == 0 ? 0 : -1;
+}
+
+// Print a chunked directory listing (magic, then length-prefixed chunks of names ending with an
+// empty one). Returns the number of names and leaves the last one in last, or returns -1.
+long receive_listing(int client_socket, const char *first, int first_length, char *last) {
+    struct receive_buffer pending;
+    char magic[LISTING_MAGIC_LENGTH];
+    char chunk[MAXDATASIZE];
+    unsigned char prefix[4];
+    char line[NAME_MAX_LENGTH + 1];
+    size_t line_length = 0;
+    long count = 0;
+
+    memcpy(pending.data, first, first_length);
+    pending.length = first_length;
+    pending.offset = 0;
+
+    if (receive_exact(client_socket, &pending, magic, sizeof(magic)) == -1 || memcmp(magic, LISTING_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "Malformed listing response\n");
+        return -1;
+    }
+    while (1) {
+        if (receive_exact(client_socket, &pending, prefix, sizeof(prefix)) == -1) {
+            perror("Failed to receive");
+            return -1;
+        }
+        size_t remaining = ((size_t)prefix[0] << 24) | (prefix[1] << 16) | (prefix[2] << 8) | prefix[3];
+        if (remaining == 0) {
+            return count;
+        }
+        while (remaining > 0) {
+            size_t take = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+            if (receive_exact(client_socket, &pending, chunk, take) == -1) {
+                perror("Failed to receive");
+                return -1;
+            }
+            fwrite(chunk, 1, take, stdout);
+            // Remember the last name, which is the cursor for the next page
+            for (size_t i = 0; i < take; i++) {
+                if (chunk[i] == '\n') {
+                    line[line_length] = '\0';
+                    memcpy(last, line, line_length + 1);
+                    line_length = 0;
+                    count++;
+                } else if (line_length < NAME_MAX_LENGTH) {
+                    line[line_length++] = chunk[i];
+                }
+            }
+            remaining -= take;
+        }
+    }
+}
 
 // Function to send commands to the server and receive responses
 void send_command_to_server(int client_socket, const char *command) {
@@ -23,62 +207,138 @@ void send_command_to_server(int client_socket, const char *command) {
     if (strcmp(command, "quitc") == 0) {
         return; // No need to receive response for quit command
     }
+    else if (strcmp(command, "dirlist -a") == 0 || strncmp(command, "dirlist -a ", 11) == 0 || strcmp(command, "dirlist -t") == 0) {
+        // The listing is streamed; a page that came back full may have more entries after it
+        char last[NAME_MAX_LENGTH + 1] = "";
+        long limit = 0;
+        bytes_received = recv(client_socket, buffer, MAXDATASIZE - 1, 0);
+        if (bytes_received <= 0) {
+            perror("Failed to receive");
+            return;
+        }
+        if (buffer[0] != '\0') {
+            buffer[bytes_received] = '\0';
+            printf("Response from server: %s\n", buffer);
+            return;
+        }
+        long count = receive_listing(client_socket, buffer, bytes_received, last);
+        sscanf(command, "dirlist -a --limit %ld", &limit);
+        if (limit > 0 && count == limit) {
+            printf("Next page: dirlist -a --limit %ld --after %s\n", limit, last);
+        }
+    }
     else if (strncmp(command, "w24fz ", 6) == 0) {
         // Handle w24fz response separately
-        bytes_received = recv(client_socket, buffer, MAXDATASIZE, 0);
+        bytes_received = recv(client_socket, buffer, MAXDATASIZE - 1, 0);
         if (bytes_received <= 0) {
             perror("Failed to receive");
             return;
         }
+        if (buffer[0] == '\0') {
+            if (receive_archive(client_socket, buffer, bytes_received, ARCHIVE_FILE) == 0) {
+                printf("TAR file received and saved as %s\n", ARCHIVE_FILE);
+            }
+            return;
+        }
         buffer[bytes_received] = '\0';
         if (strcmp(buffer, "No file found") == 0) {
             printf("No file found within the specified size range.\n");
+        } else if (strncmp(buffer, "Busy", 4) == 0) {
+            printf("%s\n", buffer);
         } else {
             printf("TAR file created\n");
         }
     }
     else if (strncmp(command, "w24ft ", 6) == 0) {
         // Handle w24ft response separately
-        bytes_received = recv(client_socket, buffer, MAXDATASIZE, 0);
+        bytes_received = recv(client_socket, buffer, MAXDATASIZE - 1, 0);
         if (bytes_received <= 0) {
             perror("Failed to receive");
             return;
         }
+        if (buffer[0] == '\0') {
+            if (receive_archive(client_socket, buffer, bytes_received, ARCHIVE_FILE) == 0) {
+                printf("Archive received and saved as %s\n", ARCHIVE_FILE);
+            }
+            return;
+        }
         buffer[bytes_received] = '\0';
         if (strcmp(buffer, "No file found") == 0) {
             printf("No files found matching the specified extensions.\n");
+        } else if (strncmp(buffer, "Busy", 4) == 0) {
+            printf("%s\n", buffer);
         } else {
             printf("Archive created\n");
         }
     }
     else if (strncmp(command, "w24fn ", 6) == 0) {
         // Handle w24fn response separately
-        bytes_received = recv(client_socket, buffer, MAXDATASIZE, 0);
+        bytes_received = recv(client_socket, buffer, MAXDATASIZE - 1, 0);
         if (bytes_received <= 0) {
             perror("Failed to receive");
             return;
         }
+        if (buffer[0] == '\0') {
+            // "w24fn --content <filename>" downloads the file into the current directory
+            char file_name[MAXDATASIZE];
+            const char *slash;
+            sscanf(command + 16, "%s", file_name);
+            slash = strrchr(file_name, '/');
+            if (receive_file(client_socket, buffer, bytes_received, slash != NULL ? slash + 1 : file_name) == 0) {
+                printf("File received and saved as %s\n", slash != NULL ? slash + 1 : file_name);
+            }
+            return;
+        }
         buffer[bytes_received] = '\0';
         if (strcmp(buffer, "No file found") == 0) {
             printf("No files found matching the specified extensions.\n");
+        } else if (strncmp(buffer, "Busy", 4) == 0) {
+            printf("%s\n", buffer);
         } else {
         printf("File contents:\n%s\n", buffer);
         }
     }
-    else if (strncmp(command, "w24fdb ", 7) == 0 || strncmp(command, "w24fda ", 7) == 0) {
-        // Handle w24fdb/w24fda response separately
-        bytes_received = recv(client_socket, buffer, MAXDATASIZE, 0);
+    else if (strncmp(command, "w24fdb ", 7) == 0 || strncmp(command, "w24fda ", 7) == 0 || strncmp(command, "w24fdr ", 7) == 0) {
+        // Handle w24fdb/w24fda/w24fdr response separately
+        bytes_received = recv(client_socket, buffer, MAXDATASIZE - 1, 0);
         if (bytes_received <= 0) {
             perror("Failed to receive");
             return;
         }
+        if (buffer[0] == '\0') {
+            if (receive_archive(client_socket, buffer, bytes_received, ARCHIVE_FILE) == 0) {
+                printf("TAR file received and saved as %s\n", ARCHIVE_FILE);
+            }
+            return;
+        }
         buffer[bytes_received] = '\0';
-        if (strcmp(buffer, "No files found with the specified creation date or earlier.") == 0 || strcmp(buffer, "No files found with the specified creation date or later.") == 0) {
+        if (strcmp(buffer, "No files found with the specified creation date or earlier.") == 0 || strcmp(buffer, "No files found with the specified creation date or later.") == 0 ||
+            strcmp(buffer, "No files found with the specified creation date range.") == 0) {
             printf("No files found with the specified creation date.\n");
+        } else if (strncmp(buffer, "Invalid date", 12) == 0 || strncmp(buffer, "Busy", 4) == 0) {
+            printf("%s\n", buffer);
         } else {
             printf("TAR file received and saved as temp.tar.gz\n");
         }
     }
+    else if (strcmp(command, "w24stats") == 0) {
+        // The report can be longer than one receive; its last line is io_backend
+        char report[STATS_MAXSIZE];
+        size_t length = 0;
+        while (length < sizeof(report) - 1) {
+            bytes_received = recv(client_socket, report + length, sizeof(report) - 1 - length, 0);
+            if (bytes_received <= 0) {
+                perror("Failed to receive");
+                return;
+            }
+            length += bytes_received;
+            report[length] = '\0';
+            if (strncmp(report, "Busy", 4) == 0 || (strstr(report, "io_backend=") != NULL && report[length - 1] == '\n')) {
+                break;
+            }
+        }
+        printf("Response from server: %s\n", report);
+    }
     else {
         // Receive response from server for other commands
         bytes_received = recv(client_socket, buffer, MAXDATASIZE, 0);
@@ -122,7 +382,7 @@ int main() {
         command[strcspn(command, "\n")] = '\0';
 
         // Validate command syntax
-        if (strcmp(command, "dirlist -a") != 0 && strcmp(command, "dirlist -t") != 0 && strcmp(command, "quitc") != 0 && strncmp(command, "w24fn ", 6) != 0 && strncmp(command, "w24fz ", 6) != 0 && strncmp(command, "w24ft ", 6) != 0 && strncmp(command, "w24fdb ", 7) != 0 && strncmp(command, "w24fda ", 7) != 0) {
+        if (strcmp(command, "dirlist -a") != 0 && strncmp(command, "dirlist -a ", 11) != 0 && strcmp(command, "dirlist -t") != 0 && strcmp(command, "quitc") != 0 && strcmp(command, "w24stats") != 0 && strncmp(command, "w24fn ", 6) != 0 && strncmp(command, "w24fz ", 6) != 0 && strncmp(command, "w24ft ", 6) != 0 && strncmp(command, "w24fdb ", 7) != 0 && strncmp(command, "w24fda ", 7) != 0 && strncmp(command, "w24fdr ", 7) != 0 && strncmp(command, "w24fs ", 6) != 0) {
             printf("Invalid command. Please enter a valid command\n");
             continue;
         }
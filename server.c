@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -16,19 +18,57 @@
 #include <sys/wait.h>
 #include <pthread.h> 
 #include <stdarg.h> 
-
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <zlib.h>
+
+// mirror1.c and mirror2.c build this file with their own port and name
+#ifndef PORT
 #define PORT 8888
-#define BACKLOG 5
+#endif
+#ifndef SERVER_NAME
+#define SERVER_NAME "Serverw24"
+#endif
+#define BACKLOG 128
+#define EPOLL_BACKLOG 1024
+#define EPOLL_MAX_EVENTS 64
+#define WORK_QUEUE_CAPACITY 256
 #define MAXDATASIZE 1024
+#define STATS_MAXSIZE 4096          // A w24stats report with every counter and histogram at its widest
 #define MIRROR1_IP "127.0.0.1"
 #define MIRROR1_PORT 8889
 #define MIRROR2_IP "127.0.0.1"
 #define MIRROR2_PORT 8890
+#define MIRROR_POOL_SIZE 4          // Connections kept open to each mirror
+#define MIRROR_HEALTH_INTERVAL 5    // Seconds a connection may sit idle before it is pinged
+#define MIRROR_HEALTH_TIMEOUT 2     // Seconds a ping may take before the connection is dropped
+#define MIRROR_RETRY_INTERVAL 1     // Seconds before redialling a mirror that could not be reached
+#define MIRROR_CLIENT_QUEUE (8 * 1024 * 1024) // Response bytes a slow client may fall behind before it is cut off
 #define MAX_PATH_LENGTH_LENGTH 512
-#define TAR_COMMAND "tar -czf"
 #define DATE_FORMAT "%Y-%m-%d"
+#define INVALID_DATE_MESSAGE "Invalid date. Use YYYY-MM-DD."
 #define MAX_PATH_LENGTH 1024
+#ifndef LOG_FILE
 #define LOG_FILE "server.log"
+#endif
+#define LOG_RING_SIZE 65536         // Per-thread log buffer; a power of two
+#define LOG_LINE_MAX 1024           // Longer messages are truncated
+#define LOG_FLUSH_INTERVAL_MS 20
+#define LOG_BATCH_RINGS 64          // Rings written with one writev()
+#define LOG_ROTATE_BYTES (64L * 1024 * 1024)
+#define LOG_ROTATE_KEEP 3           // Rotated files kept: LOG_FILE.1 (newest) to LOG_FILE.3
 
 // Function declarations
 void *handle_client(void *arg);
@@ -38,21 +78,62 @@ void handle_w24fz(int client_socket, long size1, long size2);
 void handle_w24ft(int client_socket, const char *extensions);
 void handle_w24fdb(int client_socket, const char *date);
 void handle_w24fda(int client_socket, const char *date);
-void handleDirectoryListing(int client_socket);
+void handle_w24fdr(int client_socket, const char *dates);
+void handle_w24fs(int client_socket, const char *arguments);
+void handleDirectoryListing(int client_socket, const char *options);
 char *redirect_destination(int connection_count);
-int compare_creation_time(const void *a, const void *b);
+int compare_strings(const void *a, const void *b);
 void create_tar_archive(const char *criteria);
-bool search_file(const char *path, const char *filename, char *response);
-int search_files_by_date_recursive(const char *dir_path, time_t target_date, FILE *output_file);
-int is_file_newer_or_equal(const char *file_path, time_t target_date);
+bool search_file(const char *path, const char *filename, char *response, char *found_path);
+void handle_w24fn_content(int client_socket, const char *filename);
+struct tar_stream;
+int search_files_by_date(const char *path, time_t min_time, time_t max_time, struct tar_stream *archive);
+void handle_direct_command(int client_socket, const char *buffer);
+void run_command(int client_socket, const char *buffer);
+void serve_locally(int client_socket, const char *buffer);
+void format_load_report(char *buffer, size_t size);
+void format_route_stats(char *buffer, size_t size);
+void perform_redirection(int client_socket, const char *destination, const char *buffer);
+void dispatch_command(int client_socket, int connection_count, const char *buffer);
+int run_epoll_server(int reactor_count);
+void start_file_index(const char *root);
+bool index_acquire(void);
+void index_release(void);
+long index_generation(void);
+void handle_w24stats(int client_socket);
+void start_result_cache(void);
+void format_cache_stats(char *buffer, size_t size);
+const char *io_backend_name(void);
+void result_capture_append(const void *data, size_t length);
+void result_capture_complete(void);
+int negotiate_protocol(int client_socket, unsigned char requested);
+void run_framed_session(int client_socket, int connection_count, const void *initial, size_t initial_length);
 
 
 
 
 // Enum for log levels
 enum LogLevel { INFO, WARNING, ERROR };
-
-// Function to determine redirection destination based on connection count
+void log_message(enum LogLevel level, const char *format, ...);
+
+// Enum for the connection handling model selected at startup
+enum ServerMode { MODE_FORK, MODE_EPOLL };
+
+// Enum for the admission lanes commands are sorted into by expected cost
+enum Lane { LANE_INTERACTIVE, LANE_HEAVY, LANES };
+enum Lane command_lane(const char *command);
+int lane_enter(enum Lane l, char *response, size_t size);
+void lane_leave(enum Lane l, int slot, long service_us);
+void lane_refuse(enum Lane l, int queued, char *response, size_t size);
+void start_lanes(void);
+void format_lane_stats(char *buffer, size_t size);
+void lane_lower_priority(void);
+void lane_run_command(enum Lane l, int client_socket, const char *command);
+bool lane_should_yield(void);
+void lane_yield(long *slice_started_us);
+
+// Function to determine redirection destination based on connection count.
+// This is the "rotation" routing policy; the load-aware ones are below.
 char *redirect_destination(int connection_count) {
     if (connection_count < 3 ) {
         return NULL; // Don't redirect first three connections
@@ -72,816 +153,7830 @@ char *redirect_destination(int connection_count) {
     }
 }
 
+// ---------------------------------------------------------------------------
+// Load-aware routing
+//
+// Each command is routed to one of three backends: this server or one of the
+// mirrors. The routing policy is chosen at startup:
+//
+//   rotation           the original fixed schedule by connection number
+//   least-outstanding  the backend with the fewest commands in flight or queued
+//   p2c                power of two choices: sample two backends and take the
+//                      one with the lower (outstanding + 1) * (p99 + 1)
+//
+// Outstanding counts are kept here, so they cover every command this server has
+// routed. Queue depth and p99 latency come from each backend itself: mirrors
+// report theirs in answer to the monitor's pings, and the local ones are read
+// directly. A mirror that has not reported recently is skipped. The counters live
+// in shared memory so that forked connection handlers all see and update them.
+// ---------------------------------------------------------------------------
+
+#define ROUTE_BACKENDS 3
+#define LATENCY_WINDOW 1024          // Recent local command latencies kept for the p99
+#define ROUTE_POLL_INTERVAL_MS 250   // How often the monitor asks each mirror for its load
+#define ROUTE_REPORT_TTL_MS 1000     // A mirror is skipped once its last report is older than this
+
+enum Backend { BACKEND_LOCAL, BACKEND_MIRROR1, BACKEND_MIRROR2 };
+enum RoutingPolicy { ROUTE_ROTATION, ROUTE_LEAST_OUTSTANDING, ROUTE_P2C };
+
+static const char *const backend_names[ROUTE_BACKENDS] = { "Serverw24", "Mirror1", "Mirror2" };
+
+struct backend_load {
+    atomic_int outstanding;       // Commands routed here that have not finished
+    atomic_int reported_inflight;
+    atomic_int reported_queue;
+    atomic_long reported_p99_us;
+    atomic_long reported_at_us;   // 0 until the first report, and after a failure
+    atomic_long routed;
+};
+
+struct route_stats {
+    struct backend_load backends[ROUTE_BACKENDS];
+    atomic_uint latency_next;
+    atomic_uint latency_us[LATENCY_WINDOW];
+};
+
+static struct route_stats *route_stats;
+static enum RoutingPolicy routing_policy = ROUTE_LEAST_OUTSTANDING;
+static const char *const routing_policy_names[] = { "rotation", "least-outstanding", "p2c" };
+
+static long monotonic_us(void);
+int epoll_queue_depth(void);
+int epoll_lane_queue_depth(enum Lane l);
+
+void start_route_stats(void) {
+    route_stats = mmap(NULL, sizeof(struct route_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (route_stats == MAP_FAILED) {
+        perror("Routing statistics allocation failed");
+        route_stats = NULL;
+        return;
+    }
+    memset(route_stats, 0, sizeof(struct route_stats));
+    // The local backend is always available
+    atomic_store(&route_stats->backends[BACKEND_LOCAL].reported_at_us, LONG_MAX);
+}
 
+static void record_local_latency(long latency_us) {
+    unsigned int slot = atomic_fetch_add(&route_stats->latency_next, 1) % LATENCY_WINDOW;
+    atomic_store(&route_stats->latency_us[slot], latency_us > UINT_MAX ? UINT_MAX : (unsigned int)latency_us);
+}
 
-bool search_file(const char *path, const char *filename, char *response) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
+static int compare_latency(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
 
-    dir = opendir(path);
-    if (dir == NULL) {
-        perror("Error opening directory");
-        return false;
+// 99th percentile of the recent local command latencies
+long local_p99_us(void) {
+    unsigned int samples[LATENCY_WINDOW];
+    unsigned int count;
+
+    if (route_stats == NULL) {
+        return 0;
+    }
+    count = atomic_load(&route_stats->latency_next);
+    if (count > LATENCY_WINDOW) {
+        count = LATENCY_WINDOW;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        samples[i] = atomic_load(&route_stats->latency_us[i]);
     }
+    qsort(samples, count, sizeof(samples[0]), compare_latency);
+    return samples[(count * 99) / 100 < count ? (count * 99) / 100 : count - 1];
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        char full_path[MAXDATASIZE];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+// The load report a mirror sends in answer to a ping: "inflight queue p99_us"
+void format_load_report(char *buffer, size_t size) {
+    int inflight = route_stats ? atomic_load(&route_stats->backends[BACKEND_LOCAL].outstanding) : 0;
+    snprintf(buffer, size, "%d %d %ld", inflight, epoll_queue_depth(), local_p99_us());
+}
 
-        if (strcmp(entry->d_name, filename) == 0 && stat(full_path, &file_stat) == 0) {
-            // Construct response string with filename, size, date created, and permissions
-            snprintf(response, MAXDATASIZE, "Filename: %s\nSize: %ld bytes\nDate created: %s\nPermissions: %o", entry->d_name, file_stat.st_size, ctime(&file_stat.st_mtime), file_stat.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
-            closedir(dir);
-            return true;
+// Run a command on this server once its lane admits it, keeping its load and latency statistics
+void serve_locally(int client_socket, const char *buffer) {
+    enum Lane lane = command_lane(buffer);
+    char response[MAXDATASIZE];
+    int slot = lane_enter(lane, response, sizeof(response));
+    long start = monotonic_us();
+
+    if (slot == -1) {
+        send(client_socket, response, strlen(response), MSG_NOSIGNAL);
+        return;
+    }
+    if (route_stats == NULL) {
+        lane_run_command(lane, client_socket, buffer);
+    } else {
+        atomic_fetch_add(&route_stats->backends[BACKEND_LOCAL].outstanding, 1);
+        lane_run_command(lane, client_socket, buffer);
+        record_local_latency(monotonic_us() - start);
+        atomic_fetch_sub(&route_stats->backends[BACKEND_LOCAL].outstanding, 1);
+    }
+    lane_leave(lane, slot, monotonic_us() - start);
+}
+
+static bool backend_available(int backend, long now_us) {
+    return now_us - atomic_load(&route_stats->backends[backend].reported_at_us) < ROUTE_REPORT_TTL_MS * 1000L;
+}
+
+static long backend_queue(int backend) {
+    struct backend_load *load = &route_stats->backends[backend];
+    return atomic_load(&load->outstanding) + (backend == BACKEND_LOCAL ? epoll_queue_depth() : atomic_load(&load->reported_queue));
+}
+
+static long backend_p99_us(int backend) {
+    return backend == BACKEND_LOCAL ? local_p99_us() : atomic_load(&route_stats->backends[backend].reported_p99_us);
+}
+
+static unsigned int route_random(void) {
+    static __thread unsigned int seed;
+
+    if (seed == 0) {
+        seed = (unsigned int)monotonic_us() ^ (unsigned int)pthread_self() ^ (unsigned int)getpid();
+    }
+    return rand_r(&seed);
+}
+
+// Pick the backend for one command
+int route_command(int connection_count) {
+    int candidates[ROUTE_BACKENDS];
+    int count = 0;
+    int choice = BACKEND_LOCAL;
+    long now = monotonic_us();
+
+    if (route_stats == NULL || routing_policy == ROUTE_ROTATION) {
+        const char *destination = redirect_destination(connection_count);
+        for (int b = BACKEND_MIRROR1; destination != NULL && b < ROUTE_BACKENDS; b++) {
+            if (strcmp(destination, backend_names[b]) == 0) {
+                choice = b;
+            }
+        }
+        if (route_stats != NULL) {
+            atomic_fetch_add(&route_stats->backends[choice].routed, 1);
+        }
+        return choice;
+    }
+
+    for (int b = 0; b < ROUTE_BACKENDS; b++) {
+        if (backend_available(b, now)) {
+            candidates[count++] = b;
         }
+    }
 
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            // Recursively search subdirectories
-            if (search_file(full_path, filename, response)) {
-                closedir(dir);
-                return true;
+    if (routing_policy == ROUTE_LEAST_OUTSTANDING) {
+        // Ties are broken at random so an idle system still spreads its work
+        long best = LONG_MAX;
+        int ties = 0;
+        for (int i = 0; i < count; i++) {
+            long queue = backend_queue(candidates[i]);
+            if (queue < best) {
+                best = queue;
+                choice = candidates[i];
+                ties = 1;
+            } else if (queue == best && route_random() % ++ties == 0) {
+                choice = candidates[i];
             }
         }
+    } else if (count > 1) {
+        int first = candidates[route_random() % count];
+        int second = candidates[route_random() % (count - 1)];
+        if (second == first) {
+            second = candidates[count - 1];
+        }
+        long first_cost = (backend_queue(first) + 1) * (backend_p99_us(first) + 1);
+        long second_cost = (backend_queue(second) + 1) * (backend_p99_us(second) + 1);
+        choice = first_cost <= second_cost ? first : second;
     }
 
-    closedir(dir);
-    return false;
+    atomic_fetch_add(&route_stats->backends[choice].routed, 1);
+    return choice;
 }
 
-// Function to handle w24fn command
-void handle_w24fn(int client_socket, const char *filename) {
-    char response[MAXDATASIZE];
-    bool file_found = search_file(getenv("HOME"), filename, response);
+// Load figures of every backend, for w24stats
+void format_route_stats(char *buffer, size_t size) {
+#ifdef MIRROR_SERVER
+    // Mirrors do not route, so only their own figures mean anything
+    size_t used = snprintf(buffer, size, "routing_policy=none\n");
+    int backends = 1;
+#else
+    size_t used = snprintf(buffer, size, "routing_policy=%s\n", routing_policy_names[routing_policy]);
+    int backends = ROUTE_BACKENDS;
+#endif
+    long now = monotonic_us();
+
+    for (int b = 0; route_stats != NULL && b < backends && used < size; b++) {
+        struct backend_load *load = &route_stats->backends[b];
+        used += snprintf(buffer + used, size - used, "route_%s=up:%d outstanding:%d queue:%ld p99_us:%ld routed:%ld\n",
+                         backend_names[b], backend_available(b, now), atomic_load(&load->outstanding), backend_queue(b),
+                         backend_p99_us(b), atomic_load(&load->routed));
+    }
+}
 
-    if (file_found) {
-        // Send response to client if file is found
-        send(client_socket, response, strlen(response), 0);
-    } else {
-        // Send "File not found" response if file is not found
-        char error_response[MAXDATASIZE];
-        snprintf(error_response, sizeof(error_response), "File '%s' not found", filename);
-        send(client_socket, error_response, strlen(error_response), 0);
+// ---------------------------------------------------------------------------
+// Admission control
+//
+// Commands run in one of two lanes by expected cost: interactive commands
+// (listings, lookups, statistics) and heavy ones that read many files or
+// stream a whole file (archives, w24fn --content). Each lane runs at most a
+// fixed number of commands at once and lets a bounded number wait for a turn;
+// a command beyond that is refused with "Busy, retry after N ms", estimated
+// from the lane's recent service times, instead of adding one more tar+gzip
+// pipeline to a disk that is already saturated.
+//
+// Every command served locally takes a slot in its lane, whichever mode or
+// protocol it arrived by. The table lives in shared memory with a robust
+// lock, so the limits hold across forked handlers, and the slots of a handler
+// that died are reclaimed. In epoll mode each lane also has its own worker
+// pool of the lane's size fed by its own queue, so an archive never occupies
+// a worker that a lookup is waiting for.
+//
+// Admission alone still lets running archives take every core from the
+// lookups queued behind them, so heavy work also gives way while it runs.
+// Threads that only do heavy work (epoll heavy workers, gzip compressors)
+// run at a lower CPU priority, and archive producers pause between slices
+// while interactive commands are queued or running anywhere.
+// ---------------------------------------------------------------------------
+
+#define LANE_SLOTS_MAX 256
+#define LANE_HEAVY_QUEUE 32             // Heavy commands that may wait for a slot
+#define LANE_WAIT_BUCKETS 5             // Wait histogram: <1 ms, <10 ms, <100 ms, <1 s, longer
+#define LANE_RECLAIM_SECONDS 1          // How often a waiter looks for slots of handlers that died
+#define LANE_DEFAULT_SERVICE_US 100000  // Assumed service time until a lane has finished a command
+#define LANE_HEAVY_NICE 10              // Nice value of threads that only do heavy work
+#define LANE_SLICE_US 2000              // How long a heavy command runs between checks for lookups
+#define LANE_YIELD_POLL_US 200          // How often a paused heavy command checks again
+#define LANE_YIELD_MAX_US 10000         // Longest pause per slice, so archives still progress
+
+static const char *const lane_names[LANES] = { "interactive", "heavy" };
+
+struct lane {
+    int slots;                          // Commands of the lane that may run at once
+    int queue_limit;                    // Commands that may wait for a slot before more are refused
+    int running;
+    int waiting;
+    pid_t owners[LANE_SLOTS_MAX];       // Process holding each slot, 0 if free
+    long admitted;
+    long rejected;
+    long service_us;                    // Moving average of how long a command holds its slot
+    long yielded_us;                    // Time the lane's commands paused for interactive ones
+    long wait_histogram[LANE_WAIT_BUCKETS];
+};
+
+struct lane_table {
+    pthread_mutex_t lock;               // Robust: a forked handler may die holding it
+    pthread_cond_t released;
+    struct lane lanes[LANES];
+};
+
+static struct lane_table *lane_table;
+static int lane_slot_counts[LANES];     // From --workers and --heavy-workers; 0 picks a default
+static __thread long command_queued_us; // When the epoll worker's command was queued, 0 elsewhere
+static __thread enum Lane command_running_lane; // Lane of the slot this thread holds
+static __thread bool thread_priority_lowered;
+
+// Lane of a command by its expected cost
+enum Lane command_lane(const char *command) {
+    static const char *const heavy[] = { "w24fz ", "w24ft ", "w24fdb ", "w24fda ", "w24fdr ", "w24fn --content " };
+
+    for (size_t i = 0; i < sizeof(heavy) / sizeof(heavy[0]); i++) {
+        if (strncmp(command, heavy[i], strlen(heavy[i])) == 0) {
+            return LANE_HEAVY;
+        }
     }
+    return LANE_INTERACTIVE;
 }
 
+// Size the lanes: interactive commands mostly wait on metadata and the network, so they get
+// several slots per core; heavy ones keep a core busy compressing, so they get one per core
+void start_lanes(void) {
+    pthread_mutexattr_t attr;
+    pthread_condattr_t cond_attr;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
 
+    if (cores < 1) {
+        cores = 1;
+    }
+    if (lane_slot_counts[LANE_INTERACTIVE] <= 0) {
+        lane_slot_counts[LANE_INTERACTIVE] = cores * 4;
+    }
+    if (lane_slot_counts[LANE_HEAVY] <= 0) {
+        lane_slot_counts[LANE_HEAVY] = cores > 2 ? cores : 2;
+    }
+    lane_table = mmap(NULL, sizeof(struct lane_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (lane_table == MAP_FAILED) {
+        perror("Admission table allocation failed");
+        lane_table = NULL;
+        return;
+    }
+    memset(lane_table, 0, sizeof(struct lane_table));
+    for (int l = 0; l < LANES; l++) {
+        if (lane_slot_counts[l] > LANE_SLOTS_MAX) {
+            lane_slot_counts[l] = LANE_SLOTS_MAX;
+        }
+        lane_table->lanes[l].slots = lane_slot_counts[l];
+    }
+    lane_table->lanes[LANE_INTERACTIVE].queue_limit = WORK_QUEUE_CAPACITY;
+    lane_table->lanes[LANE_HEAVY].queue_limit = LANE_HEAVY_QUEUE;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&lane_table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lane_table->released, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+}
 
+static void lane_lock(void) {
+    // Every update leaves the table consistent, so the lock of a handler that died is taken over
+    if (pthread_mutex_lock(&lane_table->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&lane_table->lock);
+    }
+}
 
-int compare_strings(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
+static void lane_unlock(void) {
+    pthread_mutex_unlock(&lane_table->lock);
 }
 
-void handleDirectoryListing(int client_socket) {
-    DIR *dir;
-    struct dirent *entry;
-    char *file_names[MAXDATASIZE]; // Array to store file names
-    int num_entries = 0;
+// Free the slots of processes that no longer exist. Caller holds the lock.
+static void lane_reclaim(struct lane *lane) {
+    for (int s = 0; s < lane->slots; s++) {
+        if (lane->owners[s] != 0 && kill(lane->owners[s], 0) == -1 && errno == ESRCH) {
+            lane->owners[s] = 0;
+            lane->running--;
+        }
+    }
+}
 
-    // Open the current directory
-    dir = opendir(".");
-    if (dir == NULL) {
-        perror("Error opening directory");
-        send(client_socket, "Error opening directory", strlen("Error opening directory"), 0);
+// How long a refused client should wait: the queued commands ahead of it drained at the
+// lane's pace. Caller holds the lock.
+static long lane_retry_ms(const struct lane *lane, int queued) {
+    long service_us = lane->service_us > 0 ? lane->service_us : LANE_DEFAULT_SERVICE_US;
+    long retry_ms = service_us * (queued + 1) / lane->slots / 1000;
+    return retry_ms > 0 ? retry_ms : 1;
+}
+
+// Count a command refused because its lane's epoll queue is full, and format the reply
+void lane_refuse(enum Lane l, int queued, char *response, size_t size) {
+    long retry_ms = 1000;
+
+    if (lane_table != NULL) {
+        lane_lock();
+        lane_table->lanes[l].rejected++;
+        retry_ms = lane_retry_ms(&lane_table->lanes[l], queued + lane_table->lanes[l].waiting);
+        lane_unlock();
+    }
+    snprintf(response, size, "Busy, retry after %ld ms", retry_ms);
+}
+
+// Take a slot in a command's lane, waiting for one if the lane's queue has room. Returns the
+// slot, or -1 with the reply for the client if the command is refused.
+int lane_enter(enum Lane l, char *response, size_t size) {
+    struct lane *lane;
+    long queued_us = command_queued_us ? command_queued_us : monotonic_us();
+    int slot = -1;
+
+    if (lane_table == NULL) {
+        return 0;
+    }
+    lane = &lane_table->lanes[l];
+    lane_lock();
+    if (lane->running >= lane->slots && lane->waiting >= lane->queue_limit) {
+        lane_reclaim(lane);
+    }
+    if (lane->running >= lane->slots && lane->waiting >= lane->queue_limit) {
+        lane->rejected++;
+        snprintf(response, size, "Busy, retry after %ld ms", lane_retry_ms(lane, lane->waiting));
+        lane_unlock();
+        return -1;
+    }
+    lane->waiting++;
+    while (lane->running >= lane->slots) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += LANE_RECLAIM_SECONDS;
+        int result = pthread_cond_timedwait(&lane_table->released, &lane_table->lock, &deadline);
+        if (result == EOWNERDEAD) {
+            pthread_mutex_consistent(&lane_table->lock);
+        } else if (result == ETIMEDOUT) {
+            lane_reclaim(lane);
+        }
+    }
+    lane->waiting--;
+    for (slot = 0; lane->owners[slot] != 0; slot++) {
+    }
+    lane->owners[slot] = getpid();
+    lane->running++;
+    lane->admitted++;
+    command_running_lane = l;
+
+    long wait_us = monotonic_us() - queued_us;
+    int bucket = 0;
+    for (long limit = 1000; bucket < LANE_WAIT_BUCKETS - 1 && wait_us >= limit; limit *= 10) {
+        bucket++;
+    }
+    lane->wait_histogram[bucket]++;
+    lane_unlock();
+    return slot;
+}
+
+// Give a slot back once its command is done
+void lane_leave(enum Lane l, int slot, long service_us) {
+    struct lane *lane;
+
+    if (lane_table == NULL) {
         return;
     }
+    command_running_lane = LANE_INTERACTIVE;
+    lane = &lane_table->lanes[l];
+    lane_lock();
+    if (lane->owners[slot] != 0) {
+        lane->owners[slot] = 0;
+        lane->running--;
+    }
+    // An average over roughly the last eight commands
+    lane->service_us = lane->service_us == 0 ? service_us : (lane->service_us * 7 + service_us) / 8;
+    pthread_cond_broadcast(&lane_table->released);
+    lane_unlock();
+}
 
-    // Read directory entries and store file names in the array
-    while ((entry = readdir(dir)) != NULL && num_entries < MAXDATASIZE) {
-        file_names[num_entries] = strdup(entry->d_name);
-        num_entries++;
+// Let the scheduler prefer every other thread over this one. Only for threads that never
+// serve an interactive command, since an unprivileged thread cannot raise it back.
+void lane_lower_priority(void) {
+    if (setpriority(PRIO_PROCESS, gettid(), LANE_HEAVY_NICE) == 0) {
+        thread_priority_lowered = true;
     }
+}
 
-    // Close the directory
-    closedir(dir);
+struct heavy_command {
+    int client_socket;
+    const char *command;
+};
 
-    // Sort the file names
-    qsort(file_names, num_entries, sizeof(char *), compare_strings);
+static void *heavy_command_main(void *arg) {
+    struct heavy_command *heavy = arg;
 
-    // Concatenate the sorted file names into the response string
-    char response[MAXDATASIZE] = "";
-    for (int i = 0; i < num_entries; i++) {
-        strcat(response, file_names[i]);
-        strcat(response, "\n");
-        free(file_names[i]); // Free dynamically allocated memory
+    lane_lower_priority();
+    command_running_lane = LANE_HEAVY;
+    handle_direct_command(heavy->client_socket, heavy->command);
+    return NULL;
+}
+
+// Run an admitted command. A heavy one is moved to a thread of its own at lower priority,
+// unless this thread already runs there: a forked handler or a framed request thread goes
+// on to serve lookups afterwards, and could not raise its priority back.
+void lane_run_command(enum Lane l, int client_socket, const char *command) {
+    struct heavy_command heavy = { client_socket, command };
+    pthread_t thread;
+
+    if (l != LANE_HEAVY || thread_priority_lowered || pthread_create(&thread, NULL, heavy_command_main, &heavy) != 0) {
+        handle_direct_command(client_socket, command);
+        return;
     }
+    pthread_join(thread, NULL);
+}
 
-    // Send the response string to the client
-    send(client_socket, response, strlen(response), 0);
+// Whether an interactive command is queued or running in any process
+static bool lane_interactive_pending(void) {
+    struct lane *lane = &lane_table->lanes[LANE_INTERACTIVE];
+    bool pending;
+
+    lane_lock();
+    pending = lane->running + lane->waiting > 0;
+    lane_unlock();
+    return pending || epoll_lane_queue_depth(LANE_INTERACTIVE) > 0;
 }
 
-void handle_dirlist_t(int client_socket) {
-    DIR *dir;
-    struct dirent *entry;
-    char response[MAXDATASIZE] = "";
-    int num_entries = 0;
+// Whether the command this thread is serving should give way to interactive ones
+bool lane_should_yield(void) {
+    return lane_table != NULL && command_running_lane == LANE_HEAVY;
+}
 
-    // Open the current directory
-    dir = opendir(".");
-    if (dir == NULL) {
-        log_message(ERROR, "Error opening directory: %s", strerror(errno));
-        send(client_socket, "Error opening directory", strlen("Error opening directory"), 0);
+// Called by heavy commands between pieces of work. Once the command has run for a slice it
+// pauses while interactive commands are pending, for at most LANE_YIELD_MAX_US. A lane that
+// still looks busy after that long may be holding the slots of a handler that died.
+void lane_yield(long *slice_started_us) {
+    long now = monotonic_us();
+
+    if (now - *slice_started_us < LANE_SLICE_US) {
         return;
     }
+    long paused_at = now;
+    while (now - paused_at < LANE_YIELD_MAX_US && lane_interactive_pending()) {
+        struct timespec pause = { 0, LANE_YIELD_POLL_US * 1000L };
+        nanosleep(&pause, NULL);
+        now = monotonic_us();
+    }
+    lane_lock();
+    if (now - paused_at >= LANE_YIELD_MAX_US) {
+        lane_reclaim(&lane_table->lanes[LANE_INTERACTIVE]);
+    }
+    lane_table->lanes[LANE_HEAVY].yielded_us += now - paused_at;
+    lane_unlock();
+    *slice_started_us = now;
+}
 
-    // Read directory entries and store them in the response string
-    while ((entry = readdir(dir)) != NULL && num_entries < MAXDATASIZE - 1) {
-        strcat(response, entry->d_name);
-        strcat(response, "\n");
-        num_entries++;
+// Slots, queues and wait-time histograms of both lanes, for w24stats
+void format_lane_stats(char *buffer, size_t size) {
+    size_t used = 0;
+
+    for (int l = 0; lane_table != NULL && l < LANES && used < size; l++) {
+        struct lane lane;
+        lane_lock();
+        lane = lane_table->lanes[l];
+        lane_unlock();
+        used += snprintf(buffer + used, size - used, "lane_%s=slots:%d running:%d waiting:%d admitted:%ld rejected:%ld "
+                         "yielded_ms:%ld wait_ms:<1=%ld,<10=%ld,<100=%ld,<1000=%ld,>=1000=%ld\n",
+                         lane_names[l], lane.slots, lane.running, lane.waiting, lane.admitted, lane.rejected, lane.yielded_us / 1000,
+                         lane.wait_histogram[0], lane.wait_histogram[1], lane.wait_histogram[2],
+                         lane.wait_histogram[3], lane.wait_histogram[4]);
     }
+}
 
-    // Send the response string to the client
-    send(client_socket, response, strlen(response), 0);
 
-    // Close the directory
-    closedir(dir);
+
+// ---------------------------------------------------------------------------
+// Resident filesystem metadata index
+//
+// $HOME is walked once at startup by a background thread. Every entry becomes
+// a fixed-width record whose path lives in a shared string arena, and sorted
+// permutations of the record ids answer path, name, size and ctime lookups
+// with a binary search. Until the first build is published, the handlers fall
+// back to walking the disk.
+//
+// After the build the same thread keeps the index current from inotify
+// events. Changed entries are appended as an unsorted delta and the records
+// they replace are marked deleted; once the delta outgrows INDEX_DELTA_LIMIT it
+// is sorted and merged into the permutations in one linear pass.
+//
+// The finished index is also written to a snapshot file, which the server and
+// both mirrors map at startup instead of walking $HOME again. They then catch
+// up with whatever changed while no process was watching.
+// ---------------------------------------------------------------------------
+
+// Flags stored with each index record
+#define INDEX_FLAG_HIDDEN 0x1 // Some component of the path starts with '.'
+
+#define INDEX_DELTA_LIMIT 4096
+#define INDEX_PERMUTATIONS 5
+#define NAME_BLOOM_BITS_PER_NAME 12     // About 1% false positives with NAME_BLOOM_HASHES probes
+#define NAME_BLOOM_HASHES 7
+#define INOTIFY_BUFFER_SIZE 65536
+#define INDEX_SNAPSHOT_FILE "index.snapshot"        // Shared by the server and both mirrors
+#define INDEX_SNAPSHOT_MAGIC "W24SNAP"
+#define INDEX_SNAPSHOT_VERSION 2
+#define INDEX_SNAPSHOT_INTERVAL_MS (5 * 60 * 1000)  // Least time between rewrites of a changing index
+#define INDEX_SNAPSHOT_PAGE 65536                   // Records and arena are mapped at their file offsets,
+                                                    // which must be page aligned on any architecture
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | \
+                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct index_record {
+    uint64_t path_offset;  // Offset of the NUL-terminated full path in the arena
+    uint32_t path_length;
+    uint32_t name_offset;  // Offset of the basename within the path
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    int64_t created;       // Birth time where the filesystem records one, else ctime
+    uint32_t mode;
+    uint32_t flags;
+    uint32_t mtime_nsec;   // Sub-second parts, so a rewrite within one second is still a change
+    uint32_t ctime_nsec;
+};
+
+// Open-addressing slot mapping a basename to its run in by_name
+struct name_slot {
+    uint64_t hash;                    // 0 marks an empty slot
+    uint32_t start;                   // First position of the name in by_name
+    uint32_t count;                   // Length of the run
+};
+
+// Open-addressing slot mapping a trigram of a name to its posting list
+struct trigram_slot {
+    uint32_t key;                     // The three bytes plus one; 0 marks an empty slot
+    uint32_t start;                   // First entry in postings
+    uint32_t count;
+};
+
+// Basename lookup structures, rebuilt whenever by_name is. The blocked Bloom filter
+// keeps all of a name's bits in one 64-byte cache line, so a miss costs one load.
+// The trigram index lists, for every three-byte sequence, the distinct names that
+// contain it, so a substring or glob search only verifies the names that share
+// all of the pattern's trigrams.
+struct name_table {
+    struct name_slot *slots;
+    size_t slot_mask;                 // Slot count minus one; the count is a power of two
+    uint64_t *bloom;                  // Blocks of 8 words
+    size_t block_mask;                // Block count minus one
+    uint32_t *runs;                   // Where each distinct name starts in by_name, plus the end
+    size_t run_count;
+    struct trigram_slot *trigrams;    // NULL if there was no memory for it
+    size_t trigram_mask;
+    uint32_t *postings;               // Run numbers, ascending within each list
+    size_t posting_count;
+};
+
+struct file_index {
+    bool ready;
+    size_t root_length;               // Length of the indexed root path
+    char *arena;
+    size_t arena_length;
+    size_t arena_capacity;
+    struct index_record *records;
+    uint8_t *deleted;                 // Tombstones, parallel to records
+    size_t count;
+    size_t capacity;
+    size_t deleted_count;
+    size_t sorted_count;              // Ids below this are covered by the permutations
+    size_t sorted_length;             // Length of by_path and by_name
+    size_t size_length;               // Length of by_size
+    size_t created_length;            // Length of by_created
+    size_t extension_length;          // Length of by_extension
+    uint32_t *by_path;                // Ids sorted by path
+    uint32_t *by_name;                // Ids sorted by (basename, path)
+    uint32_t *by_size;                // Regular file ids sorted by size, so size ranges scan only files
+    uint32_t *by_created;             // Regular files outside hidden directories, sorted by creation time
+    uint32_t *by_extension;           // Regular files with an extension, sorted by (extension, path):
+                                      // each extension's posting list is one contiguous run
+    struct name_table names;          // Hash table over by_name, plus a Bloom filter of every name
+    const char *snapshot;             // Read-only mapping of the snapshot the index was loaded from. Arrays
+    size_t snapshot_length;           // inside it are replaced when they change, never freed
+    bool records_mapped;              // records and arena are copy-on-write mappings of the snapshot at
+    bool arena_mapped;                // the start of anonymous reservations of capacity entries
+};
+
+// Watcher counters live in shared memory so forked connection handlers report live values
+struct index_stats {
+    atomic_long events;
+    atomic_long overflows;
+    atomic_long rescanned_dirs;
+    atomic_long merges;
+    atomic_long pending_since_us;     // When unapplied events were first seen, 0 when idle
+    atomic_long last_lag_us;          // Time taken to apply the last batch of events
+    atomic_long startup_us;           // From start_file_index() until the index was published
+    atomic_long from_snapshot;        // 1 if the index was loaded from a snapshot
+    atomic_long generation;           // Bumped by every change applied to the index
+    atomic_long unwatched_dirs;       // Directories whose watch could not be added
+};
+
+// A watched directory and its timestamps when it was last read
+struct watched_directory {
+    char *path;
+    struct timespec mtime;
+    struct timespec ctime;
+    bool racy;                        // Timestamps too close to the read to prove nothing changed after it
+};
+
+// Watch descriptor to directory map, only touched by the index thread
+struct index_watcher {
+    int inotify_fd;
+    struct watched_directory *dirs;
+    int capacity;
+    char **unwatched;                 // Directories whose changes go unseen, until they are removed
+    size_t unwatched_count;
+};
+
+// Sections of an index snapshot. Every array is stored exactly as it is laid out in
+// memory, so the snapshot is position independent and can be used where it is mapped.
+enum snapshot_section {
+    SNAPSHOT_ROOT,
+    SNAPSHOT_ARENA,
+    SNAPSHOT_RECORDS,
+    SNAPSHOT_DELETED,
+    SNAPSHOT_BY_PATH,
+    SNAPSHOT_BY_NAME,
+    SNAPSHOT_BY_SIZE,
+    SNAPSHOT_BY_CREATED,
+    SNAPSHOT_BY_EXTENSION,
+    SNAPSHOT_NAME_SLOTS,
+    SNAPSHOT_BLOOM,
+    SNAPSHOT_RUNS,
+    SNAPSHOT_TRIGRAMS,
+    SNAPSHOT_POSTINGS,
+    SNAPSHOT_DIRECTORIES,
+    SNAPSHOT_DIRECTORY_PATHS,
+    SNAPSHOT_SECTIONS
+};
+
+struct snapshot_header {
+    char magic[8];                    // INDEX_SNAPSHOT_MAGIC
+    uint32_t version;                 // INDEX_SNAPSHOT_VERSION
+    uint32_t record_size;             // sizeof(struct index_record), so a layout change is caught
+    uint64_t file_length;
+    int64_t written;                  // Seconds since the epoch
+    uint64_t deleted_count;
+    uint64_t slot_mask;
+    uint64_t block_mask;
+    uint64_t trigram_mask;
+    struct {
+        uint64_t offset;              // From the start of the file
+        uint64_t length;              // In bytes; 0 for an absent table
+    } sections[SNAPSHOT_SECTIONS];
+};
+
+// A watched directory's stamps, so a later process can tell which directories changed
+struct snapshot_directory {
+    uint64_t path_offset;             // In SNAPSHOT_DIRECTORY_PATHS
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t racy;
+};
+
+static struct file_index file_index;
+static pthread_rwlock_t file_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct index_stats *index_stats;
+static struct index_watcher index_watcher = { .inotify_fd = -1 };
+static const char *index_root;
+static const char *index_snapshot_path = INDEX_SNAPSHOT_FILE;  // NULL with --index-snapshot off
+static long index_started_us;
+static long snapshot_saved_us;        // When the snapshot was last written, or found unchanged
+static long snapshot_changes = -1;    // Events and rescans the written snapshot includes; -1 forces a write
+static long index_fork_generation = -1;  // Generation a forked handler's copy of the index is frozen at
+
+static long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
 }
 
-void *handle_client(void *arg) {
-    int client_socket = *((int *)arg);
-    char buffer[MAXDATASIZE];
+static inline const char *index_path(const struct file_index *index, const struct index_record *record) {
+    return index->arena + record->path_offset;
+}
 
-    // Receive client request
-    if (recv(client_socket, buffer, MAXDATASIZE, 0) == -1) {
-        perror("recv");
-        close(client_socket);
-        pthread_exit(NULL);
+static inline const char *index_name(const struct file_index *index, const struct index_record *record) {
+    return index->arena + record->path_offset + record->name_offset;
+}
+
+// A path is hidden if any component below the root starts with '.'
+static uint32_t index_path_flags(const char *path, size_t root_length) {
+    return strstr(path + root_length, "/.") != NULL ? INDEX_FLAG_HIDDEN : 0;
+}
+
+static bool index_in_snapshot(const struct file_index *index, const void *array) {
+    return index->snapshot != NULL && (const char *)array >= index->snapshot && (const char *)array < index->snapshot + index->snapshot_length;
+}
+
+// Free an array unless it is used in place from the snapshot
+static void index_free_array(const struct file_index *index, void *array) {
+    if (!index_in_snapshot(index, array)) {
+        free(array);
     }
+}
 
-    // Parse client request and dispatch appropriate handler
-    if (strcmp(buffer, "w24fn") == 0) {
-        // Extract filename from client request
-        char filename[MAXDATASIZE];
-        if (recv(client_socket, filename, MAXDATASIZE, 0) == -1) {
-            perror("recv");
-            close(client_socket);
-            pthread_exit(NULL);
-        }
-        handle_w24fn(client_socket, filename);
-    } else if (strcmp(buffer, "dirlist_t") == 0) {
-        handle_dirlist_t(client_socket);
-    } else if (strcmp(buffer, "w24fz") == 0) {
-        // Extract size parameters from client request
-        long size1, size2;
-        if (recv(client_socket, &size1, sizeof(long), 0) == -1 ||
-            recv(client_socket, &size2, sizeof(long), 0) == -1) {
-            perror("recv");
-            close(client_socket);
-            pthread_exit(NULL);
+// Grow an array that may still be a mapped snapshot section: a mapping cannot be
+// realloc()ed, so its used part is copied to the heap and the reservation unmapped
+static void *index_grow_array(void *array, bool *mapped, size_t used, size_t reserved, size_t capacity) {
+    if (!*mapped) {
+        return realloc(array, capacity);
+    }
+    void *grown = malloc(capacity);
+    if (grown != NULL) {
+        memcpy(grown, array, used);
+        munmap(array, reserved);
+        *mapped = false;
+    }
+    return grown;
+}
+
+static void index_free_storage(struct file_index *index) {
+    if (index->records_mapped) {
+        munmap(index->records, index->capacity * sizeof(struct index_record));
+    } else {
+        free(index->records);
+    }
+    if (index->arena_mapped) {
+        munmap(index->arena, index->arena_capacity);
+    } else {
+        free(index->arena);
+    }
+    free(index->deleted);
+}
+
+// Append a copy of a record; the caller either owns the index privately or holds the write lock
+static int index_push(struct file_index *index, const char *path, const struct index_record *fields) {
+    if (index->count == index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 4096;
+        struct index_record *records = index_grow_array(index->records, &index->records_mapped, index->count * sizeof(struct index_record),
+                                                        index->capacity * sizeof(struct index_record), capacity * sizeof(struct index_record));
+        if (records == NULL) {
+            return -1;
         }
-        handle_w24fz(client_socket, size1, size2);
-    } else if (strcmp(buffer, "w24ft") == 0) {
-        // Extract extensions from client request
-        char extensions[MAXDATASIZE];
-        if (recv(client_socket, extensions, MAXDATASIZE, 0) == -1) {
-            perror("recv");
-            close(client_socket);
-            pthread_exit(NULL);
+        index->records = records;
+        uint8_t *deleted = realloc(index->deleted, capacity);
+        if (deleted == NULL) {
+            return -1;
         }
-        handle_w24ft(client_socket, extensions);
-    } else if (strcmp(buffer, "w24fdb") == 0) {
-        // Extract date from client request
-        char date[MAXDATASIZE];
-        if (recv(client_socket, date, MAXDATASIZE, 0) == -1) {
-            perror("recv");
-            close(client_socket);
-            pthread_exit(NULL);
+        index->deleted = deleted;
+        index->capacity = capacity;
+    }
+    if (index->arena_length + fields->path_length + 1 > index->arena_capacity) {
+        size_t capacity = index->arena_capacity ? index->arena_capacity * 2 : 1 << 20;
+        while (capacity < index->arena_length + fields->path_length + 1) {
+            capacity *= 2;
         }
-        handle_w24fdb(client_socket, date);
-    } else if (strcmp(buffer, "w24fda") == 0) {
-        // Extract date from client request
-        char date[MAXDATASIZE];
-        if (recv(client_socket, date, MAXDATASIZE, 0) == -1) {
-            perror("recv");
-            close(client_socket);
-            pthread_exit(NULL);
+        char *arena = index_grow_array(index->arena, &index->arena_mapped, index->arena_length, index->arena_capacity, capacity);
+        if (arena == NULL) {
+            return -1;
         }
-        handle_w24fda(client_socket, date);
-    } else if (strcmp(buffer, "dirlist") == 0) {
-        handleDirectoryListing(client_socket);
-    } else {
-        log_message(ERROR, "Unknown command received: %s", buffer);
+        index->arena = arena;
+        index->arena_capacity = capacity;
     }
 
-    close(client_socket);
-    pthread_exit(NULL);
+    struct index_record *record = &index->records[index->count];
+    *record = *fields;
+    record->path_offset = index->arena_length;
+    index->deleted[index->count] = 0;
+    index->count++;
+
+    memcpy(index->arena + index->arena_length, path, fields->path_length + 1);
+    index->arena_length += fields->path_length + 1;
+    return 0;
 }
 
+// lstat() a path for the index, asking for the birth time as well
+static int index_lstat(const char *path, struct statx *stx) {
+    return statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                 STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_BTIME, stx);
+}
 
+// Creation time of an entry. Filesystems without a birth time fall back to ctime.
+static int64_t statx_created(const struct statx *stx) {
+    return (stx->stx_mask & STATX_BTIME) ? stx->stx_btime.tv_sec : stx->stx_ctime.tv_sec;
+}
 
-void handle_w24fz(int client_socket, long size1, long size2) {
-    char response[MAXDATASIZE] = "";
-    bool file_found = false;
+// FNV-1a, finished with a multiply-xorshift so the high bits mix as well; never 0
+static uint64_t name_hash(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
 
-    // Open the home directory
-    DIR *dir = opendir(getenv("HOME"));
-    if (dir == NULL) {
-        perror("Error opening directory");
-        send(client_socket, "Error opening directory", strlen("Error opening directory"), 0);
-        return;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 0x100000001b3ULL;
     }
+    hash ^= hash >> 32;
+    hash *= 0xd6e8feb86659fd93ULL;
+    hash ^= hash >> 32;
+    return hash != 0 ? hash : 1;
+}
 
-    // Traverse directory tree and find files within the specified size range
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        struct stat st;
-        char path[MAX_PATH_LENGTH];
-        snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), entry->d_name);
+// The high bits pick the block, and 9-bit slices of a remixed hash pick the bits inside it
+static void name_bloom_add(struct name_table *names, uint64_t hash) {
+    uint64_t *block = names->bloom + ((hash >> 40) & names->block_mask) * 8;
+    uint64_t bits = hash * 0x9e3779b97f4a7c15ULL;
 
-        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) { // Check if it's a regular file
-            if (st.st_size >= size1 && st.st_size <= size2) {
-                // Add file path to response
-                strcat(response, path);
-                strcat(response, "\n");
-                file_found = true;
-            }
-        }
+    for (int i = 0; i < NAME_BLOOM_HASHES; i++, bits >>= 9) {
+        block[(bits >> 6) & 7] |= 1ULL << (bits & 63);
     }
+}
 
-    closedir(dir);
+static bool name_bloom_test(const struct name_table *names, uint64_t hash) {
+    const uint64_t *block = names->bloom + ((hash >> 40) & names->block_mask) * 8;
+    uint64_t bits = hash * 0x9e3779b97f4a7c15ULL;
 
-    if (!file_found) {
-        // Send "No file found" response if no file is found within the size range
-        send(client_socket, "No file found", strlen("No file found"), 0);
-        return;
+    for (int i = 0; i < NAME_BLOOM_HASHES; i++, bits >>= 9) {
+        if (!(block[(bits >> 6) & 7] & (1ULL << (bits & 63)))) {
+            return false;
+        }
     }
+    return true;
+}
 
-    // Create a temporary file to store the list of files
-    char temp_file[] = "/home/username/w24project/w24fz_temp_list.txt";
-    FILE *temp_file_ptr = fopen(temp_file, "w");
-    if (!temp_file_ptr) {
-        perror("Error creating temporary file");
-        send(client_socket, "Error creating temporary file", strlen("Error creating temporary file"), 0);
-        return;
+// Append the index_lstat() result of a path
+static int index_append(struct file_index *index, const char *path, const struct statx *stx, uint32_t flags) {
+    const char *slash = strrchr(path, '/');
+    struct index_record record = {
+        .path_length = strlen(path),
+        .name_offset = slash ? slash - path + 1 : 0,
+        .size = stx->stx_size,
+        .mtime = stx->stx_mtime.tv_sec,
+        .ctime = stx->stx_ctime.tv_sec,
+        .created = statx_created(stx),
+        .mode = stx->stx_mode,
+        .flags = flags,
+        .mtime_nsec = stx->stx_mtime.tv_nsec,
+        .ctime_nsec = stx->stx_ctime.tv_nsec,
+    };
+    // Names added after the last rebuild go into the filter too, so a negative test covers the delta
+    if (index->names.bloom != NULL) {
+        name_bloom_add(&index->names, name_hash(path + record.name_offset));
     }
+    return index_push(index, path, &record);
+}
 
-    // Write the list of files to the temporary file
-    fputs(response, temp_file_ptr);
-    fclose(temp_file_ptr);
+// Remember a directory's timestamps just before its entries are read
+static void index_stamp_directory(struct watched_directory *dir) {
+    struct stat st;
+    struct timespec now;
 
-    // Create the tar.gz file
-    char tar_command[MAXDATASIZE];
-    snprintf(tar_command, sizeof(tar_command), "tar -czf /home/username/w24project/temp.tar.gz -T %s", temp_file);
-    int ret = system(tar_command);
-    if (ret == -1) {
-        perror("Error creating tar.gz file");
-        send(client_socket, "Error creating tar.gz file", strlen("Error creating tar.gz file"), 0);
+    if (lstat(dir->path, &st) == -1) {
         return;
     }
+    clock_gettime(CLOCK_REALTIME, &now);
+    dir->mtime = st.st_mtim;
+    dir->ctime = st.st_ctim;
+    // Filesystem timestamps are coarse, so a change in the same tick as the read would go unnoticed
+    dir->racy = st.st_mtim.tv_sec >= now.tv_sec - 1 || st.st_ctim.tv_sec >= now.tv_sec - 1;
+}
 
-    // Open the temporary tar.gz file for reading
-    FILE *tar_file = fopen("/home/username/w24project/temp.tar.gz", "rb");
-    if (!tar_file) {
-        perror("Error opening temporary tar.gz file");
-        send(client_socket, "Error opening temporary tar.gz file", strlen("Error opening temporary tar.gz file"), 0);
-        return;
+// Remember a directory that could not be watched. Until it is gone the index may miss
+// changes, so index_generation() reports no generation and nothing is cached.
+static void index_mark_unwatched(const char *path) {
+    char **unwatched = realloc(index_watcher.unwatched, (index_watcher.unwatched_count + 1) * sizeof(char *));
+    char *copy = strdup(path);
+
+    if (unwatched != NULL) {
+        index_watcher.unwatched = unwatched;
+    }
+    // Without memory to remember it, the directory counts as unwatched for good
+    if (unwatched != NULL && copy != NULL) {
+        index_watcher.unwatched[index_watcher.unwatched_count++] = copy;
+    } else {
+        free(copy);
     }
+    atomic_fetch_add(&index_stats->unwatched_dirs, 1);
+}
 
-    // // Send the contents of the temporary tar.gz file to the client
-    char buffer[MAXDATASIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), tar_file)) > 0) {
-        //send(client_socket, buffer, bytes_read, 0);
+// Register an inotify watch for a directory and remember its path; returns its entry, or NULL
+static struct watched_directory *index_watch_directory(const char *path) {
+    if (index_watcher.inotify_fd == -1) {
+        return NULL;
+    }
+    int wd = inotify_add_watch(index_watcher.inotify_fd, path, INDEX_WATCH_MASK);
+    if (wd == -1) {
+        log_message(WARNING, "Cannot watch %s: %s", path, errno == ENOSPC ? "inotify watch limit reached" : strerror(errno));
+        index_mark_unwatched(path);
+        return NULL;
     }
+    if (wd >= index_watcher.capacity) {
+        int capacity = index_watcher.capacity ? index_watcher.capacity : 1024;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        struct watched_directory *dirs = realloc(index_watcher.dirs, capacity * sizeof(struct watched_directory));
+        if (dirs == NULL) {
+            inotify_rm_watch(index_watcher.inotify_fd, wd);
+            index_mark_unwatched(path);
+            return NULL;
+        }
+        memset(dirs + index_watcher.capacity, 0, (capacity - index_watcher.capacity) * sizeof(struct watched_directory));
+        index_watcher.dirs = dirs;
+        index_watcher.capacity = capacity;
+    }
+    free(index_watcher.dirs[wd].path);
+    index_watcher.dirs[wd].path = strdup(path);
+    index_stamp_directory(&index_watcher.dirs[wd]);
+    return &index_watcher.dirs[wd];
+}
 
-    // Close the temporary tar.gz file
-    fclose(tar_file);
+// Drop the watches of a directory and everything below it
+static void index_unwatch_subtree(const char *path) {
+    size_t length = strlen(path);
 
-    // Send a confirmation message to the client
-    send(client_socket, "TAR file transmission complete", strlen("TAR file transmission complete"), 0);
+    for (int wd = 0; wd < index_watcher.capacity; wd++) {
+        const char *watched = index_watcher.dirs[wd].path;
+        if (watched != NULL && strncmp(watched, path, length) == 0 && (watched[length] == '\0' || watched[length] == '/')) {
+            inotify_rm_watch(index_watcher.inotify_fd, wd);
+            free(index_watcher.dirs[wd].path);
+            index_watcher.dirs[wd].path = NULL;
+        }
+    }
+    for (size_t i = 0; i < index_watcher.unwatched_count;) {
+        const char *unwatched = index_watcher.unwatched[i];
+        if (strncmp(unwatched, path, length) == 0 && (unwatched[length] == '\0' || unwatched[length] == '/')) {
+            free(index_watcher.unwatched[i]);
+            index_watcher.unwatched[i] = index_watcher.unwatched[--index_watcher.unwatched_count];
+            atomic_fetch_sub(&index_stats->unwatched_dirs, 1);
+        } else {
+            i++;
+        }
+    }
 }
 
-void handle_w24ft(int client_socket, const char *extensions) {
-    printf("Handling w24ft command...\n");
+// Recursively add everything below dir_path to a private index; symlinked directories are not followed
+static void index_walk(struct file_index *index, const char *dir_path, uint32_t dir_flags) {
+    DIR *dir;
+    struct dirent *entry;
 
-    // Create the w24project directory if it doesn't exist
-    mkdir("/home/username/w24project", 0777); // 0777 sets permissions to allow read, write, and execute for all users
-    printf("Created w24project directory if not exists.\n");
+    index_watch_directory(dir_path);
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char full_path[PATH_MAX];
+        struct statx stx;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        int length = snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+        if (length >= (int)sizeof(full_path) || index_lstat(full_path, &stx) == -1) {
+            continue;
+        }
+
+        uint32_t flags = dir_flags | (entry->d_name[0] == '.' ? INDEX_FLAG_HIDDEN : 0);
+        if (index_append(index, full_path, &stx, flags) == -1) {
+            break;
+        }
+        if (S_ISDIR(stx.stx_mode)) {
+            index_walk(index, full_path, flags);
+        }
+    }
+
+    closedir(dir);
+}
+
+// Extension of a basename: what follows its last '.', or NULL if it has none
+static inline const char *name_extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot != NULL && dot[1] != '\0' ? dot + 1 : NULL;
+}
+
+// Whether a basename matches the find pattern "*.<extension>"; the extension may itself contain dots
+static bool name_has_extension(const char *name, const char *extension) {
+    size_t name_length = strlen(name);
+    size_t extension_length = strlen(extension);
+    return name_length > extension_length && name[name_length - extension_length - 1] == '.' &&
+           strcmp(name + name_length - extension_length, extension) == 0;
+}
+
+static int compare_index_path(const void *a, const void *b, void *arg) {
+    const struct file_index *index = arg;
+    return strcmp(index_path(index, &index->records[*(const uint32_t *)a]), index_path(index, &index->records[*(const uint32_t *)b]));
+}
+
+static int compare_index_name(const void *a, const void *b, void *arg) {
+    const struct file_index *index = arg;
+    const struct index_record *ra = &index->records[*(const uint32_t *)a];
+    const struct index_record *rb = &index->records[*(const uint32_t *)b];
+    int result = strcmp(index_name(index, ra), index_name(index, rb));
+    return result != 0 ? result : strcmp(index_path(index, ra), index_path(index, rb));
+}
+
+static int compare_index_size(const void *a, const void *b, void *arg) {
+    const struct file_index *index = arg;
+    int64_t sa = index->records[*(const uint32_t *)a].size;
+    int64_t sb = index->records[*(const uint32_t *)b].size;
+    return (sa > sb) - (sa < sb);
+}
+
+static int compare_index_extension(const void *a, const void *b, void *arg) {
+    const struct file_index *index = arg;
+    const struct index_record *ra = &index->records[*(const uint32_t *)a];
+    const struct index_record *rb = &index->records[*(const uint32_t *)b];
+    int result = strcmp(name_extension(index_name(index, ra)), name_extension(index_name(index, rb)));
+    return result != 0 ? result : strcmp(index_path(index, ra), index_path(index, rb));
+}
+
+static int compare_index_created(const void *a, const void *b, void *arg) {
+    const struct file_index *index = arg;
+    int64_t ta = index->records[*(const uint32_t *)a].created;
+    int64_t tb = index->records[*(const uint32_t *)b].created;
+    return (ta > tb) - (ta < tb);
+}
+
+// Merge the sorted delta ids into one permutation of base_length ids, dropping deleted ids
+static int index_merge_permutation(struct file_index *index, uint32_t **permutation, size_t base_length, uint32_t *delta, size_t delta_length,
+                                   int (*compare)(const void *, const void *, void *)) {
+    uint32_t *base = *permutation;
+    uint32_t *merged = malloc((base_length + delta_length + 1) * sizeof(uint32_t));
+    size_t i = 0, j = 0, k = 0;
+
+    if (merged == NULL) {
+        return -1;
+    }
+    qsort_r(delta, delta_length, sizeof(uint32_t), compare, index);
+
+    while (i < base_length || j < delta_length) {
+        if (i < base_length && index->deleted[base[i]]) {
+            i++;
+        } else if (j == delta_length || (i < base_length && compare(&base[i], &delta[j], index) <= 0)) {
+            merged[k++] = base[i++];
+        } else {
+            merged[k++] = delta[j++];
+        }
+    }
+
+    index_free_array(index, base);
+    *permutation = merged;
+    return k;
+}
+
+static void name_table_free(const struct file_index *index, struct name_table *names) {
+    index_free_array(index, names->slots);
+    index_free_array(index, names->bloom);
+    index_free_array(index, names->runs);
+    index_free_array(index, names->trigrams);
+    index_free_array(index, names->postings);
+    memset(names, 0, sizeof(*names));
+}
+
+// Merge the trigrams of text into keys, a sorted set of count trigrams; returns the new count.
+// A name or pattern is at most NAME_MAX bytes, so keys never needs more than NAME_MAX entries.
+static size_t add_trigrams(const char *text, size_t length, uint32_t *keys, size_t count) {
+    const unsigned char *c = (const unsigned char *)text;
+
+    for (size_t i = 0; i + 2 < length; i++) {
+        uint32_t key = ((uint32_t)c[i] << 16 | (uint32_t)c[i + 1] << 8 | c[i + 2]) + 1;
+        size_t at = count;
+        while (at > 0 && keys[at - 1] > key) {
+            at--;
+        }
+        if (at > 0 && keys[at - 1] == key) {
+            continue;
+        }
+        memmove(keys + at + 1, keys + at, (count - at) * sizeof(*keys));
+        keys[at] = key;
+        count++;
+    }
+    return count;
+}
+
+// The slot holding key, or the empty slot where it belongs
+static struct trigram_slot *trigram_find(struct trigram_slot *slots, size_t mask, uint32_t key) {
+    size_t slot = ((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+    while (slots[slot].key != 0 && slots[slot].key != key) {
+        slot = (slot + 1) & mask;
+    }
+    return &slots[slot];
+}
+
+static int trigram_grow(struct trigram_slot **slots, size_t *mask) {
+    size_t grown_mask = *mask * 2 + 1;
+    struct trigram_slot *grown = calloc(grown_mask + 1, sizeof(*grown));
+
+    if (grown == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i <= *mask; i++) {
+        if ((*slots)[i].key != 0) {
+            *trigram_find(grown, grown_mask, (*slots)[i].key) = (*slots)[i];
+        }
+    }
+    free(*slots);
+    *slots = grown;
+    *mask = grown_mask;
+    return 0;
+}
+
+// Build the posting list of every trigram over the distinct names. The lists are
+// counted first and then filled from their ends while walking the names backwards,
+// which leaves each one ascending without a sort.
+static void index_build_trigrams(const struct file_index *index, struct name_table *names) {
+    uint32_t keys[NAME_MAX];
+    size_t mask = 4095, used = 0, total = 0;
+    struct trigram_slot *slots = calloc(mask + 1, sizeof(*slots));
+
+    for (size_t run = 0; slots != NULL && run < names->run_count; run++) {
+        const char *name = index_name(index, &index->records[index->by_name[names->runs[run]]]);
+        size_t count = add_trigrams(name, strlen(name), keys, 0);
+        for (size_t k = 0; k < count; k++) {
+            struct trigram_slot *slot = trigram_find(slots, mask, keys[k]);
+            if (slot->key == 0) {
+                slot->key = keys[k];
+                used++;
+            }
+            slot->count++;
+            // Keep the table at most half full
+            if (used * 2 > mask + 1 && trigram_grow(&slots, &mask) == -1) {
+                free(slots);
+                slots = NULL;
+                break;
+            }
+        }
+        total += count;
+    }
+    uint32_t *postings = slots != NULL && total <= UINT32_MAX ? malloc((total + 1) * sizeof(uint32_t)) : NULL;
+    if (postings == NULL) {
+        free(slots);
+        log_message(WARNING, "Out of memory for the trigram index, name searches will scan every name");
+        return;
+    }
+
+    total = 0;
+    for (size_t i = 0; i <= mask; i++) {
+        total += slots[i].count;
+        slots[i].start = total;
+    }
+    for (size_t run = names->run_count; run-- > 0; ) {
+        const char *name = index_name(index, &index->records[index->by_name[names->runs[run]]]);
+        size_t count = add_trigrams(name, strlen(name), keys, 0);
+        for (size_t k = 0; k < count; k++) {
+            postings[--trigram_find(slots, mask, keys[k])->start] = run;
+        }
+    }
+    names->trigrams = slots;
+    names->trigram_mask = mask;
+    names->postings = postings;
+    names->posting_count = total;
+}
+
+// Rebuild the name table, Bloom filter and trigram index from by_name, whose equal names are
+// adjacent. Slots point at runs of positions in by_name, so the table is rebuilt
+// whenever by_name changes. If memory runs out, lookups fall back to a binary
+// search of by_name.
+static void index_build_names(struct file_index *index) {
+    struct name_table names = { 0 };
+    size_t runs = 0;
+
+    name_table_free(index, &index->names);
+    for (size_t i = 0; i < index->sorted_length; i++) {
+        if (i == 0 || strcmp(index_name(index, &index->records[index->by_name[i]]),
+                             index_name(index, &index->records[index->by_name[i - 1]])) != 0) {
+            runs++;
+        }
+    }
+
+    size_t slots = 16, blocks = 1;
+    while (slots < runs * 2) {
+        slots *= 2;
+    }
+    // Headroom for the names the delta adds before the next rebuild
+    while (blocks * 512 < (runs + INDEX_DELTA_LIMIT) * NAME_BLOOM_BITS_PER_NAME) {
+        blocks *= 2;
+    }
+    names.slots = calloc(slots, sizeof(struct name_slot));
+    names.bloom = calloc(blocks * 8, sizeof(uint64_t));
+    names.runs = malloc((runs + 1) * sizeof(uint32_t));
+    if (names.slots == NULL || names.bloom == NULL || names.runs == NULL) {
+        name_table_free(index, &names);
+        log_message(WARNING, "Out of memory for the file name table, using binary search");
+        return;
+    }
+    names.slot_mask = slots - 1;
+    names.block_mask = blocks - 1;
+
+    for (size_t i = 0; i < index->sorted_length; ) {
+        const char *name = index_name(index, &index->records[index->by_name[i]]);
+        size_t end = i + 1;
+        while (end < index->sorted_length && strcmp(index_name(index, &index->records[index->by_name[end]]), name) == 0) {
+            end++;
+        }
+        uint64_t hash = name_hash(name);
+        size_t slot = hash & names.slot_mask;
+        while (names.slots[slot].hash != 0) {
+            slot = (slot + 1) & names.slot_mask;
+        }
+        names.slots[slot] = (struct name_slot){ hash, i, end - i };
+        name_bloom_add(&names, hash);
+        names.runs[names.run_count++] = i;
+        i = end;
+    }
+    names.runs[names.run_count] = index->sorted_length;
+    index_build_trigrams(index, &names);
+    index->names = names;
+}
+
+// Which records each permutation holds. by_path and by_name hold every record;
+// the others hold only what their queries can return, so a range of them is
+// exactly the answer.
+static bool index_holds_any(const struct index_record *record, const struct file_index *index) {
+    (void)record;
+    (void)index;
+    return true;
+}
+
+static bool index_holds_file(const struct index_record *record, const struct file_index *index) {
+    (void)index;
+    return S_ISREG(record->mode);
+}
+
+static bool index_holds_dated_file(const struct index_record *record, const struct file_index *index) {
+    (void)index;
+    return S_ISREG(record->mode) && !(record->flags & INDEX_FLAG_HIDDEN);
+}
+
+static bool index_holds_extension(const struct index_record *record, const struct file_index *index) {
+    return S_ISREG(record->mode) && name_extension(index_name(index, record)) != NULL;
+}
+
+struct index_permutation {
+    uint32_t **ids;
+    size_t *length;
+    int (*compare)(const void *, const void *, void *);
+    bool (*holds)(const struct index_record *, const struct file_index *);
+};
+
+static void index_permutations(struct file_index *index, struct index_permutation permutations[INDEX_PERMUTATIONS]) {
+    permutations[0] = (struct index_permutation){ &index->by_path, &index->sorted_length, compare_index_path, index_holds_any };
+    permutations[1] = (struct index_permutation){ &index->by_name, &index->sorted_length, compare_index_name, index_holds_any };
+    permutations[2] = (struct index_permutation){ &index->by_size, &index->size_length, compare_index_size, index_holds_file };
+    permutations[3] = (struct index_permutation){ &index->by_created, &index->created_length, compare_index_created, index_holds_dated_file };
+    permutations[4] = (struct index_permutation){ &index->by_extension, &index->extension_length, compare_index_extension, index_holds_extension };
+}
+
+// Fold the delta into the sorted permutations. Caller holds the write lock
+// (or owns the index privately, as during the first build).
+static int index_merge_delta(struct file_index *index) {
+    struct index_permutation permutations[INDEX_PERMUTATIONS];
+    size_t lengths[INDEX_PERMUTATIONS];
+    uint32_t *delta = malloc((index->count - index->sorted_count + 1) * sizeof(uint32_t));
+
+    if (delta == NULL) {
+        return -1;
+    }
+    index_permutations(index, permutations);
+    for (int p = 0; p < INDEX_PERMUTATIONS; p++) {
+        size_t delta_length = 0;
+        for (size_t id = index->sorted_count; id < index->count; id++) {
+            if (!index->deleted[id] && permutations[p].holds(&index->records[id], index)) {
+                delta[delta_length++] = id;
+            }
+        }
+        int merged_length = index_merge_permutation(index, permutations[p].ids, *permutations[p].length, delta, delta_length, permutations[p].compare);
+        if (merged_length == -1) {
+            free(delta);
+            return -1;
+        }
+        lengths[p] = merged_length;
+    }
+    free(delta);
+
+    // by_path and by_name share sorted_length, so the lengths are stored once all merges are done
+    for (int p = 0; p < INDEX_PERMUTATIONS; p++) {
+        *permutations[p].length = lengths[p];
+    }
+    index->sorted_count = index->count;
+    index_build_names(index);
+    return 0;
+}
+
+// Rewrite the records and arena without tombstones and renumber the permutations.
+// Only valid right after index_merge_delta(), when every live record is sorted.
+static int index_compact(struct file_index *index) {
+    struct file_index compacted = { .ready = index->ready, .root_length = index->root_length, .snapshot = index->snapshot,
+                                    .snapshot_length = index->snapshot_length };
+    uint32_t *remap = malloc((index->count + 1) * sizeof(uint32_t));
+    struct index_permutation permutations[INDEX_PERMUTATIONS], compacted_permutations[INDEX_PERMUTATIONS];
+
+    if (remap == NULL) {
+        return -1;
+    }
+    for (size_t id = 0; id < index->count; id++) {
+        if (index->deleted[id]) {
+            continue;
+        }
+        remap[id] = compacted.count;
+        if (index_push(&compacted, index_path(index, &index->records[id]), &index->records[id]) == -1) {
+            free(remap);
+            free(compacted.records);
+            free(compacted.deleted);
+            free(compacted.arena);
+            return -1;
+        }
+    }
+    index_permutations(index, permutations);
+    index_permutations(&compacted, compacted_permutations);
+    for (int p = 0; p < INDEX_PERMUTATIONS; p++) {
+        uint32_t *ids = *permutations[p].ids;
+        size_t length = 0;
+        for (size_t i = 0; i < *permutations[p].length; i++) {
+            if (!index->deleted[ids[i]]) {
+                ids[length++] = remap[ids[i]];
+            }
+        }
+        *compacted_permutations[p].ids = ids;
+        *compacted_permutations[p].length = length;
+    }
+    free(remap);
+    index_free_storage(index);
+    name_table_free(index, &index->names);
+
+    compacted.sorted_count = compacted.count;
+    *index = compacted;
+    // Dropping the tombstones moved the runs in by_name
+    index_build_names(index);
+    return 0;
+}
+
+// Lower bound of a path in the by_path permutation
+static size_t index_path_lower_bound(const char *path) {
+    size_t low = 0, high = file_index.sorted_length;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(index_path(&file_index, &file_index.records[file_index.by_path[mid]]), path) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Find the live record for a path, or -1. Caller holds the lock.
+static long index_find_path(const char *path) {
+    size_t length = strlen(path);
+
+    // The newest version of a path is the one furthest into the delta
+    for (size_t id = file_index.count; id-- > file_index.sorted_count;) {
+        const struct index_record *record = &file_index.records[id];
+        if (!file_index.deleted[id] && record->path_length == length && memcmp(index_path(&file_index, record), path, length) == 0) {
+            return id;
+        }
+    }
+    for (size_t i = index_path_lower_bound(path); i < file_index.sorted_length; i++) {
+        uint32_t id = file_index.by_path[i];
+        if (strcmp(index_path(&file_index, &file_index.records[id]), path) != 0) {
+            break;
+        }
+        if (!file_index.deleted[id]) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+static void index_delete_id(size_t id) {
+    if (!file_index.deleted[id]) {
+        file_index.deleted[id] = 1;
+        file_index.deleted_count++;
+        atomic_fetch_add(&index_stats->generation, 1);
+    }
+}
+
+// Whether a record still describes the file, down to the nanosecond
+static bool index_record_current(const struct index_record *record, const struct statx *stx) {
+    return record->size == (int64_t)stx->stx_size && record->mtime == stx->stx_mtime.tv_sec && record->mtime_nsec == stx->stx_mtime.tv_nsec &&
+           record->ctime == stx->stx_ctime.tv_sec && record->ctime_nsec == stx->stx_ctime.tv_nsec && record->mode == stx->stx_mode;
+}
+
+// Insert or refresh the record of a path. Caller holds the write lock.
+// rewritten says the contents changed: timestamps come from a coarse clock, so a
+// rewrite of the same size can leave every field equal, and cached results must
+// still be invalidated.
+static void index_upsert(const char *path, const struct statx *stx, bool rewritten) {
+    long id = index_find_path(path);
+
+    if (id != -1) {
+        if (index_record_current(&file_index.records[id], stx)) {
+            if (rewritten) {
+                atomic_fetch_add(&index_stats->generation, 1);
+            }
+            return;
+        }
+        index_delete_id(id);
+    }
+    if (index_append(&file_index, path, stx, index_path_flags(path, file_index.root_length)) == -1) {
+        log_message(ERROR, "Out of memory while updating the file index");
+    }
+    atomic_fetch_add(&index_stats->generation, 1);
+}
+
+// Delete a path and everything below it. Caller holds the write lock.
+static void index_remove_subtree(const char *path) {
+    char prefix[PATH_MAX];
+    int prefix_length = snprintf(prefix, sizeof(prefix), "%s/", path);
+    long id = index_find_path(path);
+
+    if (id != -1) {
+        index_delete_id(id);
+    }
+    if (prefix_length >= (int)sizeof(prefix)) {
+        return;
+    }
+    for (size_t i = index_path_lower_bound(prefix); i < file_index.sorted_length; i++) {
+        uint32_t child = file_index.by_path[i];
+        if (strncmp(index_path(&file_index, &file_index.records[child]), prefix, prefix_length) != 0) {
+            break;
+        }
+        index_delete_id(child);
+    }
+    for (size_t child = file_index.sorted_count; child < file_index.count; child++) {
+        if (strncmp(index_path(&file_index, &file_index.records[child]), prefix, prefix_length) == 0) {
+            index_delete_id(child);
+        }
+    }
+}
+
+// Add a directory that appeared in the tree (created or moved in), with its whole subtree
+static void index_add_subtree(const char *dir_path, const struct statx *dir_stat) {
+    DIR *dir;
+    struct dirent *entry;
+
+    pthread_rwlock_wrlock(&file_index_lock);
+    index_upsert(dir_path, dir_stat, false);
+    pthread_rwlock_unlock(&file_index_lock);
+
+    index_watch_directory(dir_path);
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char full_path[PATH_MAX];
+        struct statx stx;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(full_path) ||
+            index_lstat(full_path, &stx) == -1) {
+            continue;
+        }
+        if (S_ISDIR(stx.stx_mode)) {
+            index_add_subtree(full_path, &stx);
+        } else {
+            pthread_rwlock_wrlock(&file_index_lock);
+            index_upsert(full_path, &stx, false);
+            pthread_rwlock_unlock(&file_index_lock);
+        }
+    }
+    closedir(dir);
+}
+
+static int compare_string_pointers(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Re-read one directory after events were lost: refresh its children, drop the vanished
+// ones and walk subdirectories that are new to the index
+static void index_rescan_directory(const char *dir_path) {
+    char prefix[PATH_MAX];
+    int prefix_length = snprintf(prefix, sizeof(prefix), "%s/", dir_path);
+    char **known = NULL;
+    size_t known_count = 0, known_capacity = 0;
+    DIR *dir;
+    struct dirent *entry;
+
+    if (prefix_length >= (int)sizeof(prefix)) {
+        return;
+    }
+    atomic_fetch_add(&index_stats->rescanned_dirs, 1);
+
+    // Collect the direct children the index currently knows about: they sit in the
+    // prefix range of the sorted paths or anywhere in the delta
+    pthread_rwlock_rdlock(&file_index_lock);
+    size_t i = index_path_lower_bound(prefix);
+    size_t id = file_index.sorted_count;
+    while (1) {
+        uint32_t candidate;
+        if (i < file_index.sorted_length) {
+            candidate = file_index.by_path[i++];
+            if (strncmp(index_path(&file_index, &file_index.records[candidate]), prefix, prefix_length) != 0) {
+                i = file_index.sorted_length;
+                continue;
+            }
+        } else if (id < file_index.count) {
+            candidate = id++;
+        } else {
+            break;
+        }
+
+        const struct index_record *record = &file_index.records[candidate];
+        if (file_index.deleted[candidate] || record->name_offset != (uint32_t)prefix_length ||
+            strncmp(index_path(&file_index, record), prefix, prefix_length) != 0) {
+            continue;
+        }
+        if (known_count == known_capacity) {
+            known_capacity = known_capacity ? known_capacity * 2 : 64;
+            known = realloc(known, known_capacity * sizeof(char *));
+        }
+        known[known_count++] = strdup(index_path(&file_index, record));
+    }
+    pthread_rwlock_unlock(&file_index_lock);
+    qsort(known, known_count, sizeof(char *), compare_string_pointers);
+    uint8_t *seen = calloc(known_count + 1, 1);
+
+    dir = opendir(dir_path);
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        char full_path[PATH_MAX];
+        char *key = full_path;
+        struct statx stx;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(full_path, sizeof(full_path), "%s%s", prefix, entry->d_name) >= (int)sizeof(full_path) ||
+            index_lstat(full_path, &stx) == -1) {
+            continue;
+        }
+        char **match = bsearch(&key, known, known_count, sizeof(char *), compare_string_pointers);
+        if (match != NULL) {
+            seen[match - known] = 1;
+        }
+        if (S_ISDIR(stx.stx_mode) && match == NULL) {
+            index_add_subtree(full_path, &stx);
+        } else {
+            pthread_rwlock_wrlock(&file_index_lock);
+            index_upsert(full_path, &stx, false);
+            pthread_rwlock_unlock(&file_index_lock);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    for (size_t i = 0; i < known_count; i++) {
+        if (!seen[i]) {
+            index_unwatch_subtree(known[i]);
+            pthread_rwlock_wrlock(&file_index_lock);
+            index_remove_subtree(known[i]);
+            pthread_rwlock_unlock(&file_index_lock);
+        }
+        free(known[i]);
+    }
+    free(known);
+    free(seen);
+}
+
+// Recover from an inotify queue overflow. Only directories whose timestamps moved
+// since they were last read can have gained or lost entries, so only those are
+// re-read instead of the whole tree.
+static void index_rescan_changed_directories(void) {
+    for (int wd = 0; wd < index_watcher.capacity; wd++) {
+        struct watched_directory *watched = &index_watcher.dirs[wd];
+        struct statx stx;
+
+        if (watched->path == NULL || index_lstat(watched->path, &stx) == -1) {
+            continue;
+        }
+        if (!watched->racy && stx.stx_mtime.tv_sec == watched->mtime.tv_sec && stx.stx_mtime.tv_nsec == watched->mtime.tv_nsec &&
+            stx.stx_ctime.tv_sec == watched->ctime.tv_sec && stx.stx_ctime.tv_nsec == watched->ctime.tv_nsec) {
+            continue;
+        }
+
+        // The rescan may add watches and grow the table, so work on a copy of the path
+        char *path = strdup(watched->path);
+        index_stamp_directory(watched);
+        index_rescan_directory(path);
+        if (strcmp(path, index_root) != 0) {
+            pthread_rwlock_wrlock(&file_index_lock);
+            index_upsert(path, &stx, false);
+            pthread_rwlock_unlock(&file_index_lock);
+        }
+        free(path);
+    }
+}
+
+// Apply one inotify event to the index
+static void index_apply_event(const struct inotify_event *event) {
+    char path[PATH_MAX];
+    struct statx stx;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        atomic_fetch_add(&index_stats->overflows, 1);
+        log_message(WARNING, "inotify queue overflow, rescanning changed directories");
+        index_rescan_changed_directories();
+        return;
+    }
+    if (event->wd < 0 || event->wd >= index_watcher.capacity || index_watcher.dirs[event->wd].path == NULL) {
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        free(index_watcher.dirs[event->wd].path);
+        index_watcher.dirs[event->wd].path = NULL;
+        return;
+    }
+    if (event->len == 0) {
+        // Event on the watched directory itself; its parent reports the change
+        if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && strcmp(index_watcher.dirs[event->wd].path, index_root) == 0) {
+            log_message(WARNING, "Indexed root %s was moved or deleted", index_root);
+        }
+        return;
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", index_watcher.dirs[event->wd].path, event->name) >= (int)sizeof(path)) {
+        return;
+    }
+    atomic_fetch_add(&index_stats->events, 1);
+
+    if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) || index_lstat(path, &stx) == -1) {
+        if (event->mask & IN_ISDIR) {
+            index_unwatch_subtree(path);
+        }
+        pthread_rwlock_wrlock(&file_index_lock);
+        index_remove_subtree(path);
+        pthread_rwlock_unlock(&file_index_lock);
+    } else if (S_ISDIR(stx.stx_mode) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+        index_add_subtree(path, &stx);
+    } else {
+        pthread_rwlock_wrlock(&file_index_lock);
+        index_upsert(path, &stx, (event->mask & IN_CLOSE_WRITE) != 0);
+        pthread_rwlock_unlock(&file_index_lock);
+    }
+}
+
+// Fold a large delta or reclaim a large share of tombstones; with force, fold any delta
+static void index_fold_delta(bool force) {
+    pthread_rwlock_wrlock(&file_index_lock);
+    bool compact = file_index.deleted_count > file_index.count / 2 + INDEX_DELTA_LIMIT;
+    if (compact || file_index.count - file_index.sorted_count > INDEX_DELTA_LIMIT || (force && file_index.count > file_index.sorted_count)) {
+        if (index_merge_delta(&file_index) == 0 && (!compact || index_compact(&file_index) == 0)) {
+            atomic_fetch_add(&index_stats->merges, 1);
+        }
+    }
+    pthread_rwlock_unlock(&file_index_lock);
+}
+
+static int write_all_at(int fd, const void *data, size_t length, off_t offset) {
+    const char *p = data;
+
+    while (length > 0) {
+        ssize_t written = pwrite(fd, p, length, offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        offset += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Write the index to path. A temporary file is filled, synced and renamed over the old
+// snapshot, so a process that has the old one mapped keeps a consistent view of it. The
+// delta must be empty. Only the index thread changes the index, so it needs no lock here.
+static int index_save_snapshot(const struct file_index *index, const char *path) {
+    struct snapshot_header header = {
+        .magic = INDEX_SNAPSHOT_MAGIC,
+        .version = INDEX_SNAPSHOT_VERSION,
+        .record_size = sizeof(struct index_record),
+        .written = time(NULL),
+        .deleted_count = index->deleted_count,
+        .slot_mask = index->names.slot_mask,
+        .block_mask = index->names.block_mask,
+        .trigram_mask = index->names.trigram_mask,
+    };
+    const struct name_table *names = &index->names;
+    const void *data[SNAPSHOT_SECTIONS];
+    size_t lengths[SNAPSHOT_SECTIONS];
+    size_t dir_count = 0, paths_length = 0;
+
+    for (int wd = 0; wd < index_watcher.capacity; wd++) {
+        if (index_watcher.dirs[wd].path != NULL) {
+            dir_count++;
+            paths_length += strlen(index_watcher.dirs[wd].path) + 1;
+        }
+    }
+    struct snapshot_directory *dirs = calloc(dir_count + 1, sizeof(struct snapshot_directory));
+    char *paths = malloc(paths_length + 1);
+    if (dirs == NULL || paths == NULL) {
+        free(dirs);
+        free(paths);
+        return -1;
+    }
+    dir_count = paths_length = 0;
+    for (int wd = 0; wd < index_watcher.capacity; wd++) {
+        const struct watched_directory *watched = &index_watcher.dirs[wd];
+        if (watched->path != NULL) {
+            dirs[dir_count++] = (struct snapshot_directory){ paths_length, watched->mtime.tv_sec, watched->mtime.tv_nsec,
+                                                             watched->ctime.tv_sec, watched->ctime.tv_nsec, watched->racy };
+            strcpy(paths + paths_length, watched->path);
+            paths_length += strlen(watched->path) + 1;
+        }
+    }
+
+    data[SNAPSHOT_ROOT] = index_root;
+    lengths[SNAPSHOT_ROOT] = index->root_length + 1;
+    data[SNAPSHOT_ARENA] = index->arena;
+    lengths[SNAPSHOT_ARENA] = index->arena_length;
+    data[SNAPSHOT_RECORDS] = index->records;
+    lengths[SNAPSHOT_RECORDS] = index->count * sizeof(struct index_record);
+    data[SNAPSHOT_DELETED] = index->deleted;
+    lengths[SNAPSHOT_DELETED] = index->count;
+    data[SNAPSHOT_BY_PATH] = index->by_path;
+    lengths[SNAPSHOT_BY_PATH] = index->sorted_length * sizeof(uint32_t);
+    data[SNAPSHOT_BY_NAME] = index->by_name;
+    lengths[SNAPSHOT_BY_NAME] = index->sorted_length * sizeof(uint32_t);
+    data[SNAPSHOT_BY_SIZE] = index->by_size;
+    lengths[SNAPSHOT_BY_SIZE] = index->size_length * sizeof(uint32_t);
+    data[SNAPSHOT_BY_CREATED] = index->by_created;
+    lengths[SNAPSHOT_BY_CREATED] = index->created_length * sizeof(uint32_t);
+    data[SNAPSHOT_BY_EXTENSION] = index->by_extension;
+    lengths[SNAPSHOT_BY_EXTENSION] = index->extension_length * sizeof(uint32_t);
+    data[SNAPSHOT_NAME_SLOTS] = names->slots;
+    lengths[SNAPSHOT_NAME_SLOTS] = names->slots != NULL ? (names->slot_mask + 1) * sizeof(struct name_slot) : 0;
+    data[SNAPSHOT_BLOOM] = names->bloom;
+    lengths[SNAPSHOT_BLOOM] = names->bloom != NULL ? (names->block_mask + 1) * 8 * sizeof(uint64_t) : 0;
+    data[SNAPSHOT_RUNS] = names->runs;
+    lengths[SNAPSHOT_RUNS] = names->runs != NULL ? (names->run_count + 1) * sizeof(uint32_t) : 0;
+    data[SNAPSHOT_TRIGRAMS] = names->trigrams;
+    lengths[SNAPSHOT_TRIGRAMS] = names->trigrams != NULL ? (names->trigram_mask + 1) * sizeof(struct trigram_slot) : 0;
+    data[SNAPSHOT_POSTINGS] = names->postings;
+    lengths[SNAPSHOT_POSTINGS] = names->postings != NULL ? names->posting_count * sizeof(uint32_t) : 0;
+    data[SNAPSHOT_DIRECTORIES] = dirs;
+    lengths[SNAPSHOT_DIRECTORIES] = dir_count * sizeof(struct snapshot_directory);
+    data[SNAPSHOT_DIRECTORY_PATHS] = paths;
+    lengths[SNAPSHOT_DIRECTORY_PATHS] = paths_length;
+
+    // Sections start on a cache line, and the two that are mapped on their own on a page
+    uint64_t offset = sizeof(header);
+    for (int section = 0; section < SNAPSHOT_SECTIONS; section++) {
+        uint64_t align = section == SNAPSHOT_ARENA || section == SNAPSHOT_RECORDS ? INDEX_SNAPSHOT_PAGE : 64;
+        offset = (offset + align - 1) / align * align;
+        header.sections[section].offset = offset;
+        header.sections[section].length = lengths[section];
+        offset += lengths[section];
+    }
+    header.file_length = offset;
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int result = fd == -1 ? -1 : 0;
+    for (int section = 0; result == 0 && section < SNAPSHOT_SECTIONS; section++) {
+        result = write_all_at(fd, data[section], lengths[section], header.sections[section].offset);
+    }
+    // The header goes last, so a file cut short is never taken for a whole one
+    if (result == 0 && (ftruncate(fd, header.file_length) == -1 || write_all_at(fd, &header, sizeof(header), 0) == -1 ||
+                        fdatasync(fd) == -1 || rename(temporary, path) == -1)) {
+        result = -1;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (result == -1) {
+        unlink(temporary);
+    }
+    free(dirs);
+    free(paths);
+    return result;
+}
+
+// A snapshot section as an array, or NULL if it is empty
+static void *snapshot_section(const char *map, const struct snapshot_header *header, enum snapshot_section section) {
+    return header->sections[section].length > 0 ? (void *)(map + header->sections[section].offset) : NULL;
+}
+
+// Map a snapshot section copy-on-write at the start of an anonymous reservation of reserved
+// bytes. Pages nobody writes stay shared with every process that maps the same snapshot,
+// and records appended behind the section land in the reservation without moving the array.
+static void *snapshot_map_appendable(int fd, const struct snapshot_header *header, enum snapshot_section section, size_t reserved) {
+    void *base = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (header->sections[section].length > 0 &&
+        mmap(base, header->sections[section].length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, header->sections[section].offset) == MAP_FAILED) {
+        munmap(base, reserved);
+        return NULL;
+    }
+    return base;
+}
+
+// Load the snapshot of root at path, as written by any of the server processes. The
+// permutations and name tables are used in place from one shared read-only mapping.
+// Returns -1 if there is no snapshot of this root in the current format.
+static int index_load_snapshot(struct file_index *index, const char *root, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct snapshot_header)) {
+        close(fd);
+        return -1;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    const struct snapshot_header *header = (const struct snapshot_header *)map;
+    bool valid = memcmp(header->magic, INDEX_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 && header->version == INDEX_SNAPSHOT_VERSION &&
+                 header->record_size == sizeof(struct index_record) && header->file_length == (uint64_t)st.st_size;
+    for (int section = 0; valid && section < SNAPSHOT_SECTIONS; section++) {
+        valid = header->sections[section].offset <= header->file_length &&
+                header->sections[section].length <= header->file_length - header->sections[section].offset;
+    }
+    valid = valid && header->sections[SNAPSHOT_ROOT].length == strlen(root) + 1 && strcmp(map + header->sections[SNAPSHOT_ROOT].offset, root) == 0 &&
+            header->sections[SNAPSHOT_DELETED].length == header->sections[SNAPSHOT_RECORDS].length / sizeof(struct index_record) &&
+            header->sections[SNAPSHOT_BY_NAME].length == header->sections[SNAPSHOT_BY_PATH].length;
+    if (!valid) {
+        log_message(WARNING, "Ignoring index snapshot %s: it is damaged, of another root or of another version", path);
+        munmap((void *)map, st.st_size);
+        close(fd);
+        return -1;
+    }
+
+    struct file_index loaded = {
+        .root_length = strlen(root),
+        .arena_length = header->sections[SNAPSHOT_ARENA].length,
+        .count = header->sections[SNAPSHOT_DELETED].length,
+        .deleted_count = header->deleted_count,
+        .sorted_length = header->sections[SNAPSHOT_BY_PATH].length / sizeof(uint32_t),
+        .size_length = header->sections[SNAPSHOT_BY_SIZE].length / sizeof(uint32_t),
+        .created_length = header->sections[SNAPSHOT_BY_CREATED].length / sizeof(uint32_t),
+        .extension_length = header->sections[SNAPSHOT_BY_EXTENSION].length / sizeof(uint32_t),
+        .by_path = snapshot_section(map, header, SNAPSHOT_BY_PATH),
+        .by_name = snapshot_section(map, header, SNAPSHOT_BY_NAME),
+        .by_size = snapshot_section(map, header, SNAPSHOT_BY_SIZE),
+        .by_created = snapshot_section(map, header, SNAPSHOT_BY_CREATED),
+        .by_extension = snapshot_section(map, header, SNAPSHOT_BY_EXTENSION),
+        .names = {
+            .slots = snapshot_section(map, header, SNAPSHOT_NAME_SLOTS),
+            .slot_mask = header->slot_mask,
+            .block_mask = header->block_mask,
+            .runs = snapshot_section(map, header, SNAPSHOT_RUNS),
+            .run_count = header->sections[SNAPSHOT_RUNS].length > 0 ? header->sections[SNAPSHOT_RUNS].length / sizeof(uint32_t) - 1 : 0,
+            .trigrams = snapshot_section(map, header, SNAPSHOT_TRIGRAMS),
+            .trigram_mask = header->trigram_mask,
+            .postings = snapshot_section(map, header, SNAPSHOT_POSTINGS),
+            .posting_count = header->sections[SNAPSHOT_POSTINGS].length / sizeof(uint32_t),
+        },
+        .snapshot = map,
+        .snapshot_length = st.st_size,
+    };
+    loaded.sorted_count = loaded.count;
+    loaded.capacity = loaded.count * 2 + 4096;
+    loaded.arena_capacity = loaded.arena_length * 2 + (1 << 20);
+    loaded.records = snapshot_map_appendable(fd, header, SNAPSHOT_RECORDS, loaded.capacity * sizeof(struct index_record));
+    loaded.records_mapped = loaded.records != NULL;
+    loaded.arena = snapshot_map_appendable(fd, header, SNAPSHOT_ARENA, loaded.arena_capacity);
+    loaded.arena_mapped = loaded.arena != NULL;
+    loaded.deleted = malloc(loaded.capacity);
+    // index_append() adds the delta's names to the Bloom filter, so it needs a private copy
+    uint64_t *bloom = malloc(header->sections[SNAPSHOT_BLOOM].length + 1);
+    close(fd);
+    if (loaded.records == NULL || loaded.arena == NULL || loaded.deleted == NULL || bloom == NULL) {
+        index_free_storage(&loaded);
+        free(bloom);
+        munmap((void *)map, st.st_size);
+        return -1;
+    }
+    memcpy(loaded.deleted, map + header->sections[SNAPSHOT_DELETED].offset, loaded.count);
+    if (loaded.names.slots != NULL) {
+        memcpy(bloom, map + header->sections[SNAPSHOT_BLOOM].offset, header->sections[SNAPSHOT_BLOOM].length);
+        loaded.names.bloom = bloom;
+    } else {
+        free(bloom);
+    }
+    *index = loaded;
+    return 0;
+}
+
+// Bring an index loaded from a snapshot up to date. Every directory the snapshot recorded
+// is watched again first, so nothing that changes from here on is missed; then the ones
+// whose timestamps moved since the snapshot are re-read, as after an inotify overflow.
+// Editing a file does not touch its directory, so last of all every entry the snapshot
+// holds is stat()ed again and refreshed if it differs.
+static void index_catch_up(void) {
+    const struct snapshot_header *header = (const struct snapshot_header *)file_index.snapshot;
+    const struct snapshot_directory *dirs = snapshot_section(file_index.snapshot, header, SNAPSHOT_DIRECTORIES);
+    const char *paths = snapshot_section(file_index.snapshot, header, SNAPSHOT_DIRECTORY_PATHS);
+    size_t dir_count = header->sections[SNAPSHOT_DIRECTORIES].length / sizeof(struct snapshot_directory);
+    size_t snapshot_count = file_index.count;
+    long start = monotonic_us(), refreshed = 0;
+
+    for (size_t i = 0; i < dir_count; i++) {
+        if (dirs[i].path_offset >= header->sections[SNAPSHOT_DIRECTORY_PATHS].length) {
+            continue;
+        }
+        struct watched_directory *watched = index_watch_directory(paths + dirs[i].path_offset);
+        if (watched != NULL) {
+            watched->mtime = (struct timespec){ dirs[i].mtime_sec, dirs[i].mtime_nsec };
+            watched->ctime = (struct timespec){ dirs[i].ctime_sec, dirs[i].ctime_nsec };
+            watched->racy = dirs[i].racy;
+        }
+    }
+    index_rescan_changed_directories();
+
+    for (size_t id = 0; id < snapshot_count; id++) {
+        char path[PATH_MAX];
+        struct statx stx;
+
+        // Records may move as the delta grows, so each one is looked up again
+        const struct index_record *record = &file_index.records[id];
+        if (file_index.deleted[id] || record->path_length >= sizeof(path)) {
+            continue;
+        }
+        memcpy(path, index_path(&file_index, record), record->path_length + 1);
+        if (index_lstat(path, &stx) == -1 || !index_record_current(record, &stx)) {
+            pthread_rwlock_wrlock(&file_index_lock);
+            if (index_lstat(path, &stx) == -1) {
+                index_remove_subtree(path);
+            } else {
+                index_upsert(path, &stx, false);
+            }
+            pthread_rwlock_unlock(&file_index_lock);
+            refreshed++;
+        }
+    }
+    if (refreshed > 0) {
+        snapshot_changes = -1;
+    }
+    index_fold_delta(false);
+    log_message(INFO, "File index caught up with %s in %.3f s: %ld directories re-read, %ld entries refreshed", index_root,
+                (monotonic_us() - start) / 1e6, atomic_load(&index_stats->rescanned_dirs), refreshed);
+}
+
+
+// Fold the delta and rewrite the snapshot if the index changed since it was last written
+static void index_checkpoint(void) {
+    long changes = atomic_load(&index_stats->events) + atomic_load(&index_stats->rescanned_dirs);
+
+    snapshot_saved_us = monotonic_us();
+    if (index_snapshot_path == NULL || changes == snapshot_changes) {
+        return;
+    }
+    index_fold_delta(true);
+    // A delta that could not be merged would be lost from the snapshot's sorted lists
+    if (file_index.count != file_index.sorted_count) {
+        return;
+    }
+    if (index_save_snapshot(&file_index, index_snapshot_path) == -1) {
+        log_message(WARNING, "Could not write the index snapshot %s: %s", index_snapshot_path, strerror(errno));
+        return;
+    }
+    snapshot_changes = changes;
+    log_message(INFO, "Index snapshot %s written in %.3f s", index_snapshot_path, (monotonic_us() - snapshot_saved_us) / 1e6);
+}
+
+// Keep the index current until the process exits
+static void index_watch_loop(void) {
+    char buffer[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = index_watcher.inotify_fd, .events = POLLIN };
+
+    while (1) {
+        if (monotonic_us() - snapshot_saved_us >= INDEX_SNAPSHOT_INTERVAL_MS * 1000L) {
+            index_checkpoint();
+        }
+        if (poll(&pfd, 1, INDEX_SNAPSHOT_INTERVAL_MS) <= 0) {
+            continue;
+        }
+        long since = monotonic_us();
+        atomic_store(&index_stats->pending_since_us, since);
+
+        ssize_t length;
+        while ((length = read(index_watcher.inotify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char *p = buffer; p < buffer + length;) {
+                const struct inotify_event *event = (const struct inotify_event *)p;
+                index_apply_event(event);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        index_fold_delta(false);
+
+        atomic_store(&index_stats->last_lag_us, monotonic_us() - since);
+        atomic_store(&index_stats->pending_since_us, 0);
+    }
+}
+
+static void *index_build_thread(void *arg) {
+    const char *root = arg;
+    struct file_index built = { 0 };
+    bool loaded = index_snapshot_path != NULL && index_load_snapshot(&built, root, index_snapshot_path) == 0;
+
+    if (!loaded) {
+        built.root_length = strlen(root);
+        index_walk(&built, root, 0);
+
+        // The first build is one big delta merged into empty permutations
+        if (index_merge_delta(&built) == -1) {
+            log_message(ERROR, "Out of memory while building the file index");
+            return NULL;
+        }
+    }
+
+    // Publish the finished index
+    pthread_rwlock_wrlock(&file_index_lock);
+    built.ready = true;
+    file_index = built;
+    pthread_rwlock_unlock(&file_index_lock);
+
+    long startup_us = monotonic_us() - index_started_us;
+    atomic_store(&index_stats->startup_us, startup_us);
+    atomic_store(&index_stats->from_snapshot, loaded);
+    log_message(INFO, "File index ready: %zu entries under %s %s in %.3f s", built.count, root,
+                loaded ? "loaded from the snapshot" : "walked", startup_us / 1e6);
+
+    if (loaded) {
+        snapshot_changes = 0;
+        index_catch_up();
+    }
+    index_checkpoint();
+    if (index_watcher.inotify_fd != -1) {
+        index_watch_loop();
+    }
+    return NULL;
+}
+
+// Forked children inherit a consistent copy of the index: hold the write lock
+// across fork() so no other thread is halfway through an update
+static void index_prepare_fork(void) {
+    pthread_rwlock_wrlock(&file_index_lock);
+}
+
+static void index_after_fork_parent(void) {
+    pthread_rwlock_unlock(&file_index_lock);
+}
+
+// The child's copy of the lock records the parent thread as writer, so start it afresh.
+// Its copy of the index no longer follows the tree, so remember which generation it holds.
+static void index_after_fork_child(void) {
+    pthread_rwlock_init(&file_index_lock, NULL);
+    index_fork_generation = atomic_load(&index_stats->generation);
+}
+
+// Start building the index of the given root in the background
+void start_file_index(const char *root) {
+    pthread_t thread;
+
+    if (root == NULL) {
+        return;
+    }
+    index_root = strdup(root);
+    index_started_us = monotonic_us();
+
+    index_stats = mmap(NULL, sizeof(struct index_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (index_stats == MAP_FAILED) {
+        perror("Index statistics allocation failed");
+        return;
+    }
+    memset(index_stats, 0, sizeof(struct index_stats));
+
+    // Watches are registered during the first walk, so nothing that changes while it runs is missed
+    index_watcher.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (index_watcher.inotify_fd == -1) {
+        perror("inotify_init1 failed, the index will not follow changes");
+    }
+
+    pthread_atfork(index_prepare_fork, index_after_fork_parent, index_after_fork_child);
+    if (pthread_create(&thread, NULL, index_build_thread, (void *)index_root) != 0) {
+        perror("Index thread creation failed");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Acquire the index for reading; returns false (without holding the lock) if it is not built yet
+static bool index_acquire_built(void) {
+    pthread_rwlock_rdlock(&file_index_lock);
+    if (!file_index.ready) {
+        pthread_rwlock_unlock(&file_index_lock);
+        return false;
+    }
+    return true;
+}
+
+// Acquire the index to answer a query. Also returns false in a forked handler once the tree has
+// changed since the fork: its copy would go on missing the change for the rest of the session,
+// so the caller walks the disk instead.
+bool index_acquire(void) {
+    if (index_fork_generation != -1 && atomic_load(&index_stats->generation) != index_fork_generation) {
+        return false;
+    }
+    return index_acquire_built();
+}
+
+void index_release(void) {
+    pthread_rwlock_unlock(&file_index_lock);
+}
+
+// The generation of the index results are computed from, or -1 if they cannot be cached: without
+// a watcher nothing marks the tree as changed, and a forked handler's copy stops at the fork
+long index_generation(void) {
+    long generation;
+
+    if (index_watcher.inotify_fd == -1 || atomic_load(&index_stats->unwatched_dirs) > 0 || !index_acquire()) {
+        return -1;
+    }
+    generation = atomic_load(&index_stats->generation);
+    index_release();
+    if (index_fork_generation != -1 && generation != index_fork_generation) {
+        return -1;
+    }
+    return generation;
+}
+
+// Visit every live record with the given basename: the sorted part in path order, then the delta.
+// The visitor returns false to stop.
+void index_lookup_name(const char *name, bool (*visit)(const struct index_record *, void *), void *arg) {
+    const struct name_table *names = &file_index.names;
+    size_t low = 0, high = 0;
+
+    if (names->slots != NULL) {
+        uint64_t hash = name_hash(name);
+        // Every name in the index, the delta's included, is in the filter, so a miss ends here
+        if (!name_bloom_test(names, hash)) {
+            return;
+        }
+        for (size_t slot = hash & names->slot_mask; names->slots[slot].hash != 0; slot = (slot + 1) & names->slot_mask) {
+            const struct name_slot *entry = &names->slots[slot];
+            if (entry->hash == hash && strcmp(index_name(&file_index, &file_index.records[file_index.by_name[entry->start]]), name) == 0) {
+                low = entry->start;
+                high = entry->start + entry->count;
+                break;
+            }
+        }
+    } else {
+        high = file_index.sorted_length;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (strcmp(index_name(&file_index, &file_index.records[file_index.by_name[mid]]), name) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        high = file_index.sorted_length;
+    }
+    for (size_t i = low; i < high; i++) {
+        uint32_t id = file_index.by_name[i];
+        const struct index_record *record = &file_index.records[id];
+        if (strcmp(index_name(&file_index, record), name) != 0) {
+            break;
+        }
+        if (!file_index.deleted[id] && !visit(record, arg)) {
+            return;
+        }
+    }
+    for (size_t id = file_index.sorted_count; id < file_index.count; id++) {
+        const struct index_record *record = &file_index.records[id];
+        if (!file_index.deleted[id] && strcmp(index_name(&file_index, record), name) == 0 && !visit(record, arg)) {
+            return;
+        }
+    }
+}
+
+// A w24fs pattern. Without glob characters it matches any name that contains it;
+// with them it has to match the whole name, as with find -name.
+struct name_pattern {
+    const char *text;
+    bool glob;
+    char literals[NAME_MAX + 2];      // The runs of literal characters, each followed by '/'
+    char longest[NAME_MAX + 1];       // The longest run, which every matching name contains
+};
+
+// Split a pattern into its literal runs; returns -1 if no file name could match it
+static int name_pattern_init(struct name_pattern *pattern, const char *text) {
+    size_t length = strlen(text), out = 0, run = 0;
+
+    if (length == 0 || length > NAME_MAX || strchr(text, '/') != NULL) {
+        return -1;
+    }
+    pattern->text = text;
+    pattern->glob = strpbrk(text, "*?[") != NULL;
+    pattern->longest[0] = '\0';
+    for (size_t i = 0; i <= length; i++) {
+        char c = text[i];
+        bool literal = c != '\0';
+        if (pattern->glob && (c == '*' || c == '?')) {
+            literal = false;
+        } else if (pattern->glob && c == '[') {
+            // A bracket expression stands for one character; an unclosed '[' is literal
+            size_t end = i + 1;
+            if (text[end] == '!' || text[end] == '^') {
+                end++;
+            }
+            if (text[end] == ']') {
+                end++;
+            }
+            end += strcspn(text + end, "]");
+            if (text[end] == ']') {
+                literal = false;
+                i = end;
+            }
+        } else if (pattern->glob && c == '\\' && text[i + 1] != '\0') {
+            c = text[++i];
+        }
+        if (literal) {
+            pattern->literals[out++] = c;
+        } else if (out > run) {
+            if (out - run > strlen(pattern->longest)) {
+                memcpy(pattern->longest, pattern->literals + run, out - run);
+                pattern->longest[out - run] = '\0';
+            }
+            pattern->literals[out++] = '/';
+            run = out;
+        }
+    }
+    pattern->literals[out] = '\0';
+    return 0;
+}
+
+// glibc's strstr() scans with vector instructions, so the longest literal run rejects
+// most names before fnmatch() walks the pattern
+static bool name_pattern_match(const struct name_pattern *pattern, const char *name) {
+    if (strstr(name, pattern->longest) == NULL) {
+        return false;
+    }
+    return !pattern->glob || fnmatch(pattern->text, name, 0) == 0;
+}
+
+// Visit the live records of a run in by_name; returns false if the visitor stopped
+static bool index_visit_run(size_t start, size_t end, bool (*visit)(const struct index_record *, void *), void *arg) {
+    for (size_t i = start; i < end; i++) {
+        uint32_t id = file_index.by_name[i];
+        if (!file_index.deleted[id] && !visit(&file_index.records[id], arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The first position in list[from, count) holding a value of at least run
+static size_t posting_lower_bound(const uint32_t *list, size_t from, size_t count, uint32_t run) {
+    while (from < count) {
+        size_t mid = from + (count - from) / 2;
+        if (list[mid] < run) {
+            from = mid + 1;
+        } else {
+            count = mid;
+        }
+    }
+    return from;
+}
+
+// Visit every live record whose name matches the pattern. The names that hold all of the
+// pattern's trigrams are found by intersecting their posting lists, shortest first, and
+// only those are matched; a pattern with no trigram to look up matches every name.
+void index_search_names(const struct name_pattern *pattern, bool (*visit)(const struct index_record *, void *), void *arg) {
+    const struct name_table *names = &file_index.names;
+    uint32_t keys[NAME_MAX];
+    size_t key_count = 0;
+
+    for (const char *literal = pattern->literals; *literal != '\0'; ) {
+        size_t length = strcspn(literal, "/");
+        key_count = add_trigrams(literal, length, keys, key_count);
+        literal += length + (literal[length] == '/');
+    }
+
+    if (names->trigrams != NULL && key_count > 0) {
+        const struct trigram_slot *lists[NAME_MAX];
+        size_t positions[NAME_MAX] = { 0 };
+        bool empty = false;
+
+        for (size_t k = 0; k < key_count; k++) {
+            lists[k] = trigram_find(names->trigrams, names->trigram_mask, keys[k]);
+            empty |= lists[k]->key == 0;
+            for (size_t at = k; at > 0 && lists[at]->count < lists[at - 1]->count; at--) {
+                const struct trigram_slot *shorter = lists[at];
+                lists[at] = lists[at - 1];
+                lists[at - 1] = shorter;
+            }
+        }
+        for (size_t i = 0; !empty && i < lists[0]->count; i++) {
+            uint32_t run = names->postings[lists[0]->start + i];
+            bool candidate = true;
+            for (size_t k = 1; candidate && k < key_count; k++) {
+                const uint32_t *list = names->postings + lists[k]->start;
+                positions[k] = posting_lower_bound(list, positions[k], lists[k]->count, run);
+                candidate = positions[k] < lists[k]->count && list[positions[k]] == run;
+            }
+            if (candidate && name_pattern_match(pattern, index_name(&file_index, &file_index.records[file_index.by_name[names->runs[run]]])) &&
+                !index_visit_run(names->runs[run], names->runs[run + 1], visit, arg)) {
+                return;
+            }
+        }
+    } else if (names->runs != NULL) {
+        for (size_t run = 0; run < names->run_count; run++) {
+            if (name_pattern_match(pattern, index_name(&file_index, &file_index.records[file_index.by_name[names->runs[run]]])) &&
+                !index_visit_run(names->runs[run], names->runs[run + 1], visit, arg)) {
+                return;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < file_index.sorted_length; i++) {
+            if (name_pattern_match(pattern, index_name(&file_index, &file_index.records[file_index.by_name[i]])) && !index_visit_run(i, i + 1, visit, arg)) {
+                return;
+            }
+        }
+    }
+    for (size_t id = file_index.sorted_count; id < file_index.count; id++) {
+        const struct index_record *record = &file_index.records[id];
+        if (!file_index.deleted[id] && name_pattern_match(pattern, index_name(&file_index, record)) && !visit(record, arg)) {
+            return;
+        }
+    }
+}
+
+// Lower bound of a key in one of the numeric permutations
+static size_t index_lower_bound(const uint32_t *ids, size_t length, int64_t key, bool by_size) {
+    size_t low = 0, high = length;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const struct index_record *record = &file_index.records[ids[mid]];
+        if ((by_size ? record->size : record->created) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Visit every live regular file with min_size <= size <= max_size: the sorted part smallest
+// first, then the delta. The scan touches only the k matches after an O(log n) search.
+void index_lookup_size(int64_t min_size, int64_t max_size, bool (*visit)(const struct index_record *, void *), void *arg) {
+    for (size_t i = index_lower_bound(file_index.by_size, file_index.size_length, min_size, true); i < file_index.size_length; i++) {
+        uint32_t id = file_index.by_size[i];
+        const struct index_record *record = &file_index.records[id];
+        if (record->size > max_size) {
+            break;
+        }
+        if (!file_index.deleted[id] && !visit(record, arg)) {
+            return;
+        }
+    }
+    for (size_t id = file_index.sorted_count; id < file_index.count; id++) {
+        const struct index_record *record = &file_index.records[id];
+        if (!file_index.deleted[id] && S_ISREG(record->mode) && record->size >= min_size && record->size <= max_size && !visit(record, arg)) {
+            return;
+        }
+    }
+}
+
+// Visit every live regular file outside hidden directories with min_time <= created <= max_time:
+// the sorted part oldest first, then the delta
+void index_lookup_created(int64_t min_time, int64_t max_time, bool (*visit)(const struct index_record *, void *), void *arg) {
+    for (size_t i = index_lower_bound(file_index.by_created, file_index.created_length, min_time, false); i < file_index.created_length; i++) {
+        uint32_t id = file_index.by_created[i];
+        const struct index_record *record = &file_index.records[id];
+        if (record->created > max_time) {
+            break;
+        }
+        if (!file_index.deleted[id] && !visit(record, arg)) {
+            return;
+        }
+    }
+    for (size_t id = file_index.sorted_count; id < file_index.count; id++) {
+        const struct index_record *record = &file_index.records[id];
+        if (!file_index.deleted[id] && S_ISREG(record->mode) && !(record->flags & INDEX_FLAG_HIDDEN) &&
+            record->created >= min_time && record->created <= max_time && !visit(record, arg)) {
+            return;
+        }
+    }
+}
+
+// Visit every live regular file named "*.<extension>": the extension's posting list in
+// path order, then the delta. A multi-part extension such as "tar.gz" is looked up
+// under its last part and filtered by the whole suffix.
+void index_lookup_extension(const char *extension, bool (*visit)(const struct index_record *, void *), void *arg) {
+    const char *key = strrchr(extension, '.') != NULL ? strrchr(extension, '.') + 1 : extension;
+    size_t low = 0, high = file_index.extension_length;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(name_extension(index_name(&file_index, &file_index.records[file_index.by_extension[mid]])), key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (size_t i = low; i < file_index.extension_length; i++) {
+        uint32_t id = file_index.by_extension[i];
+        const char *name = index_name(&file_index, &file_index.records[id]);
+        if (strcmp(name_extension(name), key) != 0) {
+            break;
+        }
+        if (!file_index.deleted[id] && (key == extension || name_has_extension(name, extension)) && !visit(&file_index.records[id], arg)) {
+            return;
+        }
+    }
+    for (size_t id = file_index.sorted_count; id < file_index.count; id++) {
+        const struct index_record *record = &file_index.records[id];
+        if (!file_index.deleted[id] && index_holds_extension(record, &file_index) &&
+            name_has_extension(index_name(&file_index, record), extension) && !visit(record, arg)) {
+            return;
+        }
+    }
+}
+
+// Function to handle w24stats command: report index size and watcher health
+void handle_w24stats(int client_socket) {
+    char response[STATS_MAXSIZE];
+    size_t entries = 0, delta = 0, deleted = 0;
+    bool ready = index_acquire_built();
+    long lag_us = 0;
+
+    if (ready) {
+        entries = file_index.count - file_index.deleted_count;
+        delta = file_index.count - file_index.sorted_count;
+        deleted = file_index.deleted_count;
+        index_release();
+    }
+    if (index_stats != NULL) {
+        long pending_since = atomic_load(&index_stats->pending_since_us);
+        lag_us = pending_since ? monotonic_us() - pending_since : atomic_load(&index_stats->last_lag_us);
+    }
+
+    snprintf(response, sizeof(response),
+             "index_ready=%d\nindex_entries=%zu\nindex_delta=%zu\nindex_deleted=%zu\nindex_lag_ms=%.3f\n"
+             "index_events=%ld\nindex_overflows=%ld\nindex_rescanned_dirs=%ld\nindex_merges=%ld\n"
+             "index_from_snapshot=%ld\nindex_startup_ms=%.3f\nindex_unwatched_dirs=%ld\n",
+             ready, entries, delta, deleted, lag_us / 1000.0,
+             index_stats ? atomic_load(&index_stats->events) : 0, index_stats ? atomic_load(&index_stats->overflows) : 0,
+             index_stats ? atomic_load(&index_stats->rescanned_dirs) : 0, index_stats ? atomic_load(&index_stats->merges) : 0,
+             index_stats ? atomic_load(&index_stats->from_snapshot) : 0, index_stats ? atomic_load(&index_stats->startup_us) / 1000.0 : 0,
+             index_stats ? atomic_load(&index_stats->unwatched_dirs) : 0);
+    size_t used = strlen(response);
+    format_route_stats(response + used, sizeof(response) - used);
+    used = strlen(response);
+    format_cache_stats(response + used, sizeof(response) - used);
+    used = strlen(response);
+    format_lane_stats(response + used, sizeof(response) - used);
+    used = strlen(response);
+    snprintf(response + used, sizeof(response) - used, "io_backend=%s\n", io_backend_name());
+    send(client_socket, response, strlen(response), 0);
+}
+
+// ---------------------------------------------------------------------------
+// Parallel directory walker
+//
+// The disk fallbacks of the search handlers share one walker. Directories are
+// tasks: the thread that reads a directory pushes its subdirectories onto its
+// own deque and pops the newest one next, so each thread stays depth-first and
+// holds a single open DIR. A thread whose deque is empty steals the oldest
+// task, usually the largest unexplored subtree, from another thread. Every
+// entry is handed to a visitor, which may run on any walk thread at once and
+// can prune a directory or stop the whole walk.
+// ---------------------------------------------------------------------------
+
+#define WALK_DEQUE_INITIAL 64
+#define WALK_DIRENT_BUFFER (64 * 1024)
+#define WALK_IDLE_WAIT_US 1000     // Longest an idle thread sleeps before looking for work again
+
+enum walk_action { WALK_CONTINUE, WALK_PRUNE, WALK_STOP };
+
+struct walk_entry {
+    const char *path;              // Full path of the entry
+    const char *name;              // Final component of path
+    unsigned char type;            // DT_* type, resolved with statx when getdents did not report it
+    int dir_fd;                    // Open parent directory, for walk_statx()
+    int depth;                     // 1 for entries directly inside the root
+};
+
+typedef enum walk_action (*walk_visit_fn)(const struct walk_entry *entry, void *arg);
+
+struct walk_task {
+    char *path;
+    int depth;
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_task *tasks;       // Ring buffer: thieves take from head, the owner from the tail
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+struct walker {
+    walk_visit_fn visit;
+    void *arg;
+    int max_depth;                 // Deepest level visited; 0 means unlimited
+    int threads;
+    struct walk_deque *deques;
+    atomic_long pending;           // Directories queued or being read
+    atomic_bool stop;
+    atomic_bool root_failed;
+    atomic_int idle;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_wake;
+};
+
+struct walk_thread {
+    struct walker *walker;
+    int id;
+    unsigned long entries;
+    char *dirents;                 // getdents64() buffer, WALK_DIRENT_BUFFER bytes
+};
+
+// Walk parallelism, set from the command line
+static int walk_threads = 0;       // 0 means one per core
+
+static int walk_thread_count(void) {
+    if (walk_threads > 0) {
+        return walk_threads;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+// statx() the entry relative to its open directory without following symlinks.
+// mask names the only fields the caller reads, so the kernel can skip the rest.
+static int walk_statx(const struct walk_entry *entry, unsigned int mask, struct statx *stx) {
+    return statx(entry->dir_fd, entry->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, stx);
+}
+
+static bool walk_deque_push(struct walk_deque *deque, struct walk_task task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : WALK_DEQUE_INITIAL;
+        struct walk_task *tasks = malloc(capacity * sizeof(struct walk_task));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[(deque->head + deque->count++) % deque->capacity] = task;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+// The owner takes back the task it pushed last
+static bool walk_deque_pop(struct walk_deque *deque, struct walk_task *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->count > 0;
+    if (found) {
+        *task = deque->tasks[(deque->head + --deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// A thief takes the oldest task, which sits highest in the tree
+static bool walk_deque_steal(struct walk_deque *deque, struct walk_task *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->count > 0;
+    if (found) {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void walk_wake_idle(struct walker *walker, bool all) {
+    pthread_mutex_lock(&walker->idle_lock);
+    if (all) {
+        pthread_cond_broadcast(&walker->idle_wake);
+    } else {
+        pthread_cond_signal(&walker->idle_wake);
+    }
+    pthread_mutex_unlock(&walker->idle_lock);
+}
+
+static void walk_schedule(struct walker *walker, int id, const char *path, int depth) {
+    struct walk_task task = { strdup(path), depth };
+
+    if (task.path == NULL) {
+        return;
+    }
+    atomic_fetch_add(&walker->pending, 1);
+    if (!walk_deque_push(&walker->deques[id], task)) {
+        free(task.path);
+        atomic_fetch_sub(&walker->pending, 1);
+        return;
+    }
+    if (atomic_load(&walker->idle) > 0) {
+        walk_wake_idle(walker, false);
+    }
+}
+
+// Read one directory, visiting its entries and queueing its subdirectories
+static void walk_directory(struct walk_thread *thread, const struct walk_task *task) {
+    struct walker *walker = thread->walker;
+    char path[MAX_PATH_LENGTH];
+    ssize_t length;
+    int fd;
+
+    fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        if (task->depth == 0) {
+            atomic_store(&walker->root_failed, true);
+        }
+        return;
+    }
+    size_t base = snprintf(path, sizeof(path), "%s/", task->path);
+    if (base >= sizeof(path)) {
+        close(fd);
+        return;
+    }
+
+    // Each getdents64() call returns as many entries as fit in the buffer
+    while (!atomic_load_explicit(&walker->stop, memory_order_relaxed) &&
+           (length = getdents64(fd, thread->dirents, WALK_DIRENT_BUFFER)) > 0) {
+        for (ssize_t offset = 0; offset < length; ) {
+            struct dirent64 *d = (struct dirent64 *)(thread->dirents + offset);
+            offset += d->d_reclen;
+
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+                continue;
+            }
+            size_t name_length = strlen(d->d_name);
+            if (base + name_length >= sizeof(path)) {
+                continue;
+            }
+            memcpy(path + base, d->d_name, name_length + 1);
+
+            struct walk_entry entry = { path, path + base, d->d_type, fd, task->depth + 1 };
+            if (entry.type == DT_UNKNOWN) {
+                struct statx stx;
+                if (walk_statx(&entry, STATX_TYPE, &stx) == 0) {
+                    entry.type = IFTODT(stx.stx_mode);
+                }
+            }
+            thread->entries++;
+
+            enum walk_action action = walker->visit(&entry, walker->arg);
+            if (action == WALK_STOP) {
+                atomic_store(&walker->stop, true);
+                break;
+            }
+            if (action == WALK_CONTINUE && entry.type == DT_DIR && (walker->max_depth == 0 || entry.depth < walker->max_depth)) {
+                walk_schedule(walker, thread->id, path, entry.depth);
+            }
+        }
+    }
+    close(fd);
+}
+
+// Pop our own work, else steal, else wait until there is some or the walk is over
+static bool walk_next_task(struct walk_thread *thread, struct walk_task *task) {
+    struct walker *walker = thread->walker;
+
+    while (!atomic_load(&walker->stop)) {
+        if (walk_deque_pop(&walker->deques[thread->id], task)) {
+            return true;
+        }
+        for (int i = 1; i < walker->threads; i++) {
+            if (walk_deque_steal(&walker->deques[(thread->id + i) % walker->threads], task)) {
+                return true;
+            }
+        }
+
+        pthread_mutex_lock(&walker->idle_lock);
+        if (atomic_load(&walker->pending) == 0) {
+            pthread_mutex_unlock(&walker->idle_lock);
+            return false;
+        }
+        // A push can slip in between the steal attempts and the wait, so never sleep for long
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WALK_IDLE_WAIT_US * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        atomic_fetch_add(&walker->idle, 1);
+        pthread_cond_timedwait(&walker->idle_wake, &walker->idle_lock, &deadline);
+        atomic_fetch_sub(&walker->idle, 1);
+        pthread_mutex_unlock(&walker->idle_lock);
+    }
+    return false;
+}
+
+static void *walk_thread_main(void *arg) {
+    struct walk_thread *thread = arg;
+    struct walker *walker = thread->walker;
+    struct walk_task task;
+
+    // A thread without a buffer takes no tasks; the others steal its share
+    thread->dirents = malloc(WALK_DIRENT_BUFFER);
+    if (thread->dirents == NULL) {
+        return NULL;
+    }
+    while (walk_next_task(thread, &task)) {
+        walk_directory(thread, &task);
+        free(task.path);
+        if (atomic_fetch_sub(&walker->pending, 1) == 1) {
+            walk_wake_idle(walker, true);
+        }
+    }
+    if (atomic_load(&walker->stop)) {
+        walk_wake_idle(walker, true);
+    }
+    free(thread->dirents);
+    return NULL;
+}
+
+// Visit every entry below root with the given number of threads (0 for the
+// configured default), the calling thread being one of them. max_depth limits
+// how deep the walk goes; 1 visits only the root's own entries. Returns the
+// number of entries visited, or -1 if root could not be opened.
+long walk_tree(const char *root, int max_depth, int threads, walk_visit_fn visit, void *arg) {
+    struct walker walker = { .visit = visit, .arg = arg, .max_depth = max_depth };
+    long entries = 0;
+
+    walker.threads = threads > 0 ? threads : walk_thread_count();
+    walker.deques = calloc(walker.threads, sizeof(struct walk_deque));
+    struct walk_thread *workers = calloc(walker.threads, sizeof(struct walk_thread));
+    pthread_t *ids = calloc(walker.threads, sizeof(pthread_t));
+    if (walker.deques == NULL || workers == NULL || ids == NULL) {
+        free(walker.deques);
+        free(workers);
+        free(ids);
+        return -1;
+    }
+    pthread_mutex_init(&walker.idle_lock, NULL);
+    pthread_cond_init(&walker.idle_wake, NULL);
+    for (int i = 0; i < walker.threads; i++) {
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+        workers[i].walker = &walker;
+        workers[i].id = i;
+    }
+
+    walk_schedule(&walker, 0, root, 0);
+
+    // Helpers that fail to start are simply missing; the others steal their share
+    int started = 1;
+    for (int i = 1; i < walker.threads; i++) {
+        if (pthread_create(&ids[started], NULL, walk_thread_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    walk_thread_main(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+
+    for (int i = 0; i < walker.threads; i++) {
+        struct walk_task task;
+        // A stopped walk leaves tasks behind
+        while (walk_deque_pop(&walker.deques[i], &task)) {
+            free(task.path);
+        }
+        free(walker.deques[i].tasks);
+        pthread_mutex_destroy(&walker.deques[i].lock);
+        entries += workers[i].entries;
+    }
+    pthread_mutex_destroy(&walker.idle_lock);
+    pthread_cond_destroy(&walker.idle_wake);
+    free(walker.deques);
+    free(workers);
+    free(ids);
+    return atomic_load(&walker.root_failed) ? -1 : entries;
+}
+
+struct name_search {
+    const char *filename;
+    char *response;
+    char *found_path;
+    pthread_mutex_t lock;
+    bool found;
+};
+
+// Walk visitor for w24fn: stop at the first entry with the wanted name
+static enum walk_action match_name(const struct walk_entry *entry, void *arg) {
+    struct name_search *search = arg;
+    struct statx stx;
+
+    if (strcmp(entry->name, search->filename) != 0 || walk_statx(entry, STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) != 0) {
+        return WALK_CONTINUE;
+    }
+    pthread_mutex_lock(&search->lock);
+    // Another thread may have matched a different copy at the same moment
+    if (!search->found) {
+        char date[32];
+        time_t mtime = stx.stx_mtime.tv_sec;
+        search->found = true;
+        // Construct response string with filename, size, date created, and permissions
+        snprintf(search->response, MAXDATASIZE, "Filename: %s\nSize: %ld bytes\nDate created: %s\nPermissions: %o", entry->name, (long)stx.stx_size, ctime_r(&mtime, date), stx.stx_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+        if (search->found_path != NULL) {
+            snprintf(search->found_path, MAXDATASIZE, "%s", entry->path);
+        }
+    }
+    pthread_mutex_unlock(&search->lock);
+    return WALK_STOP;
+}
+
+// Search the tree below path for filename; found_path (MAXDATASIZE bytes, may be NULL) receives its full path
+bool search_file(const char *path, const char *filename, char *response, char *found_path) {
+    struct name_search search = { filename, response, found_path, PTHREAD_MUTEX_INITIALIZER, false };
+
+    if (walk_tree(path, 0, 0, match_name, &search) == -1) {
+        perror("Error opening directory");
+    }
+    pthread_mutex_destroy(&search.lock);
+    return search.found;
+}
+
+// Index visitor for w24fn: keep the match with the smallest path so the answer is deterministic
+static bool keep_first_path(const struct index_record *record, void *arg) {
+    const struct index_record **first = arg;
+
+    if (*first == NULL || strcmp(index_path(&file_index, record), index_path(&file_index, *first)) < 0) {
+        *first = record;
+    }
+    return true;
+}
+
+// Every index record sharing a name, for w24fn
+struct name_matches {
+    const struct index_record **records;
+    size_t count;
+    size_t capacity;
+};
+
+static bool collect_name_match(const struct index_record *record, void *arg) {
+    struct name_matches *matches = arg;
+
+    if (matches->count == matches->capacity) {
+        size_t capacity = matches->capacity == 0 ? 16 : matches->capacity * 2;
+        const struct index_record **records = realloc(matches->records, capacity * sizeof(*records));
+        if (records == NULL) {
+            return false;
+        }
+        matches->records = records;
+        matches->capacity = capacity;
+    }
+    matches->records[matches->count++] = record;
+    return true;
+}
+
+static int compare_record_paths(const void *a, const void *b) {
+    return strcmp(index_path(&file_index, *(const struct index_record *const *)a), index_path(&file_index, *(const struct index_record *const *)b));
+}
+
+// Function to handle w24fn command
+void handle_w24fn(int client_socket, const char *filename) {
+    char response[MAXDATASIZE] = "";
+    bool file_found;
+
+    if (index_acquire()) {
+        struct name_matches matches = { 0 };
+        index_lookup_name(filename, collect_name_match, &matches);
+        if (matches.count > 0) {
+            const struct index_record *record;
+            char date[32];
+            // The delta is not sorted, so order the whole set by path
+            qsort(matches.records, matches.count, sizeof(*matches.records), compare_record_paths);
+            record = matches.records[0];
+            time_t mtime = record->mtime;
+            // Construct response string with filename, size, date created, and permissions
+            int length = snprintf(response, MAXDATASIZE, "Filename: %s\nSize: %ld bytes\nDate created: %s\nPermissions: %o", index_name(&file_index, record), (long)record->size, ctime_r(&mtime, date), record->mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+            // A repeated name also lists every path, as many as fit in one reply
+            if (matches.count > 1 && length < MAXDATASIZE - 1) {
+                length += snprintf(response + length, MAXDATASIZE - 1 - length, "\nMatches: %zu", matches.count);
+                for (size_t i = 0; i < matches.count && length < MAXDATASIZE - 1; i++) {
+                    length += snprintf(response + length, MAXDATASIZE - 1 - length, "\n%s", index_path(&file_index, matches.records[i]));
+                }
+            }
+        }
+        index_release();
+        free(matches.records);
+        file_found = matches.count > 0;
+    } else {
+        file_found = search_file(getenv("HOME"), filename, response, NULL);
+    }
+
+    if (file_found) {
+        // Send response to client if file is found
+        send(client_socket, response, strlen(response), 0);
+    } else {
+        // Send "File not found" response if file is not found
+        char error_response[MAXDATASIZE];
+        snprintf(error_response, sizeof(error_response), "File '%s' not found", filename);
+        send(client_socket, error_response, strlen(error_response), 0);
+    }
+}
+
+
+
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+void *handle_client(void *arg) {
+    int client_socket = *((int *)arg);
+    char buffer[MAXDATASIZE];
+
+    // Receive client request
+    if (recv(client_socket, buffer, MAXDATASIZE, 0) == -1) {
+        perror("recv");
+        close(client_socket);
+        pthread_exit(NULL);
+    }
+
+    // Parse client request and dispatch appropriate handler
+    if (strcmp(buffer, "w24fn") == 0) {
+        // Extract filename from client request
+        char filename[MAXDATASIZE];
+        if (recv(client_socket, filename, MAXDATASIZE, 0) == -1) {
+            perror("recv");
+            close(client_socket);
+            pthread_exit(NULL);
+        }
+        handle_w24fn(client_socket, filename);
+    } else if (strcmp(buffer, "dirlist_t") == 0) {
+        handle_dirlist_t(client_socket);
+    } else if (strcmp(buffer, "w24fz") == 0) {
+        // Extract size parameters from client request
+        long size1, size2;
+        if (recv(client_socket, &size1, sizeof(long), 0) == -1 ||
+            recv(client_socket, &size2, sizeof(long), 0) == -1) {
+            perror("recv");
+            close(client_socket);
+            pthread_exit(NULL);
+        }
+        handle_w24fz(client_socket, size1, size2);
+    } else if (strcmp(buffer, "w24ft") == 0) {
+        // Extract extensions from client request
+        char extensions[MAXDATASIZE];
+        if (recv(client_socket, extensions, MAXDATASIZE, 0) == -1) {
+            perror("recv");
+            close(client_socket);
+            pthread_exit(NULL);
+        }
+        handle_w24ft(client_socket, extensions);
+    } else if (strcmp(buffer, "w24fdb") == 0) {
+        // Extract date from client request
+        char date[MAXDATASIZE];
+        if (recv(client_socket, date, MAXDATASIZE, 0) == -1) {
+            perror("recv");
+            close(client_socket);
+            pthread_exit(NULL);
+        }
+        handle_w24fdb(client_socket, date);
+    } else if (strcmp(buffer, "w24fda") == 0) {
+        // Extract date from client request
+        char date[MAXDATASIZE];
+        if (recv(client_socket, date, MAXDATASIZE, 0) == -1) {
+            perror("recv");
+            close(client_socket);
+            pthread_exit(NULL);
+        }
+        handle_w24fda(client_socket, date);
+    } else if (strcmp(buffer, "dirlist") == 0) {
+        handleDirectoryListing(client_socket, "");
+    } else {
+        log_message(ERROR, "Unknown command received: %s", buffer);
+    }
+
+    close(client_socket);
+    pthread_exit(NULL);
+}
+
+
+
+// ---------------------------------------------------------------------------
+// Block-parallel gzip
+//
+// The tar stream is cut into independent blocks of gzip_block_size bytes that
+// the compression pool deflates concurrently, pigz style: each block is raw
+// deflate primed with the last 32 KiB of the previous block as a dictionary
+// and ends with a sync flush, so the outputs simply concatenate. The per-block
+// CRC-32s are folded together with crc32_combine() for the gzip trailer, and
+// the result is an ordinary .gz that stock gzip and tar can read.
+// ---------------------------------------------------------------------------
+
+#define GZIP_DICTIONARY_SIZE 32768
+#define GZIP_DEFAULT_BLOCK_SIZE (128 * 1024)
+#define GZIP_MAX_INFLIGHT 64
+
+struct parallel_gzip;
+
+struct gzip_block {
+    struct parallel_gzip *owner;
+    unsigned char *input;
+    size_t input_length;
+    unsigned char dictionary[GZIP_DICTIONARY_SIZE];
+    size_t dictionary_length;
+    bool last;
+    unsigned char *output;
+    size_t output_length;
+    uLong crc;
+    bool done;
+    bool failed;
+    struct gzip_block *next_job;
+};
+
+// One gzip member being produced; emit() receives the compressed bytes in order
+struct parallel_gzip {
+    int (*emit)(void *context, const void *data, size_t length);
+    void *context;
+    int window;                        // Blocks allowed in flight at once
+    pthread_mutex_t lock;
+    pthread_cond_t block_done;
+    struct gzip_block *inflight[GZIP_MAX_INFLIGHT];
+    int inflight_head;
+    int inflight_count;
+    struct gzip_block *current;        // Block being filled
+    unsigned char previous_tail[GZIP_DICTIONARY_SIZE];
+    size_t previous_tail_length;
+    uLong crc;
+    uint64_t total_input;
+    bool failed;
+};
+
+// Compression settings, set from the command line
+static int gzip_threads = 0;           // 0 means one per core
+static size_t gzip_block_size = GZIP_DEFAULT_BLOCK_SIZE;
+
+// Shared compression pool, started lazily in the process that needs it
+static pthread_mutex_t gzip_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gzip_pool_ready = PTHREAD_COND_INITIALIZER;
+static struct gzip_block *gzip_jobs_head;
+static struct gzip_block *gzip_jobs_tail;
+static int gzip_pool_size;
+static pid_t gzip_pool_pid;
+
+static int gzip_thread_count(void) {
+    if (gzip_threads > 0) {
+        return gzip_threads;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+static void gzip_compress_block(struct gzip_block *block) {
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    block->crc = crc32(0L, block->input, block->input_length);
+    // Negative windowBits produces raw deflate; the gzip wrapper is written by hand
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        block->failed = true;
+        return;
+    }
+    if (block->dictionary_length > 0) {
+        deflateSetDictionary(&zs, block->dictionary, block->dictionary_length);
+    }
+
+    // The bound covers a finished stream; a sync flush adds at most an empty stored block
+    size_t capacity = deflateBound(&zs, block->input_length) + 64;
+    block->output = malloc(capacity);
+    if (block->output == NULL) {
+        deflateEnd(&zs);
+        block->failed = true;
+        return;
+    }
+    zs.next_in = block->input;
+    zs.avail_in = block->input_length;
+    zs.next_out = block->output;
+    zs.avail_out = capacity;
+    int status = deflate(&zs, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+    // Running out of room would leave flushed output pending inside zlib
+    if (status == Z_STREAM_ERROR || zs.avail_in != 0 || zs.avail_out == 0 || (block->last && status != Z_STREAM_END)) {
+        block->failed = true;
+    }
+    block->output_length = capacity - zs.avail_out;
+    deflateEnd(&zs);
+}
+
+static void *gzip_worker_main(void *arg) {
+    (void)arg;
+
+    // Compression only ever serves archives, which give way to interactive commands
+    lane_lower_priority();
+    while (1) {
+        pthread_mutex_lock(&gzip_pool_lock);
+        while (gzip_jobs_head == NULL) {
+            pthread_cond_wait(&gzip_pool_ready, &gzip_pool_lock);
+        }
+        struct gzip_block *block = gzip_jobs_head;
+        gzip_jobs_head = block->next_job;
+        if (gzip_jobs_head == NULL) {
+            gzip_jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&gzip_pool_lock);
+
+        gzip_compress_block(block);
+
+        struct parallel_gzip *owner = block->owner;
+        pthread_mutex_lock(&owner->lock);
+        block->done = true;
+        pthread_cond_broadcast(&owner->block_done);
+        pthread_mutex_unlock(&owner->lock);
+    }
+    return NULL;
+}
+
+// Make sure this process has a pool of at least the given size. Threads do not
+// survive fork(), so a forked connection handler starts its own.
+static void gzip_pool_start(int threads) {
+    pthread_mutex_lock(&gzip_pool_lock);
+    if (gzip_pool_pid != getpid()) {
+        gzip_pool_pid = getpid();
+        gzip_pool_size = 0;
+        gzip_jobs_head = gzip_jobs_tail = NULL;
+    }
+    while (gzip_pool_size < threads) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, gzip_worker_main, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        gzip_pool_size++;
+    }
+    pthread_mutex_unlock(&gzip_pool_lock);
+}
+
+// Forking while another thread holds the pool lock would leave it locked forever in the child
+static void gzip_pool_after_fork_child(void) {
+    pthread_mutex_init(&gzip_pool_lock, NULL);
+    pthread_cond_init(&gzip_pool_ready, NULL);
+}
+
+static void gzip_submit(struct gzip_block *block) {
+    block->next_job = NULL;
+    pthread_mutex_lock(&gzip_pool_lock);
+    if (gzip_jobs_tail != NULL) {
+        gzip_jobs_tail->next_job = block;
+    } else {
+        gzip_jobs_head = block;
+    }
+    gzip_jobs_tail = block;
+    pthread_cond_signal(&gzip_pool_ready);
+    pthread_mutex_unlock(&gzip_pool_lock);
+}
+
+static struct gzip_block *gzip_new_block(struct parallel_gzip *gz) {
+    struct gzip_block *block = calloc(1, sizeof(struct gzip_block));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->input = malloc(gzip_block_size);
+    if (block->input == NULL) {
+        free(block);
+        return NULL;
+    }
+    block->owner = gz;
+    memcpy(block->dictionary, gz->previous_tail, gz->previous_tail_length);
+    block->dictionary_length = gz->previous_tail_length;
+    return block;
+}
+
+static void gzip_free_block(struct gzip_block *block) {
+    free(block->input);
+    free(block->output);
+    free(block);
+}
+
+// Wait for the oldest block in flight and emit its output
+static int gzip_emit_oldest(struct parallel_gzip *gz) {
+    struct gzip_block *block = gz->inflight[gz->inflight_head];
+
+    pthread_mutex_lock(&gz->lock);
+    while (!block->done) {
+        pthread_cond_wait(&gz->block_done, &gz->lock);
+    }
+    pthread_mutex_unlock(&gz->lock);
+
+    gz->inflight_head = (gz->inflight_head + 1) % GZIP_MAX_INFLIGHT;
+    gz->inflight_count--;
+
+    if (block->failed) {
+        gz->failed = true;
+    }
+    if (!gz->failed && block->output_length > 0 && gz->emit(gz->context, block->output, block->output_length) == -1) {
+        gz->failed = true;
+    }
+    gz->crc = crc32_combine(gz->crc, block->crc, block->input_length);
+    gzip_free_block(block);
+    return gz->failed ? -1 : 0;
+}
+
+// Hand the block being filled to the pool (or compress it here when running single-threaded)
+static int gzip_dispatch_current(struct parallel_gzip *gz, bool last) {
+    struct gzip_block *block = gz->current;
+
+    gz->current = NULL;
+    block->last = last;
+
+    // The tail of this block primes the next one
+    size_t tail = block->input_length < GZIP_DICTIONARY_SIZE ? block->input_length : GZIP_DICTIONARY_SIZE;
+    if (tail < GZIP_DICTIONARY_SIZE && gz->previous_tail_length + tail > GZIP_DICTIONARY_SIZE) {
+        size_t keep = GZIP_DICTIONARY_SIZE - tail;
+        memmove(gz->previous_tail, gz->previous_tail + gz->previous_tail_length - keep, keep);
+        gz->previous_tail_length = keep;
+    } else if (tail == GZIP_DICTIONARY_SIZE) {
+        gz->previous_tail_length = 0;
+    }
+    memcpy(gz->previous_tail + gz->previous_tail_length, block->input + block->input_length - tail, tail);
+    gz->previous_tail_length += tail;
+
+    if (gz->inflight_count == gz->window && gzip_emit_oldest(gz) == -1) {
+        gzip_free_block(block);
+        return -1;
+    }
+    gz->inflight[(gz->inflight_head + gz->inflight_count) % GZIP_MAX_INFLIGHT] = block;
+    gz->inflight_count++;
+
+    if (gz->window == 1) {
+        gzip_compress_block(block);
+        block->done = true;
+    } else {
+        gzip_submit(block);
+    }
+    return 0;
+}
+
+// Start a gzip member with the given parallelism (0 uses the configured thread count)
+int parallel_gzip_init(struct parallel_gzip *gz, int threads, int (*emit)(void *, const void *, size_t), void *context) {
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+    memset(gz, 0, sizeof(*gz));
+    gz->emit = emit;
+    gz->context = context;
+    gz->crc = crc32(0L, Z_NULL, 0);
+    if (threads <= 0) {
+        threads = gzip_thread_count();
+    }
+    // Keep two blocks per thread queued so workers never wait on the producer
+    gz->window = threads == 1 ? 1 : (threads * 2 < GZIP_MAX_INFLIGHT ? threads * 2 : GZIP_MAX_INFLIGHT);
+    if (threads > 1) {
+        gzip_pool_start(threads);
+    }
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->block_done, NULL);
+    return emit(context, header, sizeof(header));
+}
+
+// Free space at the end of the block being filled, so callers can read() straight
+// into it instead of staging the data in a buffer of their own; NULL once the member failed
+unsigned char *parallel_gzip_reserve(struct parallel_gzip *gz, size_t *room) {
+    if (gz->failed) {
+        return NULL;
+    }
+    if (gz->current == NULL && (gz->current = gzip_new_block(gz)) == NULL) {
+        gz->failed = true;
+        return NULL;
+    }
+    *room = gzip_block_size - gz->current->input_length;
+    return gz->current->input + gz->current->input_length;
+}
+
+// Account for length bytes written into the space returned by parallel_gzip_reserve()
+int parallel_gzip_commit(struct parallel_gzip *gz, size_t length) {
+    gz->current->input_length += length;
+    gz->total_input += length;
+    if (gz->current->input_length == gzip_block_size && gzip_dispatch_current(gz, false) == -1) {
+        return -1;
+    }
+    return gz->failed ? -1 : 0;
+}
+
+int parallel_gzip_write(struct parallel_gzip *gz, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+
+    while (length > 0) {
+        size_t room;
+        unsigned char *space = parallel_gzip_reserve(gz, &room);
+        if (space == NULL) {
+            return -1;
+        }
+        size_t take = length < room ? length : room;
+        memcpy(space, bytes, take);
+        bytes += take;
+        length -= take;
+        if (parallel_gzip_commit(gz, take) == -1) {
+            return -1;
+        }
+    }
+    return gz->failed ? -1 : 0;
+}
+
+// Flush the last block and write the trailer; always releases the member's resources
+int parallel_gzip_finish(struct parallel_gzip *gz) {
+    unsigned char trailer[8];
+
+    if (!gz->failed && gz->current == NULL) {
+        gz->current = gzip_new_block(gz);
+    }
+    if (gz->current != NULL) {
+        if (gz->failed) {
+            gzip_free_block(gz->current);
+            gz->current = NULL;
+        } else {
+            gzip_dispatch_current(gz, true);
+        }
+    }
+    while (gz->inflight_count > 0) {
+        gzip_emit_oldest(gz);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (gz->crc >> (8 * i)) & 0xff;
+        trailer[4 + i] = (gz->total_input >> (8 * i)) & 0xff;
+    }
+    if (!gz->failed && gz->emit(gz->context, trailer, sizeof(trailer)) == -1) {
+        gz->failed = true;
+    }
+    pthread_mutex_destroy(&gz->lock);
+    pthread_cond_destroy(&gz->block_done);
+    return gz->failed ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// io_uring backend
+//
+// With --io-backend uring, archives of index matches stat, open and read
+// their members through an io_uring, a window at a time, instead of making
+// five system calls per file. There is no liburing here, so this is the
+// small part of it they need: set up a ring, prepare submission entries,
+// and submit a batch while waiting for all of its completions. Every
+// entry's user_data points at the int that receives its result, so a batch
+// needs no bookkeeping beyond its own arrays.
+//
+// A ring is set up per archive rather than per thread, so nothing has to
+// survive fork() or outlive a helper thread, and an archive that cannot get
+// one uses plain system calls. Replies are still sent with send(): there is
+// one per 64 KiB of compressed output, too few to be worth batching.
+// ---------------------------------------------------------------------------
+
+#define URING_ARCHIVE_DEPTH 32          // Archive members stat'ed, opened and read ahead at once
+#define URING_STAGE_SIZE 65536          // Bytes read ahead per member into its registered buffer
+#define URING_ARCHIVE_MIN_FILES 8       // Shorter lists are not worth setting up a ring for
+
+static bool uring_enabled = false;
+
+const char *io_backend_name(void) {
+    return uring_enabled ? "uring" : "sync";
+}
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned pending;                   // Prepared and not yet submitted
+    void *rings;                        // Submission and completion rings, one mapping
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    atomic_uint *sq_head;
+    atomic_uint *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    atomic_uint *cq_head;
+    atomic_uint *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+    ring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->rings_size) {
+        ring->rings_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->rings != MAP_FAILED) {
+            munmap(ring->rings, ring->rings_size);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        return -1;
+    }
+    char *base = ring->rings;
+    ring->sq_head = (atomic_uint *)(base + params.sq_off.head);
+    ring->sq_tail = (atomic_uint *)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->cq_head = (atomic_uint *)(base + params.cq_off.head);
+    ring->cq_tail = (atomic_uint *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_free(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd); // Also closes the registered files and unpins the registered buffers
+}
+
+static int uring_register(struct uring *ring, unsigned opcode, const void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, ring->fd, opcode, arg, count);
+}
+
+// Next free submission entry, cleared, whose result will be stored in *result.
+// Callers prepare at most as many entries per batch as the ring holds.
+static struct io_uring_sqe *uring_prepare(struct uring *ring, unsigned char opcode, int fd, int *result) {
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->pending;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)result;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    ring->pending++;
+    return sqe;
+}
+
+// Submit the prepared entries and wait until every one of them has completed
+static int uring_run(struct uring *ring) {
+    unsigned outstanding = ring->pending;
+    unsigned to_submit = ring->pending;
+
+    atomic_store_explicit(ring->sq_tail, atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->pending, memory_order_release);
+    ring->pending = 0;
+    while (outstanding > 0) {
+        unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+        for (; head != tail && outstanding > 0; head++, outstanding--) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            *(int *)(uintptr_t)cqe->user_data = cqe->res;
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+        if (outstanding == 0) {
+            break;
+        }
+        long entered = syscall(__NR_io_uring_enter, ring->fd, to_submit, outstanding, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (entered == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        unsigned submitted = (unsigned)entered;
+        to_submit -= submitted < to_submit ? submitted : to_submit;
+    }
+    return 0;
+}
+
+static void uring_prepare_statx(struct uring *ring, int dir_fd, const char *path, int flags, unsigned mask, struct statx *stx, int *result) {
+    struct io_uring_sqe *sqe = uring_prepare(ring, IORING_OP_STATX, dir_fd, result);
+
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = mask;
+    sqe->off = (uint64_t)(uintptr_t)stx;
+    sqe->statx_flags = flags;
+}
+
+// Open the current directory into an empty registered slot, the way archive members are
+// opened. Sparse file tables and direct opens came after the opcodes themselves (5.15), and
+// a kernel without them either refuses the registration or hands back a plain descriptor.
+static bool uring_direct_open_works(struct uring *ring) {
+    int files[1] = { -1 };
+    int result = -1;
+
+    if (uring_register(ring, IORING_REGISTER_FILES, files, 1) == -1) {
+        return false;
+    }
+    struct io_uring_sqe *sqe = uring_prepare(ring, IORING_OP_OPENAT, AT_FDCWD, &result);
+    sqe->addr = (uint64_t)(uintptr_t)".";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    if (uring_run(ring) == -1) {
+        return false;
+    }
+    if (result > 0) {
+        close(result); // file_index was ignored
+    }
+    errno = result < 0 ? -result : ENOSYS;
+    return result == 0;
+}
+
+// Check at startup that the kernel has every operation and feature the backend uses
+static bool uring_supported(void) {
+    static const unsigned char needed[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED };
+    size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    struct uring ring;
+    bool supported = probe != NULL && uring_init(&ring, 4) == 0;
+
+    if (supported) {
+        supported = uring_register(&ring, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+        for (size_t i = 0; supported && i < sizeof(needed); i++) {
+            supported = needed[i] < probe->ops_len && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+        }
+        supported = supported && uring_direct_open_works(&ring);
+        uring_free(&ring);
+    }
+    free(probe);
+    return supported;
+}
+
+// ---------------------------------------------------------------------------
+// Streaming tar.gz writer
+//
+// Archive commands no longer shell out to tar. Each matched file gets a ustar
+// header (plus a pax extended header when its name, size, owner or mtime does not fit) and
+// its contents are compressed in-process by the block-parallel gzip engine,
+// whose output goes straight into the client socket.
+//
+// On the wire an archive starts with ARCHIVE_MAGIC, followed by chunks of
+// gzip data, each prefixed with its length as a 32-bit big-endian integer; a
+// zero-length chunk ends the archive. The magic starts with a NUL byte, so a
+// client can tell an archive from the plain text replies ("No file found", ...).
+// ---------------------------------------------------------------------------
+
+#define ARCHIVE_MAGIC "\0W24TGZ\n"
+#define ARCHIVE_MAGIC_LENGTH 8
+#define ARCHIVE_CHUNK_SIZE 65536
+#define TAR_BLOCK_SIZE 512
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+struct tar_stream {
+    int client_socket;
+    bool started;
+    bool failed;
+    size_t files;
+    bool yields;                                  // Pauses for interactive commands (heavy lane)
+    long slice_started_us;
+    struct parallel_gzip gz;
+    size_t chunk_length;
+    unsigned char chunk[4 + ARCHIVE_CHUNK_SIZE];  // Length prefix followed by compressed data
+    unsigned char padding[TAR_BLOCK_SIZE];        // Zeros that round members up to a whole block
+};
+
+// Send a whole buffer, retrying short writes
+static int send_all(int socket_fd, const void *buffer, size_t length) {
+    const char *data = buffer;
+
+    while (length > 0) {
+        ssize_t sent = send(socket_fd, data, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Send part of the archive response, keeping a copy for the result cache
+static int tar_stream_send(struct tar_stream *ts, const void *data, size_t length) {
+    if (send_all(ts->client_socket, data, length) == -1) {
+        return -1;
+    }
+    result_capture_append(data, length);
+    return 0;
+}
+
+// Send the compressed bytes collected so far as one chunk
+static int tar_stream_flush_chunk(struct tar_stream *ts) {
+    uint32_t prefix = htonl(ts->chunk_length);
+
+    if (ts->chunk_length == 0) {
+        return 0;
+    }
+    memcpy(ts->chunk, &prefix, 4);
+    if (tar_stream_send(ts, ts->chunk, 4 + ts->chunk_length) == -1) {
+        ts->failed = true;
+        return -1;
+    }
+    ts->chunk_length = 0;
+    return 0;
+}
+
+// Output callback of the gzip engine: pack compressed bytes into chunks
+static int tar_stream_emit(void *context, const void *data, size_t length) {
+    struct tar_stream *ts = context;
+    const unsigned char *bytes = data;
+
+    while (length > 0) {
+        size_t take = ARCHIVE_CHUNK_SIZE - ts->chunk_length;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(ts->chunk + 4 + ts->chunk_length, bytes, take);
+        ts->chunk_length += take;
+        bytes += take;
+        length -= take;
+        if (ts->chunk_length == ARCHIVE_CHUNK_SIZE && tar_stream_flush_chunk(ts) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Feed uncompressed tar bytes to the gzip engine
+static int tar_stream_write(struct tar_stream *ts, const void *data, size_t length) {
+    if (parallel_gzip_write(&ts->gz, data, length) == -1) {
+        ts->failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+static int tar_stream_start(struct tar_stream *ts) {
+    ts->started = true;
+    ts->chunk_length = 0;
+
+    if (tar_stream_send(ts, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LENGTH) == -1 ||
+        parallel_gzip_init(&ts->gz, 0, tar_stream_emit, ts) == -1) {
+        ts->failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+void tar_stream_init(struct tar_stream *ts, int client_socket) {
+    ts->client_socket = client_socket;
+    ts->started = false;
+    ts->failed = false;
+    ts->files = 0;
+    ts->yields = lane_should_yield();
+    ts->slice_started_us = monotonic_us();
+}
+
+// Whether a number fits the width - 1 octal digits of a header field
+static bool tar_number_fits(size_t width, int64_t value) {
+    return value >= 0 && (uint64_t)value < 1ULL << (3 * (width - 1));
+}
+
+// Write a numeric header field in octal, NUL-terminated like GNU tar does. A value
+// that does not fit is written as 0 and carried by a pax record instead.
+static void tar_number(char *field, size_t width, int64_t value) {
+    uint64_t digits = tar_number_fits(width, value) ? (uint64_t)value : 0;
+
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; i--, digits >>= 3) {
+        field[i - 1] = '0' + (digits & 7);
+    }
+}
+
+// Copy text into a header field, cut to the field's width; the field is already zeroed
+static void tar_text(char *field, size_t width, const char *text) {
+    size_t length = strlen(text);
+
+    memcpy(field, text, length < width ? length : width);
+}
+
+// Append one "length key=value\n" pax record; the length counts its own digits
+static size_t pax_record(char *buffer, size_t offset, size_t capacity, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3; // ' ', '=' and '\n'
+    size_t length = body + 1;
+    char digits[24];
+
+    while (length != body + (size_t)snprintf(digits, sizeof(digits), "%zu", length)) {
+        length = body + strlen(digits);
+    }
+    if (offset + length > capacity) {
+        return offset;
+    }
+    return offset + snprintf(buffer + offset, capacity - offset, "%zu %s=%s\n", length, key, value);
+}
+
+static void tar_fill_header(struct tar_header *header, const char *name, const struct stat *st, char typeflag, uint64_t size) {
+    memset(header, 0, sizeof(*header));
+    tar_text(header->name, sizeof(header->name), name);
+    tar_number(header->mode, sizeof(header->mode), st->st_mode & 07777);
+    tar_number(header->uid, sizeof(header->uid), st->st_uid);
+    tar_number(header->gid, sizeof(header->gid), st->st_gid);
+    tar_number(header->size, sizeof(header->size), size > INT64_MAX ? -1 : (int64_t)size);
+    tar_number(header->mtime, sizeof(header->mtime), st->st_mtime);
+    header->typeflag = typeflag;
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+}
+
+static void tar_checksum(struct tar_header *header) {
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned int sum = 0;
+
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    for (size_t i = 0; i < sizeof(*header); i++) {
+        sum += bytes[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", sum);
+}
+
+// Emit the header block(s) for one member, using a pax header for long names, long
+// link targets, sizes beyond the 8 GiB ustar limit, large ids and mtimes before 1970
+// or after 2242
+static int tar_write_header(struct tar_stream *ts, const char *name, const char *link_target, const struct stat *st, char typeflag, uint64_t size) {
+    struct tar_header header;
+    size_t name_length = strlen(name);
+    bool split = false;
+    bool big_size = size > 077777777777ULL;
+    bool big_uid = !tar_number_fits(sizeof(header.uid), st->st_uid);
+    bool big_gid = !tar_number_fits(sizeof(header.gid), st->st_gid);
+    bool big_mtime = !tar_number_fits(sizeof(header.mtime), st->st_mtime);
+
+    if (name_length > sizeof(header.name)) {
+        // ustar can hold up to 255 characters by splitting the name at a '/'
+        const char *slash = name_length <= sizeof(header.prefix) + 1 + sizeof(header.name) ? strchr(name + name_length - sizeof(header.name) - 1, '/') : NULL;
+        split = slash != NULL && slash > name && (size_t)(slash - name) <= sizeof(header.prefix) && strlen(slash + 1) <= sizeof(header.name);
+    }
+
+    if ((name_length > sizeof(header.name) && !split) || big_size || big_uid || big_gid || big_mtime || (link_target && strlen(link_target) > sizeof(header.linkname))) {
+        char records[3 * PATH_MAX];
+        char number[24];
+        size_t length = 0;
+
+        if (name_length > sizeof(header.name)) {
+            length = pax_record(records, length, sizeof(records), "path", name);
+        }
+        if (link_target && strlen(link_target) > sizeof(header.linkname)) {
+            length = pax_record(records, length, sizeof(records), "linkpath", link_target);
+        }
+        if (big_size) {
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)size);
+            length = pax_record(records, length, sizeof(records), "size", number);
+        }
+        if (big_uid) {
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)st->st_uid);
+            length = pax_record(records, length, sizeof(records), "uid", number);
+        }
+        if (big_gid) {
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)st->st_gid);
+            length = pax_record(records, length, sizeof(records), "gid", number);
+        }
+        if (big_mtime) {
+            snprintf(number, sizeof(number), "%lld", (long long)st->st_mtime);
+            length = pax_record(records, length, sizeof(records), "mtime", number);
+        }
+
+        tar_fill_header(&header, "././@PaxHeader", st, 'x', length);
+        tar_checksum(&header);
+        if (tar_stream_write(ts, &header, sizeof(header)) == -1) {
+            return -1;
+        }
+        memset(records + length, 0, (TAR_BLOCK_SIZE - length % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+        if (tar_stream_write(ts, records, (length + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE) == -1) {
+            return -1;
+        }
+        split = false;
+    }
+
+    tar_fill_header(&header, name, st, typeflag, size);
+    if (split) {
+        const char *slash = strchr(name + name_length - sizeof(header.name) - 1, '/');
+        memset(header.name, 0, sizeof(header.name));
+        memcpy(header.prefix, name, slash - name);
+        tar_text(header.name, sizeof(header.name), slash + 1);
+    }
+    if (link_target) {
+        tar_text(header.linkname, sizeof(header.linkname), link_target);
+    }
+    tar_checksum(&header);
+    return tar_stream_write(ts, &header, sizeof(header));
+}
+
+// Where a member's body comes from: the first staged_length bytes, already read
+// ahead, then read_at() for the rest
+struct tar_body {
+    const unsigned char *staged;
+    size_t staged_length;
+    ssize_t (*read_at)(void *context, void *buffer, size_t length, uint64_t offset);
+    void *context;
+};
+
+static ssize_t tar_body_pread(void *context, void *buffer, size_t length, uint64_t offset) {
+    return pread(*(int *)context, buffer, length, offset);
+}
+
+// Add one member whose metadata is known, starting the stream on the first one
+static int tar_stream_add_member(struct tar_stream *ts, const char *path, const struct stat *st, const char *link_target, struct tar_body *body) {
+    const char *name = path;
+
+    // Like tar, store absolute paths relative to the root
+    while (*name == '/') {
+        name++;
+    }
+    if (!ts->started && tar_stream_start(ts) == -1) {
+        return -1;
+    }
+
+    uint64_t size = S_ISREG(st->st_mode) ? (uint64_t)st->st_size : 0;
+    if (tar_write_header(ts, name, link_target, st, link_target != NULL ? '2' : '0', size) == -1) {
+        return -1;
+    }
+
+    // Copy exactly the size announced in the header, zero-filling if the file shrank.
+    // The body is read straight into the gzip block, the only copy it needs before deflate.
+    uint64_t done = 0;
+    if (body != NULL && body->staged_length > 0) {
+        done = body->staged_length < size ? body->staged_length : size;
+        if (tar_stream_write(ts, body->staged, done) == -1) {
+            return -1;
+        }
+    }
+    while (done < size) {
+        size_t room;
+        if (ts->yields) {
+            lane_yield(&ts->slice_started_us);
+        }
+        unsigned char *space = parallel_gzip_reserve(&ts->gz, &room);
+        if (space == NULL) {
+            ts->failed = true;
+            return -1;
+        }
+        size_t want = size - done < room ? size - done : room;
+        ssize_t got = body->read_at(body->context, space, want, done);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            memset(space, 0, want);
+            got = want;
+        }
+        if (parallel_gzip_commit(&ts->gz, got) == -1) {
+            ts->failed = true;
+            return -1;
+        }
+        done += got;
+    }
+
+    // Pad the member to a whole number of blocks
+    if (size % TAR_BLOCK_SIZE != 0) {
+        memset(ts->padding, 0, TAR_BLOCK_SIZE);
+        if (tar_stream_write(ts, ts->padding, TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) == -1) {
+            return -1;
+        }
+    }
+
+    ts->files++;
+    return 0;
+}
+
+// Add one file to the archive, starting the stream on the first one.
+// Unreadable files are skipped, as tar does; returns -1 only if the client is gone.
+int tar_stream_add_file(struct tar_stream *ts, const char *path) {
+    struct stat st;
+    char link_target[PATH_MAX];
+    int fd = -1;
+
+    if (ts->failed) {
+        return -1;
+    }
+    if (ts->yields) {
+        lane_yield(&ts->slice_started_us);
+    }
+
+    if (lstat(path, &st) == -1) {
+        return 0;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        ssize_t length = readlink(path, link_target, sizeof(link_target) - 1);
+        if (length == -1) {
+            return 0;
+        }
+        link_target[length] = '\0';
+        return tar_stream_add_member(ts, path, &st, link_target, NULL);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return 0; // Devices, sockets and fifos are not archived
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    struct tar_body body = { NULL, 0, tar_body_pread, &fd };
+    int result = tar_stream_add_member(ts, path, &st, NULL, &body);
+    close(fd);
+    return result;
+}
+
+// Close the archive: two zero blocks, the gzip trailer and the terminating empty chunk
+int tar_stream_finish(struct tar_stream *ts) {
+    static const char end_blocks[2 * TAR_BLOCK_SIZE];
+    uint32_t terminator = 0;
+    int result = -1;
+
+    if (!ts->started) {
+        return 0;
+    }
+    if (!ts->failed) {
+        tar_stream_write(ts, end_blocks, sizeof(end_blocks));
+    }
+    // Always finish the gzip member so blocks still in the pool are reclaimed
+    if (parallel_gzip_finish(&ts->gz) == 0 && !ts->failed && tar_stream_flush_chunk(ts) == 0 &&
+        tar_stream_send(ts, &terminator, sizeof(terminator)) == 0) {
+        result_capture_complete();
+        result = 0;
+    }
+    return result;
+}
+
+// Growable list of matched paths, copied out of the index so the archive can be
+// streamed without holding the index lock
+struct path_list {
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+static bool path_list_push(struct path_list *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            return false;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = strdup(path);
+    return list->paths[list->count++] != NULL;
+}
+
+static void path_list_free(struct path_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = list->capacity = 0;
+}
+
+// An archive's read-ahead state under the io_uring backend: one window of members at a time
+struct uring_archive {
+    struct uring ring;
+    unsigned char *stage;               // URING_ARCHIVE_DEPTH buffers of URING_STAGE_SIZE bytes
+    bool fixed_buffers;                 // stage is registered with the ring
+    struct statx stx[URING_ARCHIVE_DEPTH];
+    int stat_result[URING_ARCHIVE_DEPTH];
+    int open_result[URING_ARCHIVE_DEPTH];
+    int read_result[URING_ARCHIVE_DEPTH];
+};
+
+// Reads the rest of a member from its fixed-file slot
+struct uring_member {
+    struct uring *ring;
+    int slot;
+};
+
+static ssize_t tar_body_uring_read(void *context, void *buffer, size_t length, uint64_t offset) {
+    struct uring_member *member = context;
+    int result;
+    struct io_uring_sqe *sqe = uring_prepare(member->ring, IORING_OP_READ, member->slot, &result);
+
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    if (uring_run(member->ring) == -1) {
+        return -1;
+    }
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+
+// The fields of a statx result that the tar header uses
+static void stat_from_statx(struct stat *st, const struct statx *stx) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = stx->stx_mode;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+static bool uring_archive_init(struct uring_archive *ua) {
+    int files[URING_ARCHIVE_DEPTH];
+
+    // Each member takes an open and a linked read
+    if (uring_init(&ua->ring, URING_ARCHIVE_DEPTH * 2) == -1) {
+        return false;
+    }
+    for (int k = 0; k < URING_ARCHIVE_DEPTH; k++) {
+        files[k] = -1; // Empty slots, filled by direct opens
+    }
+    ua->stage = mmap(NULL, URING_ARCHIVE_DEPTH * URING_STAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ua->stage == MAP_FAILED || uring_register(&ua->ring, IORING_REGISTER_FILES, files, URING_ARCHIVE_DEPTH) == -1) {
+        if (ua->stage != MAP_FAILED) {
+            munmap(ua->stage, URING_ARCHIVE_DEPTH * URING_STAGE_SIZE);
+        }
+        uring_free(&ua->ring);
+        return false;
+    }
+    // Pinning the buffers counts against RLIMIT_MEMLOCK; without them the reads still work
+    struct iovec stage = { ua->stage, URING_ARCHIVE_DEPTH * URING_STAGE_SIZE };
+    ua->fixed_buffers = uring_register(&ua->ring, IORING_REGISTER_BUFFERS, &stage, 1) == 0;
+    return true;
+}
+
+static void uring_archive_free(struct uring_archive *ua) {
+    uring_free(&ua->ring);
+    munmap(ua->stage, URING_ARCHIVE_DEPTH * URING_STAGE_SIZE);
+}
+
+// Stat, open and read ahead the members list->paths[first..first+count). One submission
+// stats them all; a second opens every regular file into the fixed-file slot of its
+// position, each open linked to a read of its first URING_STAGE_SIZE bytes. An open
+// replaces whatever file the slot held from the previous window.
+static int uring_archive_prefetch(struct uring_archive *ua, const struct path_list *list, size_t first, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        uring_prepare_statx(&ua->ring, AT_FDCWD, list->paths[first + k], AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_BASIC_STATS, &ua->stx[k], &ua->stat_result[k]);
+    }
+    if (uring_run(&ua->ring) == -1) {
+        return -1;
+    }
+    for (size_t k = 0; k < count; k++) {
+        ua->open_result[k] = ua->read_result[k] = -ENOENT;
+        if (ua->stat_result[k] != 0 || !S_ISREG(ua->stx[k].stx_mode)) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_prepare(&ua->ring, IORING_OP_OPENAT, AT_FDCWD, &ua->open_result[k]);
+        sqe->addr = (uint64_t)(uintptr_t)list->paths[first + k];
+        sqe->open_flags = O_RDONLY | O_NOFOLLOW;
+        sqe->file_index = k + 1;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_prepare(&ua->ring, ua->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, k, &ua->read_result[k]);
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t)(uintptr_t)(ua->stage + k * URING_STAGE_SIZE);
+        sqe->len = ua->stx[k].stx_size < URING_STAGE_SIZE ? ua->stx[k].stx_size : URING_STAGE_SIZE;
+        sqe->buf_index = 0;
+    }
+    return uring_run(&ua->ring);
+}
+
+// Stream the listed files through io_uring, URING_ARCHIVE_DEPTH at a time, so a window of
+// small files costs two system calls instead of five per file. Returns how many paths it
+// took care of, which is 0 if no ring could be set up.
+static size_t tar_stream_add_list_uring(struct tar_stream *ts, const struct path_list *list) {
+    struct uring_archive *ua = malloc(sizeof(struct uring_archive));
+    size_t first = 0;
+
+    if (ua == NULL || !uring_archive_init(ua)) {
+        free(ua);
+        return 0;
+    }
+    for (; first < list->count && !ts->failed; first += URING_ARCHIVE_DEPTH) {
+        size_t count = list->count - first < URING_ARCHIVE_DEPTH ? list->count - first : URING_ARCHIVE_DEPTH;
+        if (uring_archive_prefetch(ua, list, first, count) == -1) {
+            break; // The caller adds the rest with plain system calls
+        }
+        for (size_t k = 0; k < count && !ts->failed; k++) {
+            const char *path = list->paths[first + k];
+            struct stat st;
+
+            if (ts->yields) {
+                lane_yield(&ts->slice_started_us);
+            }
+            if (ua->stat_result[k] != 0) {
+                continue;
+            }
+            stat_from_statx(&st, &ua->stx[k]);
+            if (S_ISLNK(st.st_mode)) {
+                char link_target[PATH_MAX];
+                ssize_t length = readlink(path, link_target, sizeof(link_target) - 1);
+                if (length != -1) {
+                    link_target[length] = '\0';
+                    tar_stream_add_member(ts, path, &st, link_target, NULL);
+                }
+            } else if (S_ISREG(st.st_mode) && ua->open_result[k] >= 0) {
+                struct uring_member member = { &ua->ring, k };
+                struct tar_body body = { ua->stage + k * URING_STAGE_SIZE, ua->read_result[k] > 0 ? ua->read_result[k] : 0,
+                                         tar_body_uring_read, &member };
+                tar_stream_add_member(ts, path, &st, NULL, &body);
+            }
+        }
+    }
+    uring_archive_free(ua);
+    free(ua);
+    return first;
+}
+
+// Stream every listed file into the archive
+static void tar_stream_add_list(struct tar_stream *ts, const struct path_list *list) {
+    size_t i = 0;
+
+    if (uring_enabled && list->count >= URING_ARCHIVE_MIN_FILES) {
+        i = tar_stream_add_list_uring(ts, list);
+    }
+    for (; i < list->count && !ts->failed; i++) {
+        tar_stream_add_file(ts, list->paths[i]);
+    }
+}
+
+// Finish an archive response, or tell the client nothing matched
+static void finish_archive_response(int client_socket, struct tar_stream *ts, const char *empty_message) {
+    if (!ts->started) {
+        result_capture_append(empty_message, strlen(empty_message));
+        result_capture_complete();
+        send(client_socket, empty_message, strlen(empty_message), 0);
+        return;
+    }
+    if (tar_stream_finish(ts) == -1) {
+        log_message(WARNING, "Archive transfer to client failed: %s", strerror(errno));
+    }
+}
+
+// Shared state for handlers that stream walk matches into an archive
+struct archive_walk {
+    struct tar_stream *archive;
+    pthread_mutex_t lock;          // Serialises writes to the archive
+    bool found;
+    int64_t min_time;
+    int64_t max_time;
+    long min_size;
+    long max_size;
+    char **extensions;
+    int extension_count;
+};
+
+static void archive_walk_init(struct archive_walk *walk, struct tar_stream *archive) {
+    memset(walk, 0, sizeof(*walk));
+    walk->archive = archive;
+    pthread_mutex_init(&walk->lock, NULL);
+}
+
+// Add a match to the archive, stopping the walk once the client is gone
+static enum walk_action archive_walk_add(struct archive_walk *walk, const char *path) {
+    pthread_mutex_lock(&walk->lock);
+    if (!walk->archive->failed) {
+        tar_stream_add_file(walk->archive, path);
+        walk->found = true;
+    }
+    bool failed = walk->archive->failed;
+    pthread_mutex_unlock(&walk->lock);
+    return failed ? WALK_STOP : WALK_CONTINUE;
+}
+
+// ---------------------------------------------------------------------------
+// Zero-copy file delivery
+//
+// "w24fn --content <filename>" downloads the file itself. The response is
+// FILE_MAGIC, the size as a 64-bit big-endian integer, then exactly that many
+// bytes. The body goes from the page cache to the socket with sendfile(), so it
+// never enters user space. Starting the server with --copy-path read switches
+// to a read()/send() loop to compare the two.
+//
+// Archive members cannot take this path: their bytes have to pass through
+// deflate, so they are read straight into the gzip block buffers instead.
+// ---------------------------------------------------------------------------
+
+#define FILE_MAGIC "\0W24FIL\n"
+#define FILE_MAGIC_LENGTH 8
+#define FILE_COPY_BUFFER_SIZE 65536
+#define SENDFILE_MAX_CHUNK (1L << 30)
+
+static bool zero_copy_enabled = true;
+
+// Send length zero bytes, standing in for the tail of a file that shrank mid-transfer
+static int send_zeros(int socket_fd, uint64_t length) {
+    static const char zeros[FILE_COPY_BUFFER_SIZE];
+
+    while (length > 0) {
+        size_t take = length < sizeof(zeros) ? length : sizeof(zeros);
+        if (send_all(socket_fd, zeros, take) == -1) {
+            return -1;
+        }
+        length -= take;
+    }
+    return 0;
+}
+
+// Copy the first length bytes of fd to the socket through a user-space buffer
+static int copy_file_body(int socket_fd, int fd, off_t offset, uint64_t length) {
+    char *buffer = malloc(FILE_COPY_BUFFER_SIZE);
+
+    if (buffer == NULL) {
+        return -1;
+    }
+    while (length > 0) {
+        size_t want = length < FILE_COPY_BUFFER_SIZE ? length : FILE_COPY_BUFFER_SIZE;
+        ssize_t got = pread(fd, buffer, want, offset);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        if (send_all(socket_fd, buffer, got) == -1) {
+            free(buffer);
+            return -1;
+        }
+        offset += got;
+        length -= got;
+    }
+    free(buffer);
+    return send_zeros(socket_fd, length);
+}
+
+// Send exactly length bytes of fd from offset, zero-filling if the file shrank
+static int send_file_body(int socket_fd, int fd, off_t offset, uint64_t length) {
+    if (!zero_copy_enabled) {
+        return copy_file_body(socket_fd, fd, offset, length);
+    }
+    while (length > 0) {
+        size_t want = length < (uint64_t)SENDFILE_MAX_CHUNK ? length : SENDFILE_MAX_CHUNK;
+        ssize_t sent = sendfile(socket_fd, fd, &offset, want);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Some filesystems cannot feed sendfile(); copy whatever is left instead
+            if (errno == EINVAL || errno == ENOSYS) {
+                return copy_file_body(socket_fd, fd, offset, length);
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            break;
+        }
+        length -= sent;
+    }
+    return send_zeros(socket_fd, length);
+}
+
+// Handle "w24fn --content <filename>": locate the file like w24fn and send its contents
+void handle_w24fn_content(int client_socket, const char *filename) {
+    char path[MAXDATASIZE] = "";
+    char response[MAXDATASIZE];
+    bool file_found;
+
+    if (index_acquire()) {
+        const struct index_record *record = NULL;
+        index_lookup_name(filename, keep_first_path, &record);
+        if (record != NULL) {
+            snprintf(path, sizeof(path), "%s", index_path(&file_index, record));
+        }
+        index_release();
+        file_found = record != NULL;
+    } else {
+        file_found = search_file(getenv("HOME"), filename, response, path);
+    }
+
+    if (!file_found) {
+        snprintf(response, sizeof(response), "File '%s' not found", filename);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        snprintf(response, sizeof(response), "File '%s' cannot be downloaded", filename);
+        send(client_socket, response, strlen(response), 0);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    unsigned char header[FILE_MAGIC_LENGTH + 8];
+    memcpy(header, FILE_MAGIC, FILE_MAGIC_LENGTH);
+    for (int i = 0; i < 8; i++) {
+        header[FILE_MAGIC_LENGTH + i] = ((uint64_t)st.st_size >> (56 - 8 * i)) & 0xff;
+    }
+    if (send_all(client_socket, header, sizeof(header)) == -1 || send_file_body(client_socket, fd, 0, st.st_size) == -1) {
+        log_message(WARNING, "File transfer to client failed: %s", strerror(errno));
+    }
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// Directory listing
+//
+// "dirlist -a" lists the working directory in name order. Names are read with
+// getdents64() straight into one arena, sorted with an MSD radix sort, and
+// streamed as LISTING_MAGIC followed by length-prefixed chunks of
+// newline-terminated names, ending with an empty chunk: the framing of the
+// archive responses.
+//
+// "dirlist -a --limit N --after NAME" returns one page: the first N names
+// after NAME. Only the page is kept, in a bounded max-heap, so paging
+// through a directory of millions of entries takes constant memory. NAME runs
+// to the end of the line, and clients pass the last name of a page to get
+// the next one.
+//
+// "dirlist -t" lists the same names oldest first by birth time, in the same
+// framing. Its result is cached with the directory's mtime as generation, so
+// repeating it on an unchanged directory skips the statx() of every entry.
+// ---------------------------------------------------------------------------
+
+#define LISTING_MAGIC "\0W24LST\n"
+#define LISTING_MAGIC_LENGTH 8
+#define LISTING_ARENA_INITIAL 65536
+#define LISTING_PAGE_MAX 10000
+#define RADIX_SORT_CUTOFF 32          // Buckets smaller than this are finished by insertion sort
+#define LISTING_STAT_BATCH 4096       // Fewest entries worth a thread of their own in dirlist -t
+
+// Names of one directory, back to back
+struct listing {
+    char *arena;
+    size_t arena_length;
+    size_t arena_capacity;
+    size_t *offsets;                  // Of each name in the arena
+    size_t count;
+    size_t capacity;
+};
+
+// The smallest names after a cursor, as a max-heap so the largest is replaced first
+struct listing_page {
+    char (*names)[NAME_MAX + 1];
+    size_t count;
+    size_t limit;
+};
+
+struct listing_stream {
+    int client_socket;
+    size_t chunk_length;
+    unsigned char chunk[4 + ARCHIVE_CHUNK_SIZE];
+};
+
+static int listing_add(struct listing *listing, const char *name, size_t length) {
+    if (listing->arena_length + length + 1 > listing->arena_capacity) {
+        size_t capacity = listing->arena_capacity ? listing->arena_capacity * 2 : LISTING_ARENA_INITIAL;
+        while (capacity < listing->arena_length + length + 1) {
+            capacity *= 2;
+        }
+        char *arena = realloc(listing->arena, capacity);
+        if (arena == NULL) {
+            return -1;
+        }
+        listing->arena = arena;
+        listing->arena_capacity = capacity;
+    }
+    if (listing->count == listing->capacity) {
+        size_t capacity = listing->capacity ? listing->capacity * 2 : 1024;
+        size_t *offsets = realloc(listing->offsets, capacity * sizeof(size_t));
+        if (offsets == NULL) {
+            return -1;
+        }
+        listing->offsets = offsets;
+        listing->capacity = capacity;
+    }
+    listing->offsets[listing->count++] = listing->arena_length;
+    memcpy(listing->arena + listing->arena_length, name, length + 1);
+    listing->arena_length += length + 1;
+    return 0;
+}
+
+static void listing_free(struct listing *listing) {
+    free(listing->arena);
+    free(listing->offsets);
+}
+
+static void page_sift_down(struct listing_page *page, size_t i) {
+    char name[NAME_MAX + 1];
+
+    memcpy(name, page->names[i], sizeof(name));
+    while (2 * i + 1 < page->count) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < page->count && strcmp(page->names[child + 1], page->names[child]) > 0) {
+            child++;
+        }
+        if (strcmp(page->names[child], name) <= 0) {
+            break;
+        }
+        memcpy(page->names[i], page->names[child], sizeof(name));
+        i = child;
+    }
+    memcpy(page->names[i], name, sizeof(name));
+}
+
+// Keep a name if it is among the limit smallest seen so far
+static void page_offer(struct listing_page *page, const char *name, size_t length) {
+    if (page->count < page->limit) {
+        size_t i = page->count++;
+        // Sift up
+        while (i > 0 && strcmp(page->names[(i - 1) / 2], name) < 0) {
+            memcpy(page->names[i], page->names[(i - 1) / 2], sizeof(page->names[0]));
+            i = (i - 1) / 2;
+        }
+        memcpy(page->names[i], name, length + 1);
+    } else if (page->count > 0 && strcmp(name, page->names[0]) < 0) {
+        memcpy(page->names[0], name, length + 1);
+        page_sift_down(page, 0);
+    }
+}
+
+// MSD radix sort of names sharing their first depth bytes. The byte at depth of every name is
+// gathered into keys first, so each pass reads each string once, and a pass sorts by scattering
+// pointers into scratch.
+static void radix_sort_names(const char **names, const char **scratch, unsigned char *keys, size_t count, size_t depth) {
+    size_t counts[256] = { 0 };
+    size_t starts[256];
+
+    if (count < RADIX_SORT_CUTOFF) {
+        for (size_t i = 1; i < count; i++) {
+            const char *name = names[i];
+            size_t j = i;
+            while (j > 0 && strcmp(names[j - 1] + depth, name + depth) > 0) {
+                names[j] = names[j - 1];
+                j--;
+            }
+            names[j] = name;
+        }
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = (unsigned char)names[i][depth];
+        counts[keys[i]]++;
+    }
+    size_t start = 0;
+    for (int c = 0; c < 256; c++) {
+        starts[c] = start;
+        start += counts[c];
+    }
+    for (size_t i = 0; i < count; i++) {
+        scratch[starts[keys[i]]++] = names[i];
+    }
+    memcpy(names, scratch, count * sizeof(char *));
+
+    // Bucket 0 holds names that ended at depth, which are all equal
+    start = counts[0];
+    for (int c = 1; c < 256; c++) {
+        if (counts[c] > 1) {
+            radix_sort_names(names + start, scratch, keys, counts[c], depth + 1);
+        }
+        start += counts[c];
+    }
+}
+
+// Sort an array of names; false if the scratch space could not be allocated
+static bool sort_names(const char **names, size_t count) {
+    const char **scratch = malloc(count * sizeof(char *));
+    unsigned char *keys = malloc(count);
+
+    if (scratch == NULL || keys == NULL) {
+        free(scratch);
+        free(keys);
+        return false;
+    }
+    radix_sort_names(names, scratch, keys, count, 0);
+    free(scratch);
+    free(keys);
+    return true;
+}
+
+static int listing_stream_flush(struct listing_stream *ls) {
+    uint32_t prefix = htonl(ls->chunk_length);
+
+    if (ls->chunk_length == 0) {
+        return 0;
+    }
+    memcpy(ls->chunk, &prefix, 4);
+    if (send_all(ls->client_socket, ls->chunk, 4 + ls->chunk_length) == -1) {
+        return -1;
+    }
+    result_capture_append(ls->chunk, 4 + ls->chunk_length);
+    ls->chunk_length = 0;
+    return 0;
+}
+
+static int listing_stream_name(struct listing_stream *ls, const char *name) {
+    size_t length = strlen(name);
+
+    if (ls->chunk_length + length + 1 > ARCHIVE_CHUNK_SIZE && listing_stream_flush(ls) == -1) {
+        return -1;
+    }
+    memcpy(ls->chunk + 4 + ls->chunk_length, name, length);
+    ls->chunk[4 + ls->chunk_length + length] = '\n';
+    ls->chunk_length += length + 1;
+    return 0;
+}
+
+// Send sorted names, then the terminating empty chunk
+static int send_listing(int client_socket, const char **names, size_t count) {
+    struct listing_stream *ls = malloc(sizeof(struct listing_stream));
+    uint32_t terminator = 0;
+    int result = -1;
+
+    if (ls == NULL) {
+        return -1;
+    }
+    ls->client_socket = client_socket;
+    ls->chunk_length = 0;
+    if (send_all(client_socket, LISTING_MAGIC, LISTING_MAGIC_LENGTH) == 0) {
+        size_t i = 0;
+        result_capture_append(LISTING_MAGIC, LISTING_MAGIC_LENGTH);
+        while (i < count && listing_stream_name(ls, names[i]) == 0) {
+            i++;
+        }
+        if (i == count && listing_stream_flush(ls) == 0 && send_all(client_socket, &terminator, sizeof(terminator)) == 0) {
+            result_capture_append(&terminator, sizeof(terminator));
+            result_capture_complete();
+            result = 0;
+        }
+    }
+    free(ls);
+    return result;
+}
+
+// Read the names of a directory, either all of them or just one page
+static int read_listing(const char *path, const char *after, struct listing *listing, struct listing_page *page) {
+    char *dirents;
+    ssize_t length;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+    dirents = malloc(WALK_DIRENT_BUFFER);
+    if (dirents == NULL) {
+        close(fd);
+        return -1;
+    }
+    while ((length = getdents64(fd, dirents, WALK_DIRENT_BUFFER)) > 0) {
+        for (ssize_t offset = 0; offset < length; ) {
+            struct dirent64 *d = (struct dirent64 *)(dirents + offset);
+            offset += d->d_reclen;
+            if (after != NULL && strcmp(d->d_name, after) <= 0) {
+                continue;
+            }
+            if (page != NULL) {
+                page_offer(page, d->d_name, strlen(d->d_name));
+            } else if (listing_add(listing, d->d_name, strlen(d->d_name)) == -1) {
+                length = -1;
+                break;
+            }
+        }
+        if (length == -1) {
+            break;
+        }
+    }
+    free(dirents);
+    close(fd);
+    return length == 0 ? 0 : -1;
+}
+
+// Function to handle dirlist -a [--limit N] [--after NAME]: list the working directory in name order
+void handleDirectoryListing(int client_socket, const char *options) {
+    struct listing listing = { 0 };
+    struct listing_page page = { 0 };
+    const char *after = NULL;
+    const char **names = NULL;
+    size_t count = 0;
+    bool listed = false;
+
+    options += strspn(options, " ");
+    if (strncmp(options, "--limit ", 8) == 0) {
+        char *end;
+        long limit = strtol(options + 8, &end, 10);
+        if (end == options + 8 || limit < 1 || limit > LISTING_PAGE_MAX) {
+            char response[MAXDATASIZE];
+            snprintf(response, sizeof(response), "Invalid limit: use 1 to %d", LISTING_PAGE_MAX);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+        page.limit = limit;
+        options = end + strspn(end, " ");
+    }
+    if (strncmp(options, "--after ", 8) == 0) {
+        after = options + 8;
+    } else if (*options != '\0') {
+        char response[] = "Usage: dirlist -a [--limit N] [--after NAME]";
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    if (page.limit > 0) {
+        page.names = malloc(page.limit * sizeof(page.names[0]));
+        names = malloc(page.limit * sizeof(char *));
+        if (page.names != NULL && names != NULL && read_listing(".", after, NULL, &page) == 0) {
+            for (size_t i = 0; i < page.count; i++) {
+                names[i] = page.names[i];
+            }
+            count = page.count;
+            listed = true;
+        }
+    } else if (read_listing(".", after, &listing, NULL) == 0) {
+        names = malloc((listing.count ? listing.count : 1) * sizeof(char *));
+        if (names != NULL) {
+            for (size_t i = 0; i < listing.count; i++) {
+                names[i] = listing.arena + listing.offsets[i];
+            }
+            count = listing.count;
+            listed = true;
+        }
+    }
+
+    if (!listed || !sort_names(names, count)) {
+        log_message(ERROR, "Error listing directory: %s", strerror(errno));
+        send(client_socket, "Error opening directory", strlen("Error opening directory"), 0);
+    } else if (send_listing(client_socket, names, count) == -1) {
+        log_message(WARNING, "Listing transfer to client failed: %s", strerror(errno));
+    }
+    free(names);
+    free(page.names);
+    listing_free(&listing);
+}
+
+// dirlist -t entries as parallel arrays, so the sort passes stream through the keys alone
+struct timed_listing {
+    const char **names;               // In name order
+    uint64_t *created;                // Birth time in nanoseconds, sign bit flipped so it sorts unsigned
+    uint32_t *order;                  // Positions in names, oldest first once sorted
+    size_t count;
+};
+
+// Birth time of a directory entry in nanoseconds; filesystems without one fall back to ctime
+static int64_t entry_created_ns(int dir_fd, const char *name) {
+    struct statx stx;
+
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC, STATX_CTIME | STATX_BTIME, &stx) != 0) {
+        return 0;
+    }
+    if (stx.stx_mask & STATX_BTIME) {
+        return stx.stx_btime.tv_sec * 1000000000LL + stx.stx_btime.tv_nsec;
+    }
+    return stx.stx_ctime.tv_sec * 1000000000LL + stx.stx_ctime.tv_nsec;
+}
+
+// A slice of a timed listing whose birth times one thread fetches
+struct created_batch {
+    struct timed_listing *timed;
+    int dir_fd;
+    size_t start;
+    size_t end;
+};
+
+static void *fetch_created(void *arg) {
+    struct created_batch *batch = arg;
+
+    for (size_t i = batch->start; i < batch->end; i++) {
+        batch->timed->created[i] = (uint64_t)entry_created_ns(batch->dir_fd, batch->timed->names[i]) ^ (1ULL << 63);
+        batch->timed->order[i] = i;
+    }
+    return NULL;
+}
+
+// Fetch every birth time. There is no batched statx(), so large directories are split into
+// contiguous batches, one per walk thread, to keep several lookups in flight. (io_uring
+// batches the calls but runs every statx on a kernel worker thread, which measured slower.)
+static void fetch_all_created(struct timed_listing *timed, int dir_fd) {
+    int threads = walk_thread_count();
+    struct created_batch batches[threads];
+    pthread_t ids[threads];
+    bool started[threads];
+
+    if (timed->count < LISTING_STAT_BATCH * 2) {
+        threads = 1;
+    } else if ((size_t)threads > timed->count / LISTING_STAT_BATCH) {
+        threads = timed->count / LISTING_STAT_BATCH;
+    }
+    for (int t = 0; t < threads; t++) {
+        batches[t] = (struct created_batch){ timed, dir_fd, timed->count * t / threads, timed->count * (t + 1) / threads };
+    }
+    // The calling thread takes the first batch itself, and any batch whose thread failed to start
+    for (int t = 1; t < threads; t++) {
+        started[t] = pthread_create(&ids[t], NULL, fetch_created, &batches[t]) == 0;
+        if (!started[t]) {
+            fetch_created(&batches[t]);
+        }
+    }
+    fetch_created(&batches[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(ids[t], NULL);
+        }
+    }
+}
+
+// Stable LSD radix sort of order by created, a byte per pass. Passes over a byte that every key
+// shares, like the high bytes of timestamps from the same era, are skipped.
+static bool sort_by_created(struct timed_listing *timed) {
+    uint64_t *keys = malloc(timed->count * sizeof(uint64_t));
+    uint32_t *order = malloc(timed->count * sizeof(uint32_t));
+
+    if (keys == NULL || order == NULL) {
+        free(keys);
+        free(order);
+        return false;
+    }
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = { 0 };
+        for (size_t i = 0; i < timed->count; i++) {
+            counts[(timed->created[i] >> shift) & 0xff]++;
+        }
+        if (timed->count == 0 || counts[(timed->created[0] >> shift) & 0xff] == timed->count) {
+            continue;
+        }
+        size_t start = 0;
+        for (int c = 0; c < 256; c++) {
+            size_t bucket = counts[c];
+            counts[c] = start;
+            start += bucket;
+        }
+        for (size_t i = 0; i < timed->count; i++) {
+            size_t slot = counts[(timed->created[i] >> shift) & 0xff]++;
+            keys[slot] = timed->created[i];
+            order[slot] = timed->order[i];
+        }
+        memcpy(timed->created, keys, timed->count * sizeof(uint64_t));
+        memcpy(timed->order, order, timed->count * sizeof(uint32_t));
+    }
+    free(keys);
+    free(order);
+    return true;
+}
+
+// Function to handle dirlist -t: list the working directory oldest first by birth time. The names
+// are sorted first, so entries born at the same instant stay in name order through the stable sort.
+void handle_dirlist_t(int client_socket) {
+    struct listing listing = { 0 };
+    struct timed_listing timed = { 0 };
+    const char **ordered = NULL;
+    bool listed = false;
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir_fd != -1 && read_listing(".", NULL, &listing, NULL) == 0) {
+        timed.count = listing.count;
+        timed.names = malloc((timed.count ? timed.count : 1) * sizeof(char *));
+        timed.created = malloc((timed.count ? timed.count : 1) * sizeof(uint64_t));
+        timed.order = malloc((timed.count ? timed.count : 1) * sizeof(uint32_t));
+        ordered = malloc((timed.count ? timed.count : 1) * sizeof(char *));
+    }
+    if (ordered != NULL && timed.names != NULL && timed.created != NULL && timed.order != NULL) {
+        for (size_t i = 0; i < timed.count; i++) {
+            timed.names[i] = listing.arena + listing.offsets[i];
+        }
+        if (sort_names(timed.names, timed.count)) {
+            fetch_all_created(&timed, dir_fd);
+            listed = sort_by_created(&timed);
+        }
+    }
+
+    if (!listed) {
+        log_message(ERROR, "Error listing directory: %s", strerror(errno));
+        send(client_socket, "Error opening directory", strlen("Error opening directory"), 0);
+    } else {
+        for (size_t i = 0; i < timed.count; i++) {
+            ordered[i] = timed.names[timed.order[i]];
+        }
+        if (send_listing(client_socket, ordered, timed.count) == -1) {
+            log_message(WARNING, "Listing transfer to client failed: %s", strerror(errno));
+        }
+    }
+    if (dir_fd != -1) {
+        close(dir_fd);
+    }
+    free(ordered);
+    free(timed.names);
+    free(timed.created);
+    free(timed.order);
+    listing_free(&listing);
+}
+
+// Index visitor for w24fz: the size permutation holds only regular files, so every record matches
+static bool collect_size_match(const struct index_record *record, void *arg) {
+    return path_list_push(arg, index_path(&file_index, record));
+}
+
+// Walk visitor for w24fz: regular files within the size range
+static enum walk_action match_size(const struct walk_entry *entry, void *arg) {
+    struct archive_walk *walk = arg;
+    struct statx stx;
+
+    // The directory entry already says whether it is a regular file, so only those are stat'ed
+    if (entry->type != DT_REG || walk_statx(entry, STATX_SIZE, &stx) != 0) {
+        return WALK_CONTINUE;
+    }
+    if ((long)stx.stx_size < walk->min_size || (long)stx.stx_size > walk->max_size) {
+        return WALK_CONTINUE;
+    }
+    return archive_walk_add(walk, entry->path);
+}
+
+void handle_w24fz(int client_socket, long size1, long size2) {
+    struct tar_stream *archive = malloc(sizeof(struct tar_stream));
+
+    if (archive == NULL) {
+        send(client_socket, "Error creating tar.gz file", strlen("Error creating tar.gz file"), 0);
+        return;
+    }
+    tar_stream_init(archive, client_socket);
+
+    if (index_acquire()) {
+        struct path_list list = { 0 };
+        index_lookup_size(size1, size2, collect_size_match, &list);
+        index_release();
+        tar_stream_add_list(archive, &list);
+        path_list_free(&list);
+    } else {
+        // Archive regular files anywhere below the home directory as they are found
+        struct archive_walk walk;
+        archive_walk_init(&walk, archive);
+        walk.min_size = size1;
+        walk.max_size = size2;
+        long entries = walk_tree(getenv("HOME"), 0, 0, match_size, &walk);
+        pthread_mutex_destroy(&walk.lock);
+        if (entries == -1) {
+            perror("Error opening directory");
+            send(client_socket, "Error opening directory", strlen("Error opening directory"), 0);
+            free(archive);
+            return;
+        }
+    }
+
+    finish_archive_response(client_socket, archive, "No file found");
+    free(archive);
+}
+
+// Walk visitor for w24ft: regular files named "*.<ext>" for any of the extensions, like find -type f -name
+static enum walk_action match_extension(const struct walk_entry *entry, void *arg) {
+    struct archive_walk *walk = arg;
+
+    if (entry->type != DT_REG) {
+        return WALK_CONTINUE;
+    }
+    for (int i = 0; i < walk->extension_count; i++) {
+        if (name_has_extension(entry->name, walk->extensions[i])) {
+            return archive_walk_add(walk, entry->path);
+        }
+    }
+    return WALK_CONTINUE;
+}
+
+// Index visitor for w24ft
+static bool collect_extension_match(const struct index_record *record, void *arg) {
+    return path_list_push(arg, index_path(&file_index, record));
+}
+
+// Split a w24ft argument list into extensions. Repeats are dropped, and so is any
+// extension another one already covers ("tar.gz" when "gz" is also asked for), which
+// leaves the posting lists disjoint so no file is archived twice.
+static int parse_extensions(char *list, char **extensions, int capacity) {
+    char *save = NULL;
+    int count = 0;
+
+    for (char *token = strtok_r(list, " \t\r\n", &save); token != NULL && count < capacity; token = strtok_r(NULL, " \t\r\n", &save)) {
+        extensions[count++] = token;
+    }
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        bool covered = false;
+        for (int j = 0; j < count && !covered; j++) {
+            if (j == i) {
+                continue;
+            }
+            // Of two equal extensions only the first is kept
+            covered = strcmp(extensions[i], extensions[j]) == 0 ? j < i : name_has_extension(extensions[i], extensions[j]);
+        }
+        if (!covered) {
+            extensions[kept++] = extensions[i];
+        }
+    }
+    return kept;
+}
+
+void handle_w24ft(int client_socket, const char *extensions) {
+    printf("Handling w24ft command...\n");
 
     // Parse the extension list
-    char ext1[10], ext2[10], ext3[10];
-    int num_matched = sscanf(extensions, "%s %s %s", ext1, ext2, ext3);
+    char list[MAXDATASIZE];
+    char *extension_list[MAXDATASIZE / 2];
+    snprintf(list, sizeof(list), "%s", extensions);
+    int num_matched = parse_extensions(list, extension_list, MAXDATASIZE / 2);
     printf("Number of extensions matched: %d\n", num_matched);
 
-    // Ensure at least one extension is provided and up to 3 extensions are allowed
-    if (num_matched < 1 || num_matched > 3) {
-        printf("Invalid number of extensions. Provide 1 to 3 extensions.\n");
-        send(client_socket, "Invalid number of extensions. Provide 1 to 3 extensions.", strlen("Invalid number of extensions. Provide 1 to 3 extensions."), 0);
+    // Ensure at least one extension is provided
+    if (num_matched < 1) {
+        printf("Invalid number of extensions. Provide at least one extension.\n");
+        send(client_socket, "Invalid number of extensions. Provide at least one extension.", strlen("Invalid number of extensions. Provide at least one extension."), 0);
+        return;
+    }
+
+    struct tar_stream *archive = malloc(sizeof(struct tar_stream));
+    if (archive == NULL) {
+        send(client_socket, "Error compressing files into tar.gz", strlen("Error compressing files into tar.gz"), 0);
+        return;
+    }
+    tar_stream_init(archive, client_socket);
+
+    if (index_acquire()) {
+        // The union of the extensions' posting lists
+        struct path_list list = { 0 };
+        for (int i = 0; i < num_matched; i++) {
+            index_lookup_extension(extension_list[i], collect_extension_match, &list);
+        }
+        index_release();
+        tar_stream_add_list(archive, &list);
+        path_list_free(&list);
+    } else {
+        // Archive each matching file below the home directory as soon as the walk finds it
+        struct archive_walk walk;
+        archive_walk_init(&walk, archive);
+        walk.extensions = extension_list;
+        walk.extension_count = num_matched;
+        if (walk_tree(getenv("HOME"), 0, 0, match_extension, &walk) == -1) {
+            perror("Error opening directory");
+        }
+        pthread_mutex_destroy(&walk.lock);
+    }
+
+    if (!archive->started) {
+        printf("No files found with the specified extensions.\n");
+    }
+    finish_archive_response(client_socket, archive, "No file found");
+    free(archive);
+}
+
+// Function to convert date string to time_t; returns -1 if the date does not parse
+time_t convert_date_string(const char *date) {
+    struct tm tm = {0};
+    if (strptime(date, DATE_FORMAT, &tm) == NULL) {
+        perror("Date parsing failed");
+        return -1;
+    }
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Walk visitor for the date commands: regular files created within the range, ignoring files and directories starting with "."
+static enum walk_action match_date(const struct walk_entry *entry, void *arg) {
+    struct archive_walk *walk = arg;
+    struct statx stx;
+
+    if (entry->name[0] == '.') {
+        return WALK_PRUNE;
+    }
+    if (entry->type != DT_REG || walk_statx(entry, STATX_CTIME | STATX_BTIME, &stx) != 0) {
+        return WALK_CONTINUE;
+    }
+    int64_t created = statx_created(&stx);
+    if (created >= walk->min_time && created <= walk->max_time) {
+        return archive_walk_add(walk, entry->path);
+    }
+    return WALK_CONTINUE;
+}
+
+// Search the tree below path for files created between min_time and max_time, inclusive
+int search_files_by_date(const char *path, time_t min_time, time_t max_time, struct tar_stream *archive) {
+    struct archive_walk walk;
+
+    archive_walk_init(&walk, archive);
+    walk.min_time = min_time;
+    walk.max_time = max_time;
+    long entries = walk_tree(path, 0, 0, match_date, &walk);
+    pthread_mutex_destroy(&walk.lock);
+    if (entries == -1) {
+        perror("Error opening directory");
+        return -1;
+    }
+    return archive->failed ? -1 : walk.found;
+}
+
+// Index visitor for the date commands: the creation-time permutation already holds only the files they want
+static bool collect_date_match(const struct index_record *record, void *arg) {
+    return path_list_push(arg, index_path(&file_index, record));
+}
+
+// Archive the regular files outside hidden directories created between min_time and
+// max_time. w24fdb, w24fda and w24fdr differ only in the bounds they pass.
+static void handle_date_range(int client_socket, time_t min_time, time_t max_time, const char *empty_message) {
+    struct tar_stream *archive = malloc(sizeof(struct tar_stream));
+    if (archive == NULL) {
+        send(client_socket, "Error creating tar.gz file", strlen("Error creating tar.gz file"), 0);
+        return;
+    }
+    tar_stream_init(archive, client_socket);
+
+    // Answer from the index when it is ready, otherwise search the home directory recursively
+    if (index_acquire()) {
+        struct path_list list = { 0 };
+        index_lookup_created(min_time, max_time, collect_date_match, &list);
+        index_release();
+        tar_stream_add_list(archive, &list);
+        path_list_free(&list);
+    } else {
+        search_files_by_date(getenv("HOME"), min_time, max_time, archive);
+    }
+
+    finish_archive_response(client_socket, archive, empty_message);
+    free(archive);
+}
+
+// Function to handle w24fdb command: files created on or before the date
+void handle_w24fdb(int client_socket, const char *date) {
+    time_t target_date = convert_date_string(date);
+
+    if (target_date == -1) {
+        send(client_socket, INVALID_DATE_MESSAGE, strlen(INVALID_DATE_MESSAGE), 0);
+        return;
+    }
+    handle_date_range(client_socket, INT64_MIN, target_date, "No files found with the specified creation date or earlier.");
+}
+
+// Function to handle w24fda command: files created on or after the date
+void handle_w24fda(int client_socket, const char *date) {
+    time_t target_date = convert_date_string(date);
+
+    if (target_date == -1) {
+        send(client_socket, INVALID_DATE_MESSAGE, strlen(INVALID_DATE_MESSAGE), 0);
+        return;
+    }
+    handle_date_range(client_socket, target_date, INT64_MAX, "No files found with the specified creation date or later.");
+}
+
+// Function to handle w24fdr command: files created between the two dates, inclusive
+void handle_w24fdr(int client_socket, const char *dates) {
+    char from[32], to[32];
+    time_t from_date = -1, to_date = -1;
+
+    if (sscanf(dates, "%31s %31s", from, to) == 2) {
+        from_date = convert_date_string(from);
+        to_date = convert_date_string(to);
+    }
+    if (from_date == -1 || to_date == -1) {
+        send(client_socket, INVALID_DATE_MESSAGE, strlen(INVALID_DATE_MESSAGE), 0);
+        return;
+    }
+    handle_date_range(client_socket, from_date, to_date, "No files found with the specified creation date range.");
+}
+
+// Index visitor for w24fs
+static bool collect_pattern_match(const struct index_record *record, void *arg) {
+    return path_list_push(arg, index_path(&file_index, record));
+}
+
+struct pattern_search {
+    const struct name_pattern *pattern;
+    struct path_list list;
+    pthread_mutex_t lock;
+};
+
+// Walk visitor for w24fs
+static enum walk_action match_pattern(const struct walk_entry *entry, void *arg) {
+    struct pattern_search *search = arg;
+    bool added = true;
+
+    if (name_pattern_match(search->pattern, entry->name)) {
+        pthread_mutex_lock(&search->lock);
+        added = path_list_push(&search->list, entry->path);
+        pthread_mutex_unlock(&search->lock);
+    }
+    return added ? WALK_CONTINUE : WALK_STOP;
+}
+
+// Function to handle w24fs command: list every entry whose name contains the pattern,
+// or matches it if it has glob characters
+void handle_w24fs(int client_socket, const char *arguments) {
+    char text[MAXDATASIZE], response[MAXDATASIZE];
+    struct name_pattern pattern;
+    struct pattern_search search = { &pattern, { 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+    // The pattern is the rest of the line, so it may contain spaces
+    arguments += strspn(arguments, " ");
+    snprintf(text, sizeof(text), "%s", arguments);
+    text[strcspn(text, "\r\n")] = '\0';
+    if (name_pattern_init(&pattern, text) == -1) {
+        char error_response[] = "Invalid pattern";
+        send(client_socket, error_response, strlen(error_response), 0);
+        return;
+    }
+
+    if (index_acquire()) {
+        index_search_names(&pattern, collect_pattern_match, &search.list);
+        index_release();
+    } else if (walk_tree(getenv("HOME"), 0, 0, match_pattern, &search) == -1) {
+        perror("Error opening directory");
+    }
+    pthread_mutex_destroy(&search.lock);
+
+    if (search.list.count == 0) {
+        snprintf(response, sizeof(response), "No file found");
+    } else {
+        qsort(search.list.paths, search.list.count, sizeof(char *), compare_strings);
+        // As many whole paths as fit in one reply, in path order
+        size_t length = snprintf(response, sizeof(response), "Matches: %zu", search.list.count);
+        for (size_t i = 0; i < search.list.count; i++) {
+            size_t path_length = strlen(search.list.paths[i]);
+            if (length + 1 + path_length >= sizeof(response)) {
+                break;
+            }
+            response[length++] = '\n';
+            memcpy(response + length, search.list.paths[i], path_length + 1);
+            length += path_length;
+        }
+    }
+    path_list_free(&search.list);
+    result_capture_append(response, strlen(response));
+    result_capture_complete();
+    send(client_socket, response, strlen(response), 0);
+}
+
+// ---------------------------------------------------------------------------
+// Result cache
+//
+// Archives and w24fs listings are kept exactly as they were sent, so asking the
+// same question of an unchanged tree again costs one sendfile(). The blobs live
+// in a memfd created before any handler is forked and the table describing them
+// in shared memory, so the fork-mode handlers share one cache with the epoll
+// workers and with each other. Each entry is keyed by the normalized command and
+// the index generation it was computed at. The index thread bumps the
+// generation with every change it applies, so an entry is never served once the
+// tree has moved on. Blobs fit in a fixed byte budget and the least recently
+// used unpinned entries are evicted to make room.
+//
+// Identical requests that arrive together are coalesced: the first one runs the
+// command as a flight, and the others wait for it to land in the cache and are
+// then all served the same bytes. A flight whose result is too large to cache
+// lets its waiters run the command themselves.
+//
+// Archive and w24fs results are cached only while a watched index answers the
+// queries: a disk walk has no generation to validate its result against. The
+// generation of a dirlist -t listing is the directory's mtime.
+// ---------------------------------------------------------------------------
+
+#define RESULT_CACHE_DEFAULT_BYTES (128L * 1024 * 1024)
+#define RESULT_CACHE_ENTRIES 512
+#define RESULT_CACHE_KEY_MAX 256
+#define RESULT_CACHE_ALIGN 4096            // Blobs start on page boundaries so evicted ones can be punched out
+#define RESULT_CACHE_CAPTURE_INITIAL 65536
+#define RESULT_CACHE_FLIGHTS 64
+#define RESULT_FLIGHT_CHECK_SECONDS 1      // How often a waiter checks that a forked producer is still alive
+#define DIRECTORY_SETTLE_NS 1000000000L    // A directory's listing is cached once its mtime is this old
+
+struct result_cache_entry {
+    bool used;
+    bool ready;                            // The blob has been written and may be served
+    int readers;                           // Handlers sending the blob; a pinned entry is not evicted
+    long generation;
+    long last_used;                        // Value of the use clock at the last hit
+    size_t offset;                         // Of the blob in the memfd
+    size_t length;
+    char key[RESULT_CACHE_KEY_MAX];
+};
+
+// A command being run for the cache; identical requests wait for it instead of running it again
+struct result_flight {
+    bool used;
+    pid_t producer;
+    long sequence;                         // Tells a waiter that the flight it waited on has ended
+    long generation;
+    char key[RESULT_CACHE_KEY_MAX];
+};
+
+// Lives in shared memory; the lock is robust because a forked handler may die holding it
+struct result_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t landed;                 // Broadcast whenever a flight ends
+    long clock;
+    long hits;
+    long misses;
+    long coalesced;                        // Requests answered by another request's flight
+    long evictions;
+    long entries;
+    long flight_sequence;
+    size_t bytes;                          // Space taken by the stored blobs
+    struct result_cache_entry slots[RESULT_CACHE_ENTRIES];
+    struct result_flight flights[RESULT_CACHE_FLIGHTS];
+};
+
+// A cacheable command being answered by this thread, and the copy of its response
+struct cache_request {
+    char key[RESULT_CACHE_KEY_MAX];
+    long generation;
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+    bool overflow;                         // The response outgrew the largest blob the cache takes
+    bool complete;                         // The whole response was sent
+};
+
+static size_t result_cache_budget = RESULT_CACHE_DEFAULT_BYTES;  // 0 with --cache-bytes 0
+static struct result_cache *result_cache;
+static int result_cache_fd = -1;
+static __thread struct cache_request *current_cache_request;
+
+// Create the cache; called before any handler is forked so that all of them share it
+void start_result_cache(void) {
+    pthread_mutexattr_t attr;
+    pthread_condattr_t cond_attr;
+
+    if (result_cache_budget == 0) {
+        return;
+    }
+    result_cache_fd = memfd_create("w24-result-cache", MFD_CLOEXEC);
+    if (result_cache_fd == -1 || ftruncate(result_cache_fd, result_cache_budget) == -1) {
+        perror("Result cache allocation failed");
+        if (result_cache_fd != -1) {
+            close(result_cache_fd);
+            result_cache_fd = -1;
+        }
+        return;
+    }
+    result_cache = mmap(NULL, sizeof(struct result_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (result_cache == MAP_FAILED) {
+        perror("Result cache allocation failed");
+        close(result_cache_fd);
+        result_cache_fd = -1;
+        result_cache = NULL;
+        return;
+    }
+    memset(result_cache, 0, sizeof(struct result_cache));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&result_cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&result_cache->landed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+}
+
+static void result_cache_lock(void) {
+    // The table is only changed by short sections that cannot leave it inconsistent,
+    // so the lock of a handler that died is simply taken over
+    if (pthread_mutex_lock(&result_cache->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&result_cache->lock);
+    }
+}
+
+static void result_cache_unlock(void) {
+    pthread_mutex_unlock(&result_cache->lock);
+}
+
+static size_t result_cache_span(size_t length) {
+    return (length + RESULT_CACHE_ALIGN - 1) & ~(size_t)(RESULT_CACHE_ALIGN - 1);
+}
+
+// Free an entry and give its pages back. Caller holds the lock.
+static void result_cache_drop(struct result_cache_entry *entry) {
+    fallocate(result_cache_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, entry->offset, result_cache_span(entry->length));
+    result_cache->bytes -= result_cache_span(entry->length);
+    result_cache->entries--;
+    entry->used = false;
+}
+
+// Evict the least recently used entry nobody is sending. Caller holds the lock.
+static bool result_cache_evict(void) {
+    struct result_cache_entry *oldest = NULL;
+
+    for (int i = 0; i < RESULT_CACHE_ENTRIES; i++) {
+        struct result_cache_entry *entry = &result_cache->slots[i];
+        if (entry->used && entry->ready && entry->readers == 0 && (oldest == NULL || entry->last_used < oldest->last_used)) {
+            oldest = entry;
+        }
+    }
+    if (oldest == NULL) {
+        return false;
+    }
+    result_cache_drop(oldest);
+    result_cache->evictions++;
+    return true;
+}
+
+static int compare_entry_offsets(const void *a, const void *b) {
+    const struct result_cache_entry *x = *(const struct result_cache_entry *const *)a;
+    const struct result_cache_entry *y = *(const struct result_cache_entry *const *)b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// First gap in the memfd that holds span bytes, or -1. Caller holds the lock.
+static long result_cache_find_space(size_t span) {
+    struct result_cache_entry *placed[RESULT_CACHE_ENTRIES];
+    size_t count = 0, end = 0;
+
+    for (int i = 0; i < RESULT_CACHE_ENTRIES; i++) {
+        if (result_cache->slots[i].used) {
+            placed[count++] = &result_cache->slots[i];
+        }
+    }
+    qsort(placed, count, sizeof(placed[0]), compare_entry_offsets);
+    for (size_t i = 0; i < count; i++) {
+        if (placed[i]->offset - end >= span) {
+            return end;
+        }
+        end = placed[i]->offset + result_cache_span(placed[i]->length);
+    }
+    return result_cache_budget - end >= span ? (long)end : -1;
+}
+
+// The entry holding the response to a request at its generation, pinned, or NULL. Entries of
+// older generations met on the way are dropped. Caller holds the lock.
+static struct result_cache_entry *result_cache_pin(const struct cache_request *request) {
+    for (int i = 0; i < RESULT_CACHE_ENTRIES; i++) {
+        struct result_cache_entry *entry = &result_cache->slots[i];
+        if (!entry->used || strcmp(entry->key, request->key) != 0) {
+            continue;
+        }
+        if (entry->ready && entry->generation == request->generation) {
+            entry->readers++;
+            entry->last_used = ++result_cache->clock;
+            return entry;
+        }
+        // Generations only grow, so an older entry is never going to be served again
+        if (entry->ready && entry->readers == 0 && entry->generation < request->generation) {
+            result_cache_drop(entry);
+        }
+    }
+    return NULL;
+}
+
+// Send a pinned entry's blob and unpin it. A pinned entry keeps its place, so no lock is needed.
+static void result_cache_send(int client_socket, struct result_cache_entry *entry) {
+    if (send_file_body(client_socket, result_cache_fd, entry->offset, entry->length) == -1) {
+        log_message(WARNING, "Cached response transfer to client failed: %s", strerror(errno));
+    }
+    result_cache_lock();
+    entry->readers--;
+    result_cache_unlock();
+}
+
+// The flight running a request's command at its generation, or NULL. Caller holds the lock.
+static struct result_flight *result_flight_find(const struct cache_request *request) {
+    for (int i = 0; i < RESULT_CACHE_FLIGHTS; i++) {
+        struct result_flight *flight = &result_cache->flights[i];
+        if (flight->used && flight->generation == request->generation && strcmp(flight->key, request->key) == 0) {
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+// Start a flight for a request, or return NULL if too many are running. Caller holds the lock.
+static struct result_flight *result_flight_claim(const struct cache_request *request) {
+    for (int i = 0; i < RESULT_CACHE_FLIGHTS; i++) {
+        struct result_flight *flight = &result_cache->flights[i];
+        if (!flight->used) {
+            flight->used = true;
+            flight->producer = getpid();
+            flight->sequence = ++result_cache->flight_sequence;
+            flight->generation = request->generation;
+            snprintf(flight->key, sizeof(flight->key), "%s", request->key);
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+// Wait for a flight to end. Caller holds the lock, which is released while waiting.
+static void result_flight_wait(struct result_flight *flight) {
+    long sequence = flight->sequence;
+
+    while (flight->used && flight->sequence == sequence) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += RESULT_FLIGHT_CHECK_SECONDS;
+        int result = pthread_cond_timedwait(&result_cache->landed, &result_cache->lock, &deadline);
+        if (result == EOWNERDEAD) {
+            pthread_mutex_consistent(&result_cache->lock);
+        } else if (result == ETIMEDOUT && flight->used && flight->sequence == sequence &&
+                   kill(flight->producer, 0) == -1 && errno == ESRCH) {
+            // A forked handler that died mid-flight never ends it
+            flight->used = false;
+        }
+    }
+}
+
+// Store the captured response of a request
+static void result_cache_store(const struct cache_request *request) {
+    size_t span = result_cache_span(request->length);
+    struct result_cache_entry *entry = NULL;
+    long offset;
+
+    result_cache_lock();
+    for (int i = 0; i < RESULT_CACHE_ENTRIES; i++) {
+        struct result_cache_entry *slot = &result_cache->slots[i];
+        if (!slot->used) {
+            entry = entry != NULL ? entry : slot;
+        } else if (slot->generation == request->generation && strcmp(slot->key, request->key) == 0) {
+            // Another handler answered the same query meanwhile
+            result_cache_unlock();
+            return;
+        }
+    }
+    while ((entry == NULL || (offset = result_cache_find_space(span)) == -1) && result_cache_evict()) {
+        for (int i = 0; entry == NULL && i < RESULT_CACHE_ENTRIES; i++) {
+            if (!result_cache->slots[i].used) {
+                entry = &result_cache->slots[i];
+            }
+        }
+    }
+    if (entry == NULL || (offset = result_cache_find_space(span)) == -1) {
+        result_cache_unlock();
+        return;
+    }
+    entry->used = true;
+    entry->ready = false;
+    entry->readers = 0;
+    entry->generation = request->generation;
+    entry->last_used = ++result_cache->clock;
+    entry->offset = offset;
+    entry->length = request->length;
+    snprintf(entry->key, sizeof(entry->key), "%s", request->key);
+    result_cache->bytes += span;
+    result_cache->entries++;
+    result_cache_unlock();
+
+    // The reserved range is not handed out again until the entry is dropped, so it is written unlocked
+    size_t written = 0;
+    while (written < request->length) {
+        ssize_t n = pwrite(result_cache_fd, request->data + written, request->length - written, offset + written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+
+    result_cache_lock();
+    if (written == request->length) {
+        entry->ready = true;
+    } else {
+        result_cache_drop(entry);
+    }
+    result_cache_unlock();
+}
+
+// Keep a copy of response bytes sent by this thread, if it is answering a cacheable command
+void result_capture_append(const void *data, size_t length) {
+    struct cache_request *request = current_cache_request;
+
+    if (request == NULL || request->overflow) {
+        return;
+    }
+    // One response may take at most a quarter of the budget, so a huge archive cannot flush the cache
+    if (request->length + length > result_cache_budget / 4) {
+        request->overflow = true;
+        return;
+    }
+    if (request->length + length > request->capacity) {
+        size_t capacity = request->capacity ? request->capacity : RESULT_CACHE_CAPTURE_INITIAL;
+        while (capacity < request->length + length) {
+            capacity *= 2;
+        }
+        unsigned char *data_copy = realloc(request->data, capacity);
+        if (data_copy == NULL) {
+            request->overflow = true;
+            return;
+        }
+        request->data = data_copy;
+        request->capacity = capacity;
+    }
+    memcpy(request->data + request->length, data, length);
+    request->length += length;
+}
+
+// The response captured so far is the whole response
+void result_capture_complete(void) {
+    if (current_cache_request != NULL) {
+        current_cache_request->complete = true;
+    }
+}
+
+// Generation of the working directory's listing: its mtime in nanoseconds. A directory changed in
+// the last second gives -1, since a change later in the same timestamp tick would go unnoticed.
+static long directory_generation(struct stat *st) {
+    struct timespec now;
+
+    if (stat(".", st) == -1 || clock_gettime(CLOCK_REALTIME, &now) == -1) {
+        return -1;
+    }
+    long mtime_ns = st->st_mtim.tv_sec * 1000000000L + st->st_mtim.tv_nsec;
+    if (now.tv_sec * 1000000000L + now.tv_nsec - mtime_ns < DIRECTORY_SETTLE_NS) {
+        return -1;
+    }
+    return mtime_ns;
+}
+
+// Canonical form of a cacheable command, so that different spellings of one query share an
+// entry, and the generation of the data it is answered from; false for commands whose results
+// are not cached, and while the data has no generation
+static bool result_cache_key(const char *command, char *key, size_t size, long *generation) {
+    char text[MAXDATASIZE], first[32], second[32];
+    long size1, size2;
+    int length = -1;
+    struct stat st;
+
+    if (strcmp(command, "dirlist -t") == 0) {
+        // Keyed by the directory itself, which may differ between the server and the mirrors
+        *generation = directory_generation(&st);
+        if (*generation == -1) {
+            return false; // st may not have been filled in
+        }
+        return snprintf(key, size, "dirlist -t %llu:%llu", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino) < (int)size;
+    }
+    *generation = index_generation();
+    if (*generation == -1) {
+        return false;
+    }
+    if (strncmp(command, "w24fz ", 6) == 0 && sscanf(command + 6, "%ld %ld", &size1, &size2) == 2) {
+        length = snprintf(key, size, "w24fz %ld %ld", size1, size2);
+    } else if (strncmp(command, "w24ft ", 6) == 0) {
+        // The same files are archived whatever the order of the extensions
+        char *extensions[MAXDATASIZE / 2];
+        snprintf(text, sizeof(text), "%s", command + 6);
+        int count = parse_extensions(text, extensions, MAXDATASIZE / 2);
+        if (count < 1) {
+            return false;
+        }
+        qsort(extensions, count, sizeof(char *), compare_strings);
+        length = snprintf(key, size, "w24ft");
+        for (int i = 0; i < count && length < (int)size; i++) {
+            length += snprintf(key + length, size - length, " %s", extensions[i]);
+        }
+    } else if ((strncmp(command, "w24fdb ", 7) == 0 || strncmp(command, "w24fda ", 7) == 0) && sscanf(command + 7, "%31s", first) == 1) {
+        time_t date = convert_date_string(first);
+        if (date == -1) {
+            return false;
+        }
+        length = snprintf(key, size, "%.6s %lld", command, (long long)date);
+    } else if (strncmp(command, "w24fdr ", 7) == 0 && sscanf(command + 7, "%31s %31s", first, second) == 2) {
+        time_t from = convert_date_string(first), to = convert_date_string(second);
+        if (from == -1 || to == -1) {
+            return false;
+        }
+        length = snprintf(key, size, "w24fdr %lld %lld", (long long)from, (long long)to);
+    } else if (strncmp(command, "w24fs ", 6) == 0) {
+        // Trimmed the way handle_w24fs trims it
+        snprintf(text, sizeof(text), "%s", command + 6 + strspn(command + 6, " "));
+        text[strcspn(text, "\r\n")] = '\0';
+        length = snprintf(key, size, "w24fs %s", text);
+    }
+    return length > 0 && length < (int)size;
+}
+
+// Answer a cacheable command from the cache, from an identical request already running, or by
+// running it and keeping its response
+static bool serve_from_cache(int client_socket, const char *buffer) {
+    struct cache_request request = { 0 };
+    struct result_cache_entry *hit = NULL;
+    struct result_flight *flight = NULL;
+    bool waited = false;
+
+    if (result_cache == NULL || !result_cache_key(buffer, request.key, sizeof(request.key), &request.generation)) {
+        return false;
+    }
+
+    result_cache_lock();
+    while ((hit = result_cache_pin(&request)) == NULL && !waited) {
+        struct result_flight *running = result_flight_find(&request);
+        if (running == NULL) {
+            flight = result_flight_claim(&request);
+            break;
+        }
+        result_flight_wait(running);
+        waited = true;
+    }
+    // A waiter that still misses met a flight whose result was not cached, and runs the command alone
+    if (hit == NULL) {
+        result_cache->misses++;
+    } else if (waited) {
+        result_cache->coalesced++;
+    } else {
+        result_cache->hits++;
+    }
+    result_cache_unlock();
+    if (hit != NULL) {
+        result_cache_send(client_socket, hit);
+        return true;
+    }
+
+    current_cache_request = &request;
+    run_command(client_socket, buffer);
+    current_cache_request = NULL;
+    if (request.complete && !request.overflow && request.length > 0) {
+        result_cache_store(&request);
+    }
+    free(request.data);
+    if (flight != NULL) {
+        result_cache_lock();
+        flight->used = false;
+        pthread_cond_broadcast(&result_cache->landed);
+        result_cache_unlock();
+    }
+    return true;
+}
+
+void format_cache_stats(char *buffer, size_t size) {
+    long hits = 0, misses = 0, coalesced = 0, evictions = 0, entries = 0;
+    size_t bytes = 0;
+
+    if (result_cache != NULL) {
+        result_cache_lock();
+        hits = result_cache->hits;
+        misses = result_cache->misses;
+        coalesced = result_cache->coalesced;
+        evictions = result_cache->evictions;
+        entries = result_cache->entries;
+        bytes = result_cache->bytes;
+        result_cache_unlock();
+    }
+    snprintf(buffer, size, "cache_hits=%ld\ncache_misses=%ld\ncache_coalesced=%ld\ncache_evictions=%ld\ncache_entries=%ld\ncache_bytes=%zu\n"
+             "cache_budget=%zu\n", hits, misses, coalesced, evictions, entries, bytes, result_cache != NULL ? result_cache_budget : 0);
+}
+
+
+
+// ---------------------------------------------------------------------------
+// Asynchronous logging
+//
+// log_message() formats the line on the calling thread and appends it to that
+// thread's ring buffer without taking a lock or making a system call; each
+// ring has a single writer (its thread) and a single reader (the flusher). A
+// background flusher collects the rings every LOG_FLUSH_INTERVAL_MS and writes
+// them to LOG_FILE with one writev() per batch, rotating the file once it
+// passes LOG_ROTATE_BYTES. A thread whose ring is full drops the line rather
+// than wait; the flusher logs how many were lost.
+//
+// Rings belong to threads only while they run: a finished thread's ring is
+// handed to the next thread that logs, so short-lived threads do not pile up
+// rings. After fork() the child starts a flusher of its own, and lines still
+// buffered at exit() are flushed by an atexit handler.
+// ---------------------------------------------------------------------------
+
+struct log_ring {
+    atomic_size_t head;             // Written by the owning thread
+    atomic_size_t tail;             // Written by the flusher
+    atomic_bool owned;
+    struct log_ring *next;
+    char data[LOG_RING_SIZE];
+};
+
+static _Atomic(struct log_ring *) log_rings;
+static __thread struct log_ring *log_thread_ring;
+static pthread_key_t log_ring_key;
+static atomic_bool log_started;       // This process has a flusher thread
+static atomic_long log_dropped;
+static pthread_mutex_t log_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = -1;
+static off_t log_file_bytes;
+static pid_t log_owner_pid;           // Only the process that opened the log first rotates it
+
+// Give the ring back when its thread exits
+static void log_release_ring(void *ring) {
+    atomic_store(&((struct log_ring *)ring)->owned, false);
+}
+
+static struct log_ring *log_claim_ring(void) {
+    struct log_ring *ring;
+
+    for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &expected, true)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct log_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_store(&ring->owned, true);
+        ring->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
+        }
+    }
+    pthread_setspecific(log_ring_key, ring);
+    return ring;
+}
+
+static void log_open_file(void) {
+    struct stat st;
+
+    log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        perror("Error opening log file");
+        return;
+    }
+    log_file_bytes = fstat(log_fd, &st) == 0 ? st.st_size : 0;
+}
+
+// Shift LOG_FILE.1 .. LOG_FILE.(KEEP-1) up by one and start a fresh LOG_FILE
+static void log_rotate(void) {
+    char from[MAX_PATH_LENGTH], to[MAX_PATH_LENGTH];
+
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", LOG_FILE, i);
+        snprintf(to, sizeof(to), "%s.%d", LOG_FILE, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", LOG_FILE);
+    rename(LOG_FILE, to);
+    close(log_fd);
+    log_open_file();
+}
+
+// Write every iovec, continuing after short writes
+static void log_writev_all(struct iovec *iov, int count) {
+    while (count > 0 && log_fd != -1) {
+        ssize_t written = writev(log_fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        log_file_bytes += written;
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Write out everything the rings hold
+static void log_flush(void) {
+    struct iovec iov[2 * LOG_BATCH_RINGS + 1];
+    struct log_ring *batch[LOG_BATCH_RINGS];
+    size_t batch_head[LOG_BATCH_RINGS];
+    char notice[128];
+    int rings = 0, count = 0;
+
+    pthread_mutex_lock(&log_flush_lock);
+    if (log_fd == -1) {
+        log_open_file();
+    }
+
+    long dropped = atomic_exchange(&log_dropped, 0);
+    if (dropped > 0) {
+        int length = snprintf(notice, sizeof(notice), "[WARNING] %ld log messages dropped: log buffers full\n", dropped);
+        iov[count++] = (struct iovec){ notice, length };
+    }
+
+    for (struct log_ring *ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (head == tail) {
+            continue;
+        }
+        // The buffered bytes may wrap around the end of the ring
+        size_t start = tail & (LOG_RING_SIZE - 1);
+        size_t length = head - tail;
+        size_t first = length < LOG_RING_SIZE - start ? length : LOG_RING_SIZE - start;
+        iov[count++] = (struct iovec){ ring->data + start, first };
+        if (first < length) {
+            iov[count++] = (struct iovec){ ring->data, length - first };
+        }
+        batch[rings] = ring;
+        batch_head[rings++] = head;
+
+        if (rings == LOG_BATCH_RINGS) {
+            log_writev_all(iov, count);
+            for (int i = 0; i < rings; i++) {
+                atomic_store_explicit(&batch[i]->tail, batch_head[i], memory_order_release);
+            }
+            rings = count = 0;
+        }
+    }
+    if (count > 0) {
+        log_writev_all(iov, count);
+        for (int i = 0; i < rings; i++) {
+            atomic_store_explicit(&batch[i]->tail, batch_head[i], memory_order_release);
+        }
+    }
+
+    if (log_fd != -1 && log_file_bytes >= LOG_ROTATE_BYTES && getpid() == log_owner_pid) {
+        log_rotate();
+    }
+    pthread_mutex_unlock(&log_flush_lock);
+}
+
+static void *log_flusher_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        usleep(LOG_FLUSH_INTERVAL_MS * 1000);
+        log_flush();
+    }
+    return NULL;
+}
+
+// The child's copies of the parent's buffered lines are the parent's to write
+static void log_after_fork_child(void) {
+    for (struct log_ring *ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        atomic_store(&ring->tail, atomic_load(&ring->head));
+        if (ring != log_thread_ring) {
+            atomic_store(&ring->owned, false);
+        }
+    }
+    pthread_mutex_init(&log_flush_lock, NULL);
+    pthread_mutex_init(&log_start_lock, NULL);
+    atomic_store(&log_started, false);
+}
+
+// Start this process's flusher; the first call also sets up the process-wide hooks
+static void log_start(void) {
+    static bool hooks_installed;
+    pthread_t thread;
+
+    pthread_mutex_lock(&log_start_lock);
+    if (!atomic_load(&log_started)) {
+        if (!hooks_installed) {
+            pthread_key_create(&log_ring_key, log_release_ring);
+            pthread_atfork(NULL, NULL, log_after_fork_child);
+            atexit(log_flush);
+            log_owner_pid = getpid();
+            hooks_installed = true;
+        }
+        if (pthread_create(&thread, NULL, log_flusher_main, NULL) == 0) {
+            pthread_detach(thread);
+        }
+        atomic_store(&log_started, true);
+    }
+    pthread_mutex_unlock(&log_start_lock);
+}
+
+// "[YYYY-MM-DD HH:MM:SS] " for the current second, reformatted only when the second changes
+static size_t log_timestamp(char *buffer) {
+    static __thread time_t cached_second = -1;
+    static __thread char cached[32];
+    static __thread size_t cached_length;
+    time_t now = time(NULL);
+
+    if (now != cached_second) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        cached_length = strftime(cached, sizeof(cached), "[%Y-%m-%d %H:%M:%S] ", &tm);
+        cached_second = now;
+    }
+    memcpy(buffer, cached, cached_length);
+    return cached_length;
+}
+
+//logmessage function
+void log_message(enum LogLevel level, const char *format, ...) {
+    static const char *const level_names[] = { "[INFO] ", "[WARNING] ", "[ERROR] " };
+    char line[LOG_LINE_MAX];
+    struct log_ring *ring = log_thread_ring;
+    va_list args;
+    size_t length;
+
+    if (!atomic_load_explicit(&log_started, memory_order_acquire)) {
+        log_start();
+    }
+    if (ring == NULL && (ring = log_thread_ring = log_claim_ring()) == NULL) {
+        atomic_fetch_add(&log_dropped, 1);
+        return;
+    }
+
+    // Timestamp, level, message and newline, truncating the message if it is too long
+    length = log_timestamp(line);
+    memcpy(line + length, level_names[level], strlen(level_names[level]));
+    length += strlen(level_names[level]);
+    va_start(args, format);
+    int written = vsnprintf(line + length, sizeof(line) - length - 1, format, args);
+    va_end(args);
+    if (written > 0) {
+        length += (size_t)written < sizeof(line) - length - 1 ? (size_t)written : sizeof(line) - length - 2;
+    }
+    line[length++] = '\n';
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < length) {
+        atomic_fetch_add(&log_dropped, 1);
+        return;
+    }
+    size_t start = head & (LOG_RING_SIZE - 1);
+    size_t first = length < LOG_RING_SIZE - start ? length : LOG_RING_SIZE - start;
+    memcpy(ring->data + start, line, first);
+    memcpy(ring->data, line + first, length - first);
+    atomic_store_explicit(&ring->head, head + length, memory_order_release);
+}
+
+// ---------------------------------------------------------------------------
+// Framed wire protocol
+//
+// A client that wants more than one request in flight opens the connection with
+// a version byte instead of a text command. Text commands never start with a
+// byte below PROTOCOL_VERSION_MAX, so legacy clients are unaffected. The server
+// answers with the version it will speak: PROTOCOL_LEGACY keeps the text
+// protocol, PROTOCOL_FRAMED switches the connection to frames.
+//
+// Every frame starts with a 12-byte big-endian header: opcode, flags, two
+// reserved bytes, request id and payload length. A request's payload holds the
+// command's arguments as text (e.g. "1000 2000" for w24fz). Its response is one
+// or more frames with the same opcode and id carrying exactly the bytes the
+// legacy reply would have, the last one flagged FRAME_END. Requests run
+// concurrently, so responses to different ids may interleave at frame
+// boundaries.
+//
+// Each request runs the ordinary handler on its own thread, writing into a
+// socketpair; a relay thread cuts what it writes into frames.
+// ---------------------------------------------------------------------------
+
+#define PROTOCOL_LEGACY 1
+#define PROTOCOL_FRAMED 2
+#define PROTOCOL_VERSION_MAX 8
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX_PAYLOAD 65536
+#define FRAME_END 0x1    // Last frame of a response
+#define FRAME_ERROR 0x2  // The request was rejected; the payload says why
+#define FRAMED_MAX_INFLIGHT 64
+
+enum FrameOpcode {
+    OP_DIRLIST_A = 1,
+    OP_DIRLIST_T,
+    OP_W24FN,
+    OP_W24FN_CONTENT,
+    OP_W24FZ,
+    OP_W24FT,
+    OP_W24FDB,
+    OP_W24FDA,
+    OP_W24STATS,
+    OP_QUIT,
+    OP_PING,    // Answered at once with an empty FRAME_END frame; used for health checks
+    OP_W24FDR,
+    OP_W24FS,
+};
+
+// Text command each opcode stands for; arguments from the payload are appended
+static const char *const frame_commands[] = {
+    [OP_DIRLIST_A] = "dirlist -a",
+    [OP_DIRLIST_T] = "dirlist -t",
+    [OP_W24FN] = "w24fn",
+    [OP_W24FN_CONTENT] = "w24fn --content",
+    [OP_W24FZ] = "w24fz",
+    [OP_W24FT] = "w24ft",
+    [OP_W24FDB] = "w24fdb",
+    [OP_W24FDA] = "w24fda",
+    [OP_W24STATS] = "w24stats",
+    [OP_W24FDR] = "w24fdr",
+    [OP_W24FS] = "w24fs",
+};
+
+struct framed_session {
+    int fd;
+    int connection_count;
+    pthread_mutex_t write_lock;   // Keeps frames of concurrent responses whole
+    pthread_mutex_t lock;
+    pthread_cond_t request_done;
+    int inflight;
+    unsigned char pending[MAXDATASIZE];  // Bytes read before the session started
+    size_t pending_length;
+    size_t pending_offset;
+};
+
+struct framed_request {
+    struct framed_session *session;
+    uint8_t opcode;
+    uint32_t request_id;
+    int handler_fd;
+    char command[MAXDATASIZE + 32];
+};
+
+// Whether the first byte of a connection selects a protocol version
+static inline bool is_version_byte(unsigned char c) {
+    return c >= PROTOCOL_LEGACY && c <= PROTOCOL_VERSION_MAX;
+}
+
+// Answer a version byte with the version this server will speak
+int negotiate_protocol(int client_socket, unsigned char requested) {
+    unsigned char version = requested < PROTOCOL_FRAMED ? requested : PROTOCOL_FRAMED;
+
+    if (send(client_socket, &version, 1, MSG_NOSIGNAL) != 1) {
+        return -1;
+    }
+    return version;
+}
+
+// Send one frame. The caller leaves FRAME_HEADER_SIZE bytes free in front of the
+// payload so header and payload leave in a single write; a second small write would
+// wait out the peer's delayed ACK.
+static int send_frame(struct framed_session *session, uint8_t opcode, uint8_t flags, uint32_t request_id, unsigned char *frame, uint32_t length) {
+    uint32_t id = htonl(request_id);
+    uint32_t prefix = htonl(length);
+    int result;
+
+    frame[0] = opcode;
+    frame[1] = flags;
+    frame[2] = frame[3] = 0;
+    memcpy(frame + 4, &id, 4);
+    memcpy(frame + 8, &prefix, 4);
+    pthread_mutex_lock(&session->write_lock);
+    result = send_all(session->fd, frame, FRAME_HEADER_SIZE + length);
+    pthread_mutex_unlock(&session->write_lock);
+    return result;
+}
+
+static int send_frame_message(struct framed_session *session, uint8_t opcode, uint8_t flags, uint32_t request_id, const char *message) {
+    unsigned char frame[FRAME_HEADER_SIZE + MAXDATASIZE];
+    size_t length = strlen(message);
+
+    memcpy(frame + FRAME_HEADER_SIZE, message, length);
+    return send_frame(session, opcode, flags, request_id, frame, length);
+}
+
+// Read exactly length bytes, using up the bytes buffered before the session first
+static int session_read_exact(struct framed_session *session, void *out, size_t length) {
+    unsigned char *dest = out;
+
+    while (length > 0) {
+        ssize_t n;
+        if (session->pending_offset < session->pending_length) {
+            n = session->pending_length - session->pending_offset;
+            if ((size_t)n > length) {
+                n = length;
+            }
+            memcpy(dest, session->pending + session->pending_offset, n);
+            session->pending_offset += n;
+        } else {
+            n = recv(session->fd, dest, length, 0);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return -1;
+            }
+        }
+        dest += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void *framed_handler_main(void *arg) {
+    struct framed_request *request = arg;
+
+    dispatch_command(request->handler_fd, request->session->connection_count, request->command);
+    close(request->handler_fd);
+    return NULL;
+}
+
+// Run one request's handler and relay what it writes as frames
+static void *framed_request_main(void *arg) {
+    struct framed_request *request = arg;
+    struct framed_session *session = request->session;
+    int pair[2];
+    pthread_t handler;
+    unsigned char *frame = malloc(FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+
+    if (frame == NULL || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        send_frame_message(session, request->opcode, FRAME_END | FRAME_ERROR, request->request_id, "Server out of resources");
+    } else {
+        request->handler_fd = pair[0];
+        if (pthread_create(&handler, NULL, framed_handler_main, request) != 0) {
+            close(pair[0]);
+            close(pair[1]);
+            send_frame_message(session, request->opcode, FRAME_END | FRAME_ERROR, request->request_id, "Server out of resources");
+        } else {
+            bool client_gone = false;
+            while (1) {
+                ssize_t n = read(pair[1], frame + FRAME_HEADER_SIZE, FRAME_MAX_PAYLOAD);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                // Keep draining after the client is gone so the handler can finish
+                if (!client_gone && send_frame(session, request->opcode, 0, request->request_id, frame, n) == -1) {
+                    client_gone = true;
+                }
+            }
+            pthread_join(handler, NULL);
+            close(pair[1]);
+            if (!client_gone) {
+                send_frame(session, request->opcode, FRAME_END, request->request_id, frame, 0);
+            }
+        }
+    }
+    free(frame);
+    free(request);
+
+    pthread_mutex_lock(&session->lock);
+    session->inflight--;
+    pthread_cond_signal(&session->request_done);
+    pthread_mutex_unlock(&session->lock);
+    return NULL;
+}
+
+// Build the text command for a request; returns false for an unknown opcode
+static bool framed_request_command(struct framed_request *request, const char *arguments, size_t length) {
+    if (request->opcode >= sizeof(frame_commands) / sizeof(frame_commands[0]) || frame_commands[request->opcode] == NULL) {
+        return false;
+    }
+    if (length > 0) {
+        snprintf(request->command, sizeof(request->command), "%s %.*s", frame_commands[request->opcode], (int)length, arguments);
+    } else {
+        snprintf(request->command, sizeof(request->command), "%s", frame_commands[request->opcode]);
+    }
+    return true;
+}
+
+// Serve a framed connection until the client quits or hangs up. The socket must be
+// blocking; initial holds bytes already read past the version byte.
+void run_framed_session(int client_socket, int connection_count, const void *initial, size_t initial_length) {
+    struct framed_session *session = calloc(1, sizeof(struct framed_session));
+    char payload[MAXDATASIZE];
+
+    if (session == NULL) {
+        return;
+    }
+    session->fd = client_socket;
+    session->connection_count = connection_count;
+    pthread_mutex_init(&session->write_lock, NULL);
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->request_done, NULL);
+    memcpy(session->pending, initial, initial_length);
+    session->pending_length = initial_length;
+
+    // A response ends with a small FRAME_END frame that must not wait for the ACK of the data before it
+    int one = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while (1) {
+        unsigned char header[FRAME_HEADER_SIZE];
+        uint32_t request_id, length;
+
+        if (session_read_exact(session, header, sizeof(header)) == -1) {
+            break;
+        }
+        memcpy(&request_id, header + 4, 4);
+        memcpy(&length, header + 8, 4);
+        request_id = ntohl(request_id);
+        length = ntohl(length);
+
+        // An oversized payload would leave the stream out of sync, so drop the connection
+        if (length >= sizeof(payload) || session_read_exact(session, payload, length) == -1) {
+            break;
+        }
+
+        if (header[0] == OP_PING) {
+            char report[64];
+            format_load_report(report, sizeof(report));
+            send_frame_message(session, OP_PING, FRAME_END, request_id, report);
+            continue;
+        }
+        if (header[0] == OP_QUIT) {
+            // Let earlier requests finish before confirming
+            pthread_mutex_lock(&session->lock);
+            while (session->inflight > 0) {
+                pthread_cond_wait(&session->request_done, &session->lock);
+            }
+            pthread_mutex_unlock(&session->lock);
+            send_frame_message(session, OP_QUIT, FRAME_END, request_id, "quitc");
+            break;
+        }
+
+        struct framed_request *request = calloc(1, sizeof(struct framed_request));
+        if (request == NULL) {
+            break;
+        }
+        request->session = session;
+        request->opcode = header[0];
+        request->request_id = request_id;
+        if (!framed_request_command(request, payload, length)) {
+            send_frame_message(session, header[0], FRAME_END | FRAME_ERROR, request_id, "Unknown command");
+            free(request);
+            continue;
+        }
+
+        // Stop reading while the connection has its fill of requests in flight
+        pthread_mutex_lock(&session->lock);
+        while (session->inflight >= FRAMED_MAX_INFLIGHT) {
+            pthread_cond_wait(&session->request_done, &session->lock);
+        }
+        session->inflight++;
+        pthread_mutex_unlock(&session->lock);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, framed_request_main, request) != 0) {
+            send_frame_message(session, request->opcode, FRAME_END | FRAME_ERROR, request_id, "Server out of resources");
+            free(request);
+            pthread_mutex_lock(&session->lock);
+            session->inflight--;
+            pthread_mutex_unlock(&session->lock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // Requests still running write to the socket, so wait for them before it is closed
+    pthread_mutex_lock(&session->lock);
+    while (session->inflight > 0) {
+        pthread_cond_wait(&session->request_done, &session->lock);
+    }
+    pthread_mutex_unlock(&session->lock);
+    pthread_mutex_destroy(&session->write_lock);
+    pthread_mutex_destroy(&session->lock);
+    pthread_cond_destroy(&session->request_done);
+    free(session);
+}
+
+void handle_client_requests(int client_socket, int connection_count) {
+    char buffer[MAXDATASIZE];
+    int num_bytes_recv;
+    bool first = true;
+
+    while (1) {
+        num_bytes_recv = recv(client_socket, buffer, MAXDATASIZE - 1, 0);
+        if (num_bytes_recv <= 0) {
+            break;
+        }
+        if (first && is_version_byte(buffer[0])) {
+            int version = negotiate_protocol(client_socket, buffer[0]);
+            if (version == -1) {
+                break;
+            }
+            if (version >= PROTOCOL_FRAMED) {
+                run_framed_session(client_socket, connection_count, buffer + 1, num_bytes_recv - 1);
+                break;
+            }
+            memmove(buffer, buffer + 1, --num_bytes_recv);
+        }
+        first = false;
+        if (num_bytes_recv == 0) {
+            continue;
+        }
+        buffer[num_bytes_recv] = '\0';
+
+        dispatch_command(client_socket, connection_count, buffer);
+    }
+    close(client_socket);
+}
+
+// Route a single command either to a mirror or to the local handlers
+void dispatch_command(int client_socket, int connection_count, const char *buffer) {
+#ifdef MIRROR_SERVER
+    // Mirrors serve everything the main server hands them
+    (void)connection_count;
+    serve_locally(client_socket, buffer);
+    return;
+#endif
+    int backend = route_command(connection_count);
+    if (backend != BACKEND_LOCAL) {
+        perform_redirection(client_socket, backend_names[backend], buffer);
+    } else {
+        serve_locally(client_socket, buffer);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Mirror connection pool
+//
+// Each mirror gets up to MIRROR_POOL_SIZE long-lived connections speaking the
+// framed protocol, so redirected commands skip the TCP handshake and several
+// can share one connection. A reader thread per connection matches response
+// frames to requests by id and queues their payload on the request; the thread
+// that made the request sends it on to its client, however long the response
+// is. The reader never writes to a client socket, so a slow client cannot hold
+// up the other requests on its connection: once it falls MIRROR_CLIENT_QUEUE
+// bytes behind, it is cut off. Connections left idle are pinged by a
+// health thread and dropped if the mirror does not answer. A command that could
+// not reach its mirror, or whose connection died before any of the response was
+// relayed, is served locally instead.
+//
+// Threads do not survive fork(), so a forked connection handler starts its own
+// pool on first use; in epoll mode one pool serves the whole process.
+// ---------------------------------------------------------------------------
+
+struct mirror_pool;
+
+// A redirected command waiting for its response
+struct mirror_request {
+    uint32_t id;
+    int client_socket;       // -1 for health-check pings
+    bool relayed;            // Some of the response is already bound for the client
+    bool client_gone;
+    bool done;
+    bool failed;             // The connection died before the response ended
+    char *reply;             // Pings collect the mirror's load report here
+    size_t reply_capacity;
+    size_t reply_length;
+    char *queue;             // Response bytes not yet taken by the requesting thread
+    size_t queue_length;
+    size_t queue_capacity;
+    pthread_cond_t *wake;    // Signalled when bytes are queued or the request ends; NULL for pings
+    struct mirror_request *next;
+};
+
+struct mirror_link {
+    struct mirror_pool *pool;
+    int fd;                  // -1 while disconnected
+    bool connecting;
+    uint32_t next_id;
+    int inflight;
+    long last_used_us;
+    struct mirror_request *pending;
+    pthread_mutex_t write_lock;  // Keeps request frames whole
+};
+
+struct mirror_pool {
+    const char *name;
+    const char *ip;
+    int port;
+    pthread_mutex_t lock;        // Guards the links and their pending lists
+    pthread_cond_t progress;     // Signalled whenever a request finishes
+    struct mirror_link links[MIRROR_POOL_SIZE];
+    long retry_after_us;         // Do not redial before this time after a failure
+    pid_t pid;                   // Process the pool's threads belong to
+};
+
+static struct mirror_pool mirror_pools[] = {
+    { .name = "Mirror1", .ip = MIRROR1_IP, .port = MIRROR1_PORT },
+    { .name = "Mirror2", .ip = MIRROR2_IP, .port = MIRROR2_PORT },
+};
+static pthread_mutex_t mirror_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int recv_all(int socket_fd, void *buffer, size_t length) {
+    char *data = buffer;
+
+    while (length > 0) {
+        ssize_t n = recv(socket_fd, data, length, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Translate a text command into an opcode and its arguments; false if it has no opcode
+static bool command_to_frame(const char *command, uint8_t *opcode, const char **arguments) {
+    size_t best_length = 0;
+
+    for (size_t op = 1; op < sizeof(frame_commands) / sizeof(frame_commands[0]); op++) {
+        const char *name = frame_commands[op];
+        size_t length = name != NULL ? strlen(name) : 0;
+        // The longest match wins, so "w24fn --content" is not taken for "w24fn"
+        if (length > best_length && strncmp(command, name, length) == 0 && (command[length] == '\0' || command[length] == ' ')) {
+            *opcode = op;
+            best_length = length;
+        }
+    }
+    if (best_length == 0) {
+        return false;
+    }
+    *arguments = command + best_length;
+    while (**arguments == ' ') {
+        (*arguments)++;
+    }
+    return true;
+}
+
+// Mark the link's requests failed and forget its connection. Called by the link's
+// reader with the pool lock held; the write lock keeps senders off the closing socket.
+static void mirror_link_reset(struct mirror_link *link) {
+    pthread_mutex_lock(&link->write_lock);
+    for (struct mirror_request *request = link->pending; request != NULL; request = request->next) {
+        request->failed = true;
+        request->done = true;
+        if (request->wake != NULL) {
+            pthread_cond_signal(request->wake);
+        }
+    }
+    link->pending = NULL;
+    link->inflight = 0;
+    close(link->fd);
+    link->fd = -1;
+    pthread_mutex_unlock(&link->write_lock);
+    pthread_cond_broadcast(&link->pool->progress);
+}
+
+// Queue bytes for the thread that sends them to the request's client. A client that is
+// gone or too far behind gets nothing more. Called with the pool lock held.
+static void mirror_queue_payload(struct mirror_pool *pool, struct mirror_request *request, const char *data, size_t length) {
+    if (request->client_gone) {
+        return;
+    }
+    if (request->queue_length + length > request->queue_capacity) {
+        size_t capacity = request->queue_capacity ? request->queue_capacity : FRAME_MAX_PAYLOAD;
+        while (capacity < request->queue_length + length) {
+            capacity *= 2;
+        }
+        char *queue = capacity <= MIRROR_CLIENT_QUEUE ? realloc(request->queue, capacity) : NULL;
+        if (queue == NULL) {
+            log_message(WARNING, "Client fell more than %d bytes behind %s and was cut off", MIRROR_CLIENT_QUEUE, pool->name);
+            // Ends the stream, and wakes the requesting thread if it is stuck sending to the client
+            shutdown(request->client_socket, SHUT_RDWR);
+            request->client_gone = true;
+            free(request->queue);
+            request->queue = NULL;
+            request->queue_length = request->queue_capacity = 0;
+            pthread_cond_signal(request->wake);
+            return;
+        }
+        request->queue = queue;
+        request->queue_capacity = capacity;
+    }
+    memcpy(request->queue + request->queue_length, data, length);
+    request->queue_length += length;
+    request->relayed = true;
+    pthread_cond_signal(request->wake);
+}
+
+// Read one frame's payload and hand it to the request it belongs to
+static int mirror_relay_payload(struct mirror_link *link, struct mirror_request *request, uint32_t length, char *buffer) {
+    struct mirror_pool *pool = link->pool;
+
+    while (length > 0) {
+        size_t take = length < FRAME_MAX_PAYLOAD ? length : FRAME_MAX_PAYLOAD;
+        if (recv_all(link->fd, buffer, take) == -1) {
+            return -1;
+        }
+        if (request != NULL && request->reply != NULL) {
+            size_t room = request->reply_capacity - 1 - request->reply_length;
+            size_t copy = take < room ? take : room;
+            memcpy(request->reply + request->reply_length, buffer, copy);
+            request->reply_length += copy;
+            request->reply[request->reply_length] = '\0';
+        }
+        if (request != NULL && request->client_socket != -1) {
+            pthread_mutex_lock(&pool->lock);
+            mirror_queue_payload(pool, request, buffer, take);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        length -= take;
+    }
+    return 0;
+}
+
+static void *mirror_reader_main(void *arg) {
+    struct mirror_link *link = arg;
+    struct mirror_pool *pool = link->pool;
+    char *buffer = malloc(FRAME_MAX_PAYLOAD);
+
+    while (buffer != NULL) {
+        unsigned char header[FRAME_HEADER_SIZE];
+        uint32_t request_id, length;
+
+        if (recv_all(link->fd, header, sizeof(header)) == -1) {
+            break;
+        }
+        memcpy(&request_id, header + 4, 4);
+        memcpy(&length, header + 8, 4);
+        request_id = ntohl(request_id);
+        length = ntohl(length);
+
+        // Only this thread completes requests, so the match stays valid outside the lock
+        pthread_mutex_lock(&pool->lock);
+        struct mirror_request *request = link->pending;
+        while (request != NULL && request->id != request_id) {
+            request = request->next;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (mirror_relay_payload(link, request, length, buffer) == -1) {
+            break;
+        }
+        if (request != NULL && (header[1] & FRAME_END)) {
+            pthread_mutex_lock(&pool->lock);
+            struct mirror_request **slot = &link->pending;
+            while (*slot != request) {
+                slot = &(*slot)->next;
+            }
+            *slot = request->next;
+            link->inflight--;
+            link->last_used_us = monotonic_us();
+            request->done = true;
+            if (request->wake != NULL) {
+                pthread_cond_signal(request->wake);
+            }
+            pthread_cond_broadcast(&pool->progress);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    log_message(WARNING, "Connection to %s lost", pool->name);
+    mirror_link_reset(link);
+    pthread_mutex_unlock(&pool->lock);
+    free(buffer);
+    return NULL;
+}
+
+// Open a framed connection to the pool's mirror; returns the socket or -1
+static int mirror_dial(struct mirror_pool *pool) {
+    struct sockaddr_in mirror_addr;
+    unsigned char version = PROTOCOL_FRAMED;
+    int one = 1;
+    int mirror_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (mirror_socket == -1) {
+        perror("Mirror socket creation failed");
+        return -1;
+    }
+
+    mirror_addr.sin_family = AF_INET;
+    mirror_addr.sin_port = htons(pool->port);
+    mirror_addr.sin_addr.s_addr = inet_addr(pool->ip);
+    memset(&(mirror_addr.sin_zero), '\0', 8);
+
+    if (connect(mirror_socket, (struct sockaddr *)&mirror_addr, sizeof(struct sockaddr)) == -1 ||
+        send(mirror_socket, &version, 1, MSG_NOSIGNAL) != 1 || recv_all(mirror_socket, &version, 1) == -1 ||
+        version != PROTOCOL_FRAMED) {
+        close(mirror_socket);
+        return -1;
+    }
+    setsockopt(mirror_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return mirror_socket;
+}
+
+// Pick the connected link with the fewest requests in flight, dialling a new one
+// while the pool has room. Called with the pool lock held, which it may drop.
+static struct mirror_link *mirror_pick_link(struct mirror_pool *pool) {
+    struct mirror_link *best = NULL;
+    struct mirror_link *spare = NULL;
+
+    for (int i = 0; i < MIRROR_POOL_SIZE; i++) {
+        struct mirror_link *link = &pool->links[i];
+        if (link->fd != -1 && (best == NULL || link->inflight < best->inflight)) {
+            best = link;
+        } else if (link->fd == -1 && !link->connecting && spare == NULL) {
+            spare = link;
+        }
+    }
+    // Only open another connection when every existing one is busy
+    if ((best != NULL && best->inflight == 0) || spare == NULL || monotonic_us() < pool->retry_after_us) {
+        return best;
+    }
+
+    spare->connecting = true;
+    pthread_mutex_unlock(&pool->lock);
+    int fd = mirror_dial(pool);
+    pthread_mutex_lock(&pool->lock);
+    spare->connecting = false;
+    if (fd == -1) {
+        pool->retry_after_us = monotonic_us() + MIRROR_RETRY_INTERVAL * 1000000L;
+        return best;
+    }
+
+    pthread_t reader;
+    spare->fd = fd;
+    spare->last_used_us = monotonic_us();
+    if (pthread_create(&reader, NULL, mirror_reader_main, spare) != 0) {
+        close(fd);
+        spare->fd = -1;
+        return best;
+    }
+    pthread_detach(reader);
+    return spare;
+}
+
+// Give a request an id on the link. Called with the pool lock held.
+static void mirror_register_request(struct mirror_link *link, struct mirror_request *request) {
+    request->id = link->next_id++;
+    request->next = link->pending;
+    link->pending = request;
+    link->inflight++;
+}
+
+// Send a registered request. Called without the pool lock: a send blocked on a busy
+// mirror must not stop the reader from draining responses.
+static void mirror_write_request(struct mirror_link *link, struct mirror_request *request, uint8_t opcode, const char *arguments) {
+    unsigned char frame[FRAME_HEADER_SIZE + MAXDATASIZE];
+    uint32_t length = strnlen(arguments, MAXDATASIZE);
+    uint32_t id = htonl(request->id);
+    uint32_t prefix = htonl(length);
+
+    frame[0] = opcode;
+    frame[1] = 0;
+    frame[2] = frame[3] = 0;
+    memcpy(frame + 4, &id, 4);
+    memcpy(frame + 8, &prefix, 4);
+    memcpy(frame + FRAME_HEADER_SIZE, arguments, length);
+
+    pthread_mutex_lock(&link->write_lock);
+    // A request failed by a reset no longer owns the socket number
+    if (!request->failed && send_all(link->fd, frame, FRAME_HEADER_SIZE + length) == -1) {
+        // The reader sees the broken connection and fails the request
+        shutdown(link->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&link->write_lock);
+}
+
+// Ping a link and wait for the answer, dropping the connection if it does not come
+// in time. Returns false if the ping failed. Called with the pool lock held.
+static bool mirror_ping_link(struct mirror_pool *pool, struct mirror_link *link, char *reply, size_t capacity) {
+    struct mirror_request ping = { .client_socket = -1, .reply = reply, .reply_capacity = capacity };
+    struct timespec deadline;
+    int fd = link->fd;
+
+    if (reply != NULL) {
+        reply[0] = '\0';
+    }
+    mirror_register_request(link, &ping);
+    pthread_mutex_unlock(&pool->lock);
+    mirror_write_request(link, &ping, OP_PING, "");
+    pthread_mutex_lock(&pool->lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += MIRROR_HEALTH_TIMEOUT;
+    while (!ping.done) {
+        if (pthread_cond_timedwait(&pool->progress, &pool->lock, &deadline) == ETIMEDOUT && !ping.done) {
+            log_message(WARNING, "%s did not answer a health check", pool->name);
+            // The reader fails every request on the link, the ping included
+            shutdown(fd, SHUT_RDWR);
+            deadline.tv_sec += MIRROR_HEALTH_TIMEOUT;
+        }
+    }
+    return !ping.failed;
+}
+
+// Process whose health threads also poll the mirrors' load for the router
+static pid_t route_monitor_pid;
+
+// Ask the mirror for its load and publish it to the router
+static void mirror_poll_load(struct mirror_pool *pool, int backend) {
+    struct backend_load *load = &route_stats->backends[backend];
+    char report[64];
+    int inflight, queue;
+    long p99_us;
+
+    pthread_mutex_lock(&pool->lock);
+    struct mirror_link *link = mirror_pick_link(pool);
+    bool answered = link != NULL && mirror_ping_link(pool, link, report, sizeof(report));
+    pthread_mutex_unlock(&pool->lock);
+
+    if (answered && sscanf(report, "%d %d %ld", &inflight, &queue, &p99_us) == 3) {
+        atomic_store(&load->reported_inflight, inflight);
+        atomic_store(&load->reported_queue, queue);
+        atomic_store(&load->reported_p99_us, p99_us);
+        atomic_store(&load->reported_at_us, monotonic_us());
+    } else {
+        atomic_store(&load->reported_at_us, 0);
+    }
+}
+
+// Ping connections that have been idle for a while and drop those that do not answer.
+// In the routing monitor's process, also poll the mirror's load.
+static void *mirror_health_main(void *arg) {
+    struct mirror_pool *pool = arg;
+    int backend = BACKEND_MIRROR1 + (pool - mirror_pools);
+    long last_check_us = monotonic_us();
+
+    while (1) {
+        usleep(ROUTE_POLL_INTERVAL_MS * 1000);
+        if (getpid() == route_monitor_pid && route_stats != NULL) {
+            mirror_poll_load(pool, backend);
+        }
+        if (monotonic_us() - last_check_us < MIRROR_HEALTH_INTERVAL * 1000000L) {
+            continue;
+        }
+        last_check_us = monotonic_us();
+        for (int i = 0; i < MIRROR_POOL_SIZE; i++) {
+            struct mirror_link *link = &pool->links[i];
+
+            pthread_mutex_lock(&pool->lock);
+            if (link->fd != -1 && link->inflight == 0 && monotonic_us() - link->last_used_us >= MIRROR_HEALTH_INTERVAL * 1000000L) {
+                mirror_ping_link(pool, link, NULL, 0);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+// Find the pool for a destination, starting it in this process if needed
+static struct mirror_pool *mirror_pool_get(const char *destination) {
+    struct mirror_pool *pool = NULL;
+
+    for (size_t i = 0; i < sizeof(mirror_pools) / sizeof(mirror_pools[0]); i++) {
+        if (strcmp(destination, mirror_pools[i].name) == 0) {
+            pool = &mirror_pools[i];
+        }
+    }
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mirror_pools_lock);
+    if (pool->pid != getpid()) {
+        pthread_condattr_t attr;
+        pthread_t health;
+
+        // Connections inherited from the parent belong to its reader threads
+        for (int i = 0; i < MIRROR_POOL_SIZE; i++) {
+            if (pool->pid != 0 && pool->links[i].fd != -1) {
+                close(pool->links[i].fd);
+            }
+            memset(&pool->links[i], 0, sizeof(pool->links[i]));
+            pool->links[i].pool = pool;
+            pool->links[i].fd = -1;
+            pthread_mutex_init(&pool->links[i].write_lock, NULL);
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&pool->progress, &attr);
+        pthread_condattr_destroy(&attr);
+        pool->retry_after_us = 0;
+        pool->pid = getpid();
+        if (pthread_create(&health, NULL, mirror_health_main, pool) == 0) {
+            pthread_detach(health);
+        }
+    }
+    pthread_mutex_unlock(&mirror_pools_lock);
+    return pool;
+}
+
+// Relay one command to a mirror over the pool, sending the response to the client
+// as the link's reader queues it. Returns false if the mirror could not be used and
+// nothing was sent to the client, so the caller can serve it itself.
+static bool mirror_relay(struct mirror_pool *pool, int client_socket, uint8_t opcode, const char *arguments) {
+    pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+    struct mirror_request request = { .client_socket = client_socket, .wake = &wake };
+
+    pthread_mutex_lock(&pool->lock);
+    struct mirror_link *link = mirror_pick_link(pool);
+    if (link == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    mirror_register_request(link, &request);
+    pthread_mutex_unlock(&pool->lock);
+    mirror_write_request(link, &request, opcode, arguments);
+
+    pthread_mutex_lock(&pool->lock);
+    while (!request.done || request.queue_length > 0) {
+        if (request.queue_length == 0) {
+            pthread_cond_wait(&wake, &pool->lock);
+            continue;
+        }
+        // Take the queued bytes, and leave the reader an empty queue while they go out
+        char *data = request.queue;
+        size_t length = request.queue_length;
+        request.queue = NULL;
+        request.queue_length = request.queue_capacity = 0;
+        pthread_mutex_unlock(&pool->lock);
+        bool sent = send_all(client_socket, data, length) == 0;
+        free(data);
+        pthread_mutex_lock(&pool->lock);
+        if (!sent) {
+            request.client_gone = true;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(request.queue);
+    pthread_cond_destroy(&wake);
+    return !request.failed || request.relayed;
+}
+
+// Start polling the mirrors' load for the router from this process
+void start_route_monitor(void) {
+    route_monitor_pid = getpid();
+    for (int b = BACKEND_MIRROR1; b < ROUTE_BACKENDS; b++) {
+        mirror_pool_get(backend_names[b]);
+    }
+}
+
+void perform_redirection(int client_socket, const char *destination, const char *buffer) {
+    struct mirror_pool *pool = mirror_pool_get(destination);
+    const char *arguments;
+    uint8_t opcode;
+
+    // Commands without an opcode (quitc, unknown ones) never leave this server
+    if (pool == NULL || !command_to_frame(buffer, &opcode, &arguments)) {
+        serve_locally(client_socket, buffer);
         return;
     }
 
-    // Construct the find command to search for files with specified extensions in the specified directory
-    char find_command[MAXDATASIZE];
-    snprintf(find_command, sizeof(find_command), "find ~ -type f \\( -name \"*.%s\"", ext1);
-    if (num_matched >= 2) {
-        snprintf(find_command + strlen(find_command), sizeof(find_command) - strlen(find_command), " -o -name \"*.%s\"", ext2);
-    }
-    if (num_matched == 3) {
-        snprintf(find_command + strlen(find_command), sizeof(find_command) - strlen(find_command), " -o -name \"*.%s\"", ext3);
+    struct backend_load *load = route_stats ? &route_stats->backends[BACKEND_MIRROR1 + (pool - mirror_pools)] : NULL;
+    if (load != NULL) {
+        atomic_fetch_add(&load->outstanding, 1);
+    }
+    bool relayed = mirror_relay(pool, client_socket, opcode, arguments);
+    if (load != NULL) {
+        atomic_fetch_sub(&load->outstanding, 1);
+    }
+
+    if (!relayed) {
+        log_message(WARNING, "%s unavailable, serving '%s' locally", destination, buffer);
+        // Keep routing around the mirror until it reports in again
+        if (load != NULL) {
+            atomic_store(&load->reported_at_us, 0);
+        }
+        serve_locally(client_socket, buffer);
+    }
+}
+
+void handle_direct_command(int client_socket, const char *buffer) {
+    if (!serve_from_cache(client_socket, buffer)) {
+        run_command(client_socket, buffer);
+    }
+}
+
+void run_command(int client_socket, const char *buffer) {
+    if (strcmp(buffer, "dirlist -a") == 0 || strncmp(buffer, "dirlist -a ", 11) == 0) {
+        // Options, if any, select one page of the listing
+        handleDirectoryListing(client_socket, buffer + 10);
+    } else if (strcmp(buffer, "dirlist -t") == 0) {
+        handle_dirlist_t(client_socket);
+    } else if (strcmp(buffer, "w24stats") == 0) {
+        handle_w24stats(client_socket);
+    } else if (strcmp(buffer, "quitc") == 0) {
+        // Handle quit command
+        char response[] = "quitc"; // Send confirmation to client
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+    } else if (strncmp(buffer, "w24fn --content ", 16) == 0) {
+        // Extract filename from client request
+        char filename[MAXDATASIZE];
+        sscanf(buffer + 16, "%s", filename);
+        handle_w24fn_content(client_socket, filename);
+    } else if (strncmp(buffer, "w24fn ", 6) == 0) {
+        // Extract filename from client request
+        char filename[MAXDATASIZE];
+        sscanf(buffer + 6, "%s", filename);
+        handle_w24fn(client_socket, filename);
+    } else if (strncmp(buffer, "w24fz ", 6) == 0) {
+        // Extract size parameters from client request
+        long size1, size2;
+        if (sscanf(buffer + 6, "%ld %ld", &size1, &size2) != 2) {
+            // The socket belongs to the caller, so report the error instead of closing it here
+            char response[] = "Invalid command syntax for w24fz";
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+        handle_w24fz(client_socket, size1, size2);
+    } else if (strncmp(buffer, "w24ft ", 6) == 0) {
+        // The handler splits the extension list itself
+        handle_w24ft(client_socket, buffer + 6);
+    } else if (strncmp(buffer, "w24fdb ", 7) == 0) {
+        // Extract date from client request
+        char date[MAXDATASIZE];
+        sscanf(buffer + 7, "%s", date);
+        handle_w24fdb(client_socket, date);
+    } else if (strncmp(buffer, "w24fda ", 7) == 0) {
+        // Extract date from client request
+        char date[MAXDATASIZE];
+        sscanf(buffer + 7, "%s", date);
+        handle_w24fda(client_socket, date);
+    } else if (strncmp(buffer, "w24fdr ", 7) == 0) {
+        // Both dates are parsed by the handler
+        handle_w24fdr(client_socket, buffer + 7);
+    } else if (strncmp(buffer, "w24fs ", 6) == 0) {
+        handle_w24fs(client_socket, buffer + 6);
+    } else {
+        // Handle unknown command
+        char response[] = "Unknown command";
+        send(client_socket, response, strlen(response), 0);
+    }
+}
+
+
+// ---------------------------------------------------------------------------
+// Event-driven (epoll) server mode
+//
+// One reactor thread per core owns a SO_REUSEPORT listening socket and an
+// edge-triggered epoll set with every client socket it accepted. Commands are
+// parsed incrementally out of a per-connection buffer and handed to a bounded
+// worker pool, so the filesystem-heavy handlers never block the reactors.
+// ---------------------------------------------------------------------------
+
+struct reactor;
+
+// Per-connection state owned by a reactor
+struct connection {
+    int fd;
+    int connection_count;
+    struct reactor *reactor;
+    char buffer[MAXDATASIZE + 1];
+    size_t buffer_len;
+    bool busy;           // A worker currently owns the socket
+    bool peer_closed;    // Peer hung up while a worker owned the socket
+    bool negotiated;     // The first byte has been checked for a protocol version
+    long queued_us;      // When the pending command was queued for a worker
+    char command[MAXDATASIZE + 1];
+    struct connection *next_done;
+};
+
+struct reactor {
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;         // eventfd signalled by workers when a command completes
+    pthread_t thread;
+    pthread_mutex_t done_lock;
+    struct connection *done_list;
+};
+
+// Bounded queue of connections waiting for a worker
+struct work_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    struct connection *items[WORK_QUEUE_CAPACITY];
+    size_t capacity;
+    size_t head;
+    size_t count;
+};
+
+// One queue per admission lane, each drained by the lane's own workers
+static struct work_queue epoll_work_queues[LANES] = {
+    [LANE_INTERACTIVE] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0 }, WORK_QUEUE_CAPACITY, 0, 0 },
+    [LANE_HEAVY] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0 }, LANE_HEAVY_QUEUE, 0, 0 },
+};
+static atomic_int epoll_connection_count;
+
+// Commands waiting for a worker; always 0 in fork mode
+int epoll_lane_queue_depth(enum Lane l) {
+    pthread_mutex_lock(&epoll_work_queues[l].lock);
+    int depth = epoll_work_queues[l].count;
+    pthread_mutex_unlock(&epoll_work_queues[l].lock);
+    return depth;
+}
+
+int epoll_queue_depth(void) {
+    int depth = 0;
+
+    for (int l = 0; l < LANES; l++) {
+        depth += epoll_lane_queue_depth(l);
+    }
+    return depth;
+}
+
+static int set_nonblocking(int fd, bool nonblocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// Create a listening socket; reactors each bind their own copy with SO_REUSEPORT
+static int create_listen_socket(bool reuse_port, int backlog) {
+    int sockfd;
+    int one = 1;
+    struct sockaddr_in my_addr;
+
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    if (reuse_port) {
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+            perror("SO_REUSEPORT failed");
+            close(sockfd);
+            return -1;
+        }
+    }
+
+    // Server address setup
+    my_addr.sin_family = AF_INET;
+    my_addr.sin_port = htons(PORT);
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+    memset(&(my_addr.sin_zero), '\0', 8);
+
+    if (bind(sockfd, (struct sockaddr *)&my_addr, sizeof(struct sockaddr)) == -1) {
+        perror("Bind failed");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, backlog) == -1) {
+        perror("Listen failed");
+        close(sockfd);
+        return -1;
     }
-    strcat(find_command, " \\)");
-    printf("Find command: %s\n", find_command);
 
-    // Execute the find command to get a list of files matching the extensions
-    FILE *find_output = popen(find_command, "r");
-    if (!find_output) {
-        perror("Error executing find command");
-        send(client_socket, "Error executing find command", strlen("Error executing find command"), 0);
-        return;
-    }
+    return sockfd;
+}
 
-    // Check if any files are found
-    char file_path[MAXDATASIZE];
-    if (fgets(file_path, sizeof(file_path), find_output) == NULL) {
-        printf("No files found with the specified extensions.\n");
-        send(client_socket, "No file found", strlen("No file found"), 0);
-        pclose(find_output);
-        return;
-    }
+static bool work_queue_try_push(struct work_queue *queue, struct connection *conn) {
+    bool pushed = false;
 
-    // Create a temporary file to store the list of files
-    char temp_file[] = "/home/username/w24project/w24ft_temp_list.txt";
-    FILE *temp_file_ptr = fopen(temp_file, "w");
-    if (!temp_file_ptr) {
-        perror("Error creating temporary file");
-        send(client_socket, "Error creating temporary file", strlen("Error creating temporary file"), 0);
-        pclose(find_output);
-        return;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->capacity) {
+        queue->items[(queue->head + queue->count) % queue->capacity] = conn;
+        queue->count++;
+        pushed = true;
+        pthread_cond_signal(&queue->not_empty);
     }
-    printf("Temporary file created: %s\n", temp_file);
-
-    // Read the list of files from the find command output and write to the temporary file
-    do {
-        // Remove newline character from file path
-        file_path[strcspn(file_path, "\n")] = '\0';
-        fprintf(temp_file_ptr, "%s\n", file_path);
-    } while (fgets(file_path, sizeof(file_path), find_output));
+    pthread_mutex_unlock(&queue->lock);
+    return pushed;
+}
 
-    // Close the temporary file and find command output
-    fclose(temp_file_ptr);
-    pclose(find_output);
+static struct connection *work_queue_pop(struct work_queue *queue) {
+    struct connection *conn;
 
-    // Compress the files into a temporary tar.gz archive
-    char tar_command[MAXDATASIZE];
-    snprintf(tar_command, sizeof(tar_command), "%s /home/username/w24project/w24ft_temp.tar.gz -T /home/username/w24project/w24ft_temp_list.txt", TAR_COMMAND);
-    printf("Tar command: %s\n", tar_command);
-    int ret = system(tar_command);
-    if (ret == -1) {
-        perror("Error compressing files into tar.gz");
-        send(client_socket, "Error compressing files into tar.gz", strlen("Error compressing files into tar.gz"), 0);
-        return;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
     }
+    conn = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return conn;
+}
 
-    // Open the temporary tar.gz file for reading
-    FILE *tar_file = fopen("/home/username/w24project/w24ft_temp.tar.gz", "rb");
-    if (!tar_file) {
-        perror("Error opening temporary tar.gz file");
-        send(client_socket, "Error opening temporary tar.gz file", strlen("Error opening temporary tar.gz file"), 0);
-        return;
-    }
+static void close_connection(struct connection *conn) {
+    epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn);
+}
 
-    // Send the contents of the temporary tar.gz file to the client
-    char buffer[MAXDATASIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), tar_file)) > 0) {
-        //send(client_socket, buffer, bytes_read, 0);
-    }
+// Run the pending command of a connection with the socket in blocking mode
+static void run_connection_command(struct connection *conn) {
+    set_nonblocking(conn->fd, false);
+    dispatch_command(conn->fd, conn->connection_count, conn->command);
+    set_nonblocking(conn->fd, true);
+}
+
+// Hand a finished connection back to its reactor
+static void complete_connection_command(struct connection *conn) {
+    struct reactor *reactor = conn->reactor;
+    uint64_t one = 1;
 
-    // Close the temporary tar.gz file
-    fclose(tar_file);
-    send(client_socket, "Tar created successfully", strlen("Tar created successfully"), 0);
+    pthread_mutex_lock(&reactor->done_lock);
+    conn->next_done = reactor->done_list;
+    reactor->done_list = conn;
+    pthread_mutex_unlock(&reactor->done_lock);
 
+    if (write(reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("eventfd write");
+    }
 }
 
-// Function to convert date string to time_t
-time_t convert_date_string(const char *date) {
-    struct tm tm = {0};
-    if (strptime(date, DATE_FORMAT, &tm) == NULL) {
-        perror("Date parsing failed");
-        exit(EXIT_FAILURE);
+// Worker of one lane's pool; arg is the lane
+static void *epoll_worker_main(void *arg) {
+    struct work_queue *queue = &epoll_work_queues[(intptr_t)arg];
+
+    if ((intptr_t)arg == LANE_HEAVY) {
+        lane_lower_priority();
     }
-    return mktime(&tm);
+    while (1) {
+        struct connection *conn = work_queue_pop(queue);
+        // The wait in the queue counts towards the lane's wait histogram
+        command_queued_us = conn->queued_us;
+        run_connection_command(conn);
+        command_queued_us = 0;
+        complete_connection_command(conn);
+    }
+    return NULL;
 }
 
-// Function to recursively search for files created before or on the specified date, ignoring files and directories starting with "."
-int search_files_by_date(const char *path, time_t target_date, FILE *temp_file) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
-    int files_found = 0;
+// Extract the next complete command from the connection buffer.
+// Commands end with a newline; legacy clients send one unterminated command per
+// write, so whatever is buffered once the socket is drained also counts as one.
+static bool next_command(struct connection *conn, bool drained) {
+    char *newline = memchr(conn->buffer, '\n', conn->buffer_len);
+    size_t length;
+    size_t consumed;
+
+    if (newline != NULL) {
+        length = newline - conn->buffer;
+        consumed = length + 1;
+    } else if (drained && conn->buffer_len > 0) {
+        length = conn->buffer_len;
+        consumed = length;
+    } else {
+        return false;
+    }
 
-    dir = opendir(path);
-    if (dir == NULL) {
-        perror("Error opening directory");
-        return -1;
+    memcpy(conn->command, conn->buffer, length);
+    conn->command[length] = '\0';
+    if (length > 0 && conn->command[length - 1] == '\r') {
+        conn->command[length - 1] = '\0';
     }
+    memmove(conn->buffer, conn->buffer + consumed, conn->buffer_len - consumed);
+    conn->buffer_len -= consumed;
+    return true;
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        // Ignore files and directories starting with "."
-        if (entry->d_name[0] == '.') {
+// Process buffered commands until one is handed to a worker or the buffer runs dry.
+// Returns false if the connection was closed.
+static bool process_connection_commands(struct connection *conn, bool drained) {
+    while (!conn->busy && next_command(conn, drained)) {
+        if (conn->command[0] == '\0') {
             continue;
         }
 
-        char full_path[MAX_PATH_LENGTH];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+        if (strcmp(conn->command, "quitc") == 0) {
+            char response[] = "quitc"; // Send confirmation to client
+            send(conn->fd, response, strlen(response), MSG_NOSIGNAL);
+            close_connection(conn);
+            return false;
+        }
 
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue; // Skip "." and ".." directories
-        }
-
-        if (stat(full_path, &file_stat) == 0) {
-            if (S_ISREG(file_stat.st_mode) && difftime(file_stat.st_ctime, target_date) <= 0) {
-                // File creation date is before or on the target date
-                fprintf(temp_file, "%s\n", full_path);
-                files_found = 1;
-            } else if (S_ISDIR(file_stat.st_mode)) {
-                // Recursively search directories
-                files_found = search_files_by_date(full_path, target_date, temp_file);
-                if (files_found == -1) {
-                    closedir(dir);
-                    return -1;
-                }
-            }
+        enum Lane lane = command_lane(conn->command);
+        conn->busy = true;
+        conn->queued_us = monotonic_us();
+        if (!work_queue_try_push(&epoll_work_queues[lane], conn)) {
+            // The lane's queue is full: refuse the command rather than run it on the reactor
+            char response[MAXDATASIZE];
+            lane_refuse(lane, epoll_work_queues[lane].capacity, response, sizeof(response));
+            send(conn->fd, response, strlen(response), MSG_NOSIGNAL);
+            conn->busy = false;
         }
     }
-
-    closedir(dir);
-    return files_found;
+    return true;
 }
 
+static void *framed_connection_main(void *arg) {
+    struct connection *conn = arg;
 
-// Function to handle w24fdb command
-void handle_w24fdb(int client_socket, const char *date) {
-    // Convert date string to time_t
-    time_t target_date = convert_date_string(date);
+    run_framed_session(conn->fd, conn->connection_count, conn->buffer, conn->buffer_len);
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
 
-    // Create a temporary file to store the list of files
-    char temp_file_path[] = "/home/username/w24project/w24fdb_temp_list.txt";
-    FILE *temp_file = fopen(temp_file_path, "w");
-    if (!temp_file) {
-        perror("Error creating temporary file");
-        send(client_socket, "Error creating temporary file", strlen("Error creating temporary file"), 0);
+// Framed connections keep many requests in flight, so they leave the reactor for
+// a session thread of their own
+static void start_framed_connection(struct connection *conn) {
+    pthread_t thread;
+
+    epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    set_nonblocking(conn->fd, false);
+    if (pthread_create(&thread, NULL, framed_connection_main, conn) != 0) {
+        perror("Session thread creation failed");
+        close(conn->fd);
+        free(conn);
         return;
     }
+    pthread_detach(thread);
+}
 
-    // Start searching files recursively from the home directory
-    int files_found = search_files_by_date(getenv("HOME"), target_date, temp_file);
+// Check the first bytes of a connection for a version byte.
+// Returns false if the connection left the reactor.
+static bool negotiate_connection(struct connection *conn) {
+    conn->negotiated = true;
+    if (!is_version_byte(conn->buffer[0])) {
+        return true;
+    }
 
-    if (files_found == -1) {
-        fclose(temp_file);
-        return;
+    unsigned char requested = conn->buffer[0];
+    memmove(conn->buffer, conn->buffer + 1, --conn->buffer_len);
+    int version = negotiate_protocol(conn->fd, requested);
+    if (version == -1) {
+        close_connection(conn);
+        return false;
+    }
+    if (version >= PROTOCOL_FRAMED) {
+        start_framed_connection(conn);
+        return false;
     }
+    return true;
+}
 
-    // Close the temporary file
-    fclose(temp_file);
+static void read_connection(struct connection *conn) {
+    bool drained = false;
 
-    if (files_found == 0) {
-        // Send message to client if no files were found
-        send(client_socket, "No files found with the specified creation date or earlier.", strlen("No files found with the specified creation date or earlier."), 0);
-        return;
+    while (conn->buffer_len < MAXDATASIZE) {
+        ssize_t n = recv(conn->fd, conn->buffer + conn->buffer_len, MAXDATASIZE - conn->buffer_len, 0);
+        if (n > 0) {
+            conn->buffer_len += n;
+            continue;
+        }
+        if (n == 0) {
+            conn->peer_closed = true;
+            drained = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            drained = true;
+        } else if (errno != EINTR) {
+            conn->peer_closed = true;
+            drained = true;
+        } else {
+            continue;
+        }
+        break;
     }
 
-    // Create the tar.gz file
-    char tar_command[MAXDATASIZE];
-    snprintf(tar_command, sizeof(tar_command), "tar -czf /home/username/w24project/w24fdb_temp.tar.gz -T %s", temp_file_path);
-    int ret = system(tar_command);
-    if (ret == -1) {
-        perror("Error creating tar.gz file");
-        send(client_socket, "Error creating tar.gz file", strlen("Error creating tar.gz file"), 0);
+    if (!conn->negotiated && conn->buffer_len > 0 && !negotiate_connection(conn)) {
         return;
     }
 
-    // Open the temporary tar.gz file for reading
-    FILE *tar_file = fopen("/home/username/w24project/w24fdb_temp.tar.gz", "rb");
-    if (!tar_file) {
-        perror("Error opening temporary tar.gz file");
-        send(client_socket, "Error opening temporary tar.gz file", strlen("Error opening temporary tar.gz file"), 0);
+    // A full buffer without a newline is treated as one (truncated) legacy command
+    if (!process_connection_commands(conn, drained || conn->buffer_len == MAXDATASIZE)) {
         return;
     }
 
-    // Send the contents of the temporary tar.gz file to the client
-    char buffer[MAXDATASIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), tar_file)) > 0) {
-        //send(client_socket, buffer, bytes_read, 0);
+    if (conn->peer_closed && !conn->busy) {
+        close_connection(conn);
     }
+}
 
-    // Close the temporary tar.gz file
-    fclose(tar_file);
+static void accept_connections(struct reactor *reactor) {
+    while (1) {
+        struct sockaddr_in their_addr;
+        socklen_t sin_size = sizeof(struct sockaddr_in);
+        int new_fd = accept4(reactor->listen_fd, (struct sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-    // Send a confirmation message to the client
-    send(client_socket, "TAR file transmission complete", strlen("TAR file transmission complete"), 0);
-}
-// Function to check if a file's creation date is greater than or equal to the target date
-int is_file_newer_or_equal(const char *file_path, time_t target_date) {
-    struct stat file_stat;
-    if (stat(file_path, &file_stat) == -1) {
-        perror("Error getting file status");
-        return 0;
+        if (new_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+
+        // Log client connection
+        log_message(INFO, "Connection from %s", inet_ntoa(their_addr.sin_addr));
+
+        struct connection *conn = calloc(1, sizeof(struct connection));
+        if (conn == NULL) {
+            close(new_fd);
+            continue;
+        }
+        conn->fd = new_fd;
+        conn->reactor = reactor;
+        conn->connection_count = atomic_fetch_add(&epoll_connection_count, 1);
+
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, new_fd, &event) == -1) {
+            perror("epoll_ctl");
+            close(new_fd);
+            free(conn);
+        }
     }
-    // Check if the file's creation date is greater than or equal to the target date
-    return difftime(file_stat.st_ctime, target_date) >= 0;
 }
 
-// Recursive function to search for files by date in a directory tree
-int search_files_by_date_recursive(const char *dir_path, time_t target_date, FILE *output_file) {
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
-        perror("Error opening directory");
-        return -1;
+// Pick up connections whose command finished on a worker
+static void drain_completed(struct reactor *reactor) {
+    uint64_t value;
+    struct connection *conn;
+
+    if (read(reactor->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        perror("eventfd read");
     }
 
-    struct dirent *entry;
-    int files_found = 0;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".." directories
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+    pthread_mutex_lock(&reactor->done_lock);
+    conn = reactor->done_list;
+    reactor->done_list = NULL;
+    pthread_mutex_unlock(&reactor->done_lock);
+
+    while (conn != NULL) {
+        struct connection *next = conn->next_done;
+        conn->busy = false;
+        // Edge-triggered epoll will not report data that arrived while the worker
+        // owned the socket, so read again before waiting
+        read_connection(conn);
+        conn = next;
+    }
+}
 
-        // Construct the full path of the current entry
-        char entry_path[MAX_PATH_LENGTH];
-        snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name);
+static void *reactor_main(void *arg) {
+    struct reactor *reactor = arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
 
-        // Check if the entry is a directory
-        if (entry->d_type == DT_DIR) {
-            // Recursively search in the subdirectory
-            int subdirectory_files_found = search_files_by_date_recursive(entry_path, target_date, output_file);
-            if (subdirectory_files_found == -1) {
-                closedir(dir);
-                return -1;
+    while (1) {
+        int n = epoll_wait(reactor->epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            files_found += subdirectory_files_found;
-        } else {
-            // Check if the file's creation date is greater than or equal to the target date
-            if (is_file_newer_or_equal(entry_path, target_date)) {
-                // Write the file path to the output file
-                fprintf(output_file, "%s\n", entry_path);
-                files_found = 1;
+            perror("epoll_wait");
+            break;
+        }
+
+        // Completions are handled after the batch, since they may free a
+        // connection that still has an event further down this array
+        bool completions = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(reactor);
+            } else if (events[i].data.ptr == reactor) {
+                completions = true;
+            } else {
+                struct connection *conn = events[i].data.ptr;
+                if (conn->busy) {
+                    // The worker's completion re-reads the socket
+                    if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                        conn->peer_closed = true;
+                    }
+                    continue;
+                }
+                read_connection(conn);
             }
         }
+        if (completions) {
+            drain_completed(reactor);
+        }
     }
-
-    closedir(dir);
-    return files_found;
+    return NULL;
 }
 
-// Function to handle w24fda command
-void handle_w24fda(int client_socket, const char *date) {
-    // Convert date string to time_t
-    time_t target_date = convert_date_string(date);
+static int start_reactor(struct reactor *reactor) {
+    struct epoll_event event;
 
-    // Create a temporary file to store the list of files
-    char temp_file_path[] = "/home/username/w24project/w24fda_temp_list.txt";
-    FILE *temp_file = fopen(temp_file_path, "w");
-    if (!temp_file) {
-        perror("Error creating temporary file");
-        send(client_socket, "Error creating temporary file", strlen("Error creating temporary file"), 0);
-        return;
+    reactor->listen_fd = create_listen_socket(true, EPOLL_BACKLOG);
+    if (reactor->listen_fd == -1) {
+        return -1;
     }
+    set_nonblocking(reactor->listen_fd, true);
 
-    // Start searching files recursively from the home directory
-    int files_found = search_files_by_date_recursive(getenv("HOME"), target_date, temp_file);
-
-    if (files_found == -1) {
-        fclose(temp_file);
-        return;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->epoll_fd == -1 || reactor->wake_fd == -1) {
+        perror("Reactor setup failed");
+        return -1;
     }
+    pthread_mutex_init(&reactor->done_lock, NULL);
+    reactor->done_list = NULL;
 
-    // Close the temporary file
-    fclose(temp_file);
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &event) == -1) {
+        perror("epoll_ctl listen");
+        return -1;
+    }
 
-    if (files_found == 0) {
-        // Send message to client if no files were found
-        send(client_socket, "No files found with the specified creation date or later.", strlen("No files found with the specified creation date or later."), 0);
-        return;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = reactor;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event) == -1) {
+        perror("epoll_ctl eventfd");
+        return -1;
     }
 
-    // Create the tar.gz file
-    char tar_command[MAXDATASIZE];
-    snprintf(tar_command, sizeof(tar_command), "tar -czf /home/username/w24project/w24fda_temp.tar.gz -T %s", temp_file_path);
-    int ret = system(tar_command);
-    if (ret == -1) {
-        perror("Error creating tar.gz file");
-        send(client_socket, "Error creating tar.gz file", strlen("Error creating tar.gz file"), 0);
-        return;
+    return pthread_create(&reactor->thread, NULL, reactor_main, reactor) == 0 ? 0 : -1;
+}
+
+// Start the reactors and one worker pool per lane, sized like the lane; returns only on startup failure
+int run_epoll_server(int reactor_count) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
+    }
+    if (reactor_count <= 0) {
+        reactor_count = cores;
     }
 
-    // Open the temporary tar.gz file for reading
-    FILE *tar_file = fopen("/home/username/w24project/w24fda_temp.tar.gz", "rb");
-    if (!tar_file) {
-        perror("Error opening temporary tar.gz file");
-        send(client_socket, "Error opening temporary tar.gz file", strlen("Error opening temporary tar.gz file"), 0);
-        return;
+    for (int l = 0; l < LANES; l++) {
+        for (int i = 0; i < lane_slot_counts[l]; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, epoll_worker_main, (void *)(intptr_t)l) != 0) {
+                perror("Worker thread creation failed");
+                return -1;
+            }
+            pthread_detach(thread);
+        }
     }
 
-    // Send the contents of the temporary tar.gz file to the client
-    char buffer[MAXDATASIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), tar_file)) > 0) {
-        //send(client_socket, buffer, bytes_read, 0);
+    struct reactor *reactors = calloc(reactor_count, sizeof(struct reactor));
+    if (reactors == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < reactor_count; i++) {
+        if (start_reactor(&reactors[i]) == -1) {
+            return -1;
+        }
     }
 
-    // Close the temporary tar.gz file
-    fclose(tar_file);
+    log_message(INFO, "%s started in epoll mode. Listening on port %d with %d reactors, %d interactive and %d heavy workers", SERVER_NAME, PORT,
+                reactor_count, lane_slot_counts[LANE_INTERACTIVE], lane_slot_counts[LANE_HEAVY]);
 
-    // Send a confirmation message to the client
-    send(client_socket, "TAR file transmission complete", strlen("TAR file transmission complete"), 0);
+    for (int i = 0; i < reactor_count; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    return -1;
 }
 
-
-
-//logmessage function
-void log_message(enum LogLevel level, const char *format, ...) {
-    va_list args;
-    FILE *log_file;
-    time_t current_time;
-    char time_string[30];
-
-    // Open the log file in append mode
-    log_file = fopen(LOG_FILE, "a");
-    if (log_file == NULL) {
-        perror("Error opening log file");
-        return;
+// Walk visitor for --walk-bench: fetch the size of every regular file, as a w24fz walk does
+static enum walk_action count_entry(const struct walk_entry *entry, void *arg) {
+    struct statx stx;
+    (void)arg;
+    if (entry->type == DT_REG) {
+        walk_statx(entry, STATX_SIZE, &stx);
     }
+    return WALK_CONTINUE;
+}
 
-
-    // Get the current time
-    current_time = time(NULL);
-    strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", localtime(&current_time));
-
-    // Write the log message with timestamp and log level
-    fprintf(log_file, "[%s] ", time_string);
-    switch (level) {
-        case INFO:
-            fprintf(log_file, "[INFO] ");
-            break;
-        case WARNING:
-            fprintf(log_file, "[WARNING] ");
-            break;
-        case ERROR:
-            fprintf(log_file, "[ERROR] ");
+// Report walker throughput in entries/sec with 1, 2, 4 ... max_threads threads.
+// The first walk only warms the dentry and inode caches.
+static int run_walk_benchmark(const char *root, int max_threads) {
+    if (walk_tree(root, 0, 1, count_entry, NULL) == -1) {
+        perror("Error opening directory");
+        return 1;
+    }
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        long start = monotonic_us();
+        long entries = walk_tree(root, 0, threads, count_entry, NULL);
+        long elapsed = monotonic_us() - start;
+        printf("threads=%d entries=%ld time_ms=%.1f entries_per_sec=%.0f\n", threads, entries, elapsed / 1000.0, entries * 1e6 / (elapsed > 0 ? elapsed : 1));
+        if (threads == max_threads) {
             break;
+        }
     }
+    return 0;
+}
 
-    // Write the formatted message
-    va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
+static bool count_match(const struct index_record *record, void *arg) {
+    (void)record;
+    (*(long *)arg)++;
+    return true;
+}
 
-    // Add newline character
-    fprintf(log_file, "\n");
+// Look up each name once; returns the elapsed microseconds
+static long time_name_lookups(char **names, long count, long *matches) {
+    long start = monotonic_us();
 
-    // Close the log file
-    fclose(log_file);
+    for (long i = 0; i < count; i++) {
+        index_lookup_name(names[i], count_match, matches);
+    }
+    return monotonic_us() - start;
 }
 
-void handle_client_requests(int client_socket, int connection_count) {
-    char buffer[MAXDATASIZE];
-    int num_bytes_recv;
+// --name-bench: time w24fn lookups of every name in the index, and of as many names that are
+// in none of it, through the name table and then through the binary search it replaced
+static int run_name_benchmark(const char *root, int rounds) {
+    // A benchmark measures the index as built, and must not replace the servers' snapshot
+    index_snapshot_path = NULL;
+    start_file_index(root);
+    while (!index_acquire()) {
+        usleep(10000);
+    }
 
-    while (1) {
-        num_bytes_recv = recv(client_socket, buffer, MAXDATASIZE, 0);
-        if (num_bytes_recv <= 0) {
-            break;
+    long distinct = 0;
+    for (size_t i = 0; i < file_index.sorted_length; i++) {
+        if (i == 0 || strcmp(index_name(&file_index, &file_index.records[file_index.by_name[i]]),
+                             index_name(&file_index, &file_index.records[file_index.by_name[i - 1]])) != 0) {
+            distinct++;
         }
-        buffer[num_bytes_recv] = '\0';
-
-        // Choose redirection destination based on connection count
-        char *destination = redirect_destination(connection_count);
-        if (destination != NULL) {
-            // Perform redirection for specific connections
-            perform_redirection(client_socket, destination, buffer);
-        } else {
-            // Handle client command directly for others
-            handle_direct_command(client_socket, buffer);
+    }
+    char **hits = malloc(distinct * sizeof(char *)), **misses = malloc(distinct * sizeof(char *));
+    if (hits == NULL || misses == NULL) {
+        perror("Allocation failed");
+        return 1;
+    }
+    long false_positives = 0;
+    for (size_t i = 0, n = 0; i < file_index.sorted_length; i++) {
+        const char *name = index_name(&file_index, &file_index.records[file_index.by_name[i]]);
+        if (n == 0 || strcmp(name, hits[n - 1]) != 0) {
+            hits[n] = (char *)name;
+            if (asprintf(&misses[n], "%s.missing", name) == -1) {
+                perror("Allocation failed");
+                return 1;
+            }
+            false_positives += file_index.names.slots != NULL && name_bloom_test(&file_index.names, name_hash(misses[n]));
+            n++;
         }
     }
-    close(client_socket);
+    printf("records=%zu names=%ld bloom_bytes=%zu false_positive_rate=%.4f\n", file_index.count, distinct,
+           file_index.names.bloom != NULL ? (file_index.names.block_mask + 1) * 64 : 0, (double)false_positives / (distinct > 0 ? distinct : 1));
+
+    struct name_table table = file_index.names;
+    for (int pass = 0; pass < 2; pass++) {
+        long hit_us = 0, miss_us = 0, matches = 0;
+        // The second pass hides the table, so index_lookup_name() takes the binary search
+        file_index.names = pass == 0 ? table : (struct name_table){ 0 };
+        for (int round = 0; round < rounds; round++) {
+            hit_us += time_name_lookups(hits, distinct, &matches);
+            miss_us += time_name_lookups(misses, distinct, &matches);
+        }
+        double lookups = (double)distinct * rounds;
+        printf("lookup=%s hit_ns=%.1f miss_ns=%.1f matches=%ld\n", pass == 0 ? "hash" : "binary",
+               hit_us * 1000.0 / (lookups > 0 ? lookups : 1), miss_us * 1000.0 / (lookups > 0 ? lookups : 1), matches / (rounds > 0 ? rounds : 1));
+    }
+    file_index.names = table;
+    index_release();
+    return 0;
 }
 
-void perform_redirection(int client_socket, const char *destination, const char *buffer) {
-    int mirror_socket;
-    struct sockaddr_in mirror_addr;
-    int mirror_port;
+// --search-bench: time a w24fs pattern against the index, through the trigram index
+// and then by matching every distinct name
+static int run_search_benchmark(const char *root, const char *text, int rounds) {
+    struct name_pattern pattern;
 
-    if (strcmp(destination, "Mirror1") == 0) {
-        mirror_port = MIRROR1_PORT;
-    } else if (strcmp(destination, "Mirror2") == 0) {
-        mirror_port = MIRROR2_PORT;
-    } else {
-        mirror_port = PORT;
-    }
+    // A benchmark measures the index as built, and must not replace the servers' snapshot
+    index_snapshot_path = NULL;
 
-    if ((mirror_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Mirror socket creation failed");
-        return;
+    if (name_pattern_init(&pattern, text) == -1) {
+        fprintf(stderr, "Invalid pattern\n");
+        return 1;
     }
-
-    mirror_addr.sin_family = AF_INET;
-    mirror_addr.sin_port = htons(mirror_port);
-    mirror_addr.sin_addr.s_addr = inet_addr(destination == "Mirror1" ? MIRROR1_IP : (destination == "Mirror2" ? MIRROR2_IP : "127.0.0.1"));
-    memset(&(mirror_addr.sin_zero), '\0', 8);
-
-    if (connect(mirror_socket, (struct sockaddr *)&mirror_addr, sizeof(struct sockaddr)) == -1) {
-        perror("Mirror connection failed");
-        close(mirror_socket);
-        return;
+    start_file_index(root);
+    while (!index_acquire()) {
+        usleep(10000);
     }
-
-    char recv_buffer[MAXDATASIZE + 1];
-    send(mirror_socket, buffer, strlen(buffer), 0);
-    int num_bytes_recv = recv(mirror_socket, recv_buffer, MAXDATASIZE, 0);
-    if (num_bytes_recv <= 0) {
-        perror("Receive failed from Mirror");
-        close(mirror_socket);
-        return;
+    printf("records=%zu names=%zu\n", file_index.count, file_index.names.run_count);
+
+    struct trigram_slot *trigrams = file_index.names.trigrams;
+    for (int pass = 0; pass < 2; pass++) {
+        long matches = 0, start = monotonic_us();
+        // The second pass hides the trigram index, so every name is matched
+        file_index.names.trigrams = pass == 0 ? trigrams : NULL;
+        for (int round = 0; round < rounds; round++) {
+            index_search_names(&pattern, count_match, &matches);
+        }
+        long elapsed = monotonic_us() - start;
+        printf("search=%s matches=%ld time_ms=%.3f\n", pass == 0 ? "trigram" : "scan", matches / (rounds > 0 ? rounds : 1),
+               elapsed / 1000.0 / (rounds > 0 ? rounds : 1));
     }
-    recv_buffer[num_bytes_recv] = '\0';
-    send(client_socket, recv_buffer, strlen(recv_buffer), 0);
-    close(mirror_socket);
+    file_index.names.trigrams = trigrams;
+    index_release();
+    return 0;
 }
 
-void handle_direct_command(int client_socket, const char *buffer) {
-    if (strcmp(buffer, "dirlist -a") == 0) {
-        handleDirectoryListing(client_socket);
-    } else if (strcmp(buffer, "dirlist -t") == 0) {
-        handle_dirlist_t(client_socket);
-    } else if (strcmp(buffer, "quitc") == 0) {
-        // Handle quit command
-        char response[] = "quitc"; // Send confirmation to client
-        send(client_socket, response, strlen(response), 0);
-        close(client_socket);
-    } else if (strncmp(buffer, "w24fn ", 6) == 0) {
-        // Extract filename from client request
-        char filename[MAXDATASIZE];
-        sscanf(buffer + 6, "%s", filename);
-        handle_w24fn(client_socket, filename);
-    } else if (strncmp(buffer, "w24fz ", 6) == 0) {
-        // Extract size parameters from client request
-        long size1, size2;
-        if (sscanf(buffer + 6, "%ld %ld", &size1, &size2) != 2) {
-            perror("Invalid command syntax for w24fz");
-            close(client_socket);
-            return;
+static int run_listing_benchmark(const char *directory, int rounds) {
+    struct listing listing = { 0 };
+
+    if (read_listing(directory, NULL, &listing, NULL) == -1) {
+        perror("Error reading directory");
+        return 1;
+    }
+    const char **names = malloc(listing.count * sizeof(char *));
+    if (names == NULL) {
+        perror("Allocation failed");
+        return 1;
+    }
+    printf("names=%zu bytes=%zu\n", listing.count, listing.arena_length);
+    for (int pass = 0; pass < 2; pass++) {
+        long elapsed = 0;
+        for (int round = 0; round < rounds; round++) {
+            // Every round sorts the names in directory order again
+            for (size_t i = 0; i < listing.count; i++) {
+                names[i] = listing.arena + listing.offsets[i];
+            }
+            long start = monotonic_us();
+            if (pass == 0) {
+                sort_names(names, listing.count);
+            } else {
+                qsort(names, listing.count, sizeof(char *), compare_strings);
+            }
+            elapsed += monotonic_us() - start;
         }
-        handle_w24fz(client_socket, size1, size2);
-    } else if (strncmp(buffer, "w24ft ", 6) == 0) {
-        // Extract extensions from client request
-        char extensions[MAXDATASIZE];
-        sscanf(buffer + 6, "%s", extensions);
-        handle_w24ft(client_socket, extensions);
-    } else if (strncmp(buffer, "w24fdb ", 7) == 0) {
-        // Extract date from client request
-        char date[MAXDATASIZE];
-        sscanf(buffer + 7, "%s", date);
-        handle_w24fdb(client_socket, date);
-    } else if (strncmp(buffer, "w24fda ", 7) == 0) {
-        // Extract date from client request
-        char date[MAXDATASIZE];
-        sscanf(buffer + 7, "%s", date);
-        handle_w24fda(client_socket, date);
-    } else {
-        // Handle unknown command
-        char response[] = "Unknown command";
-        send(client_socket, response, strlen(response), 0);
+        printf("sort=%s time_ms=%.3f\n", pass == 0 ? "radix" : "qsort", elapsed / 1000.0 / (rounds > 0 ? rounds : 1));
     }
+    free(names);
+    listing_free(&listing);
+    return 0;
 }
 
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--mode fork|epoll] [--reactors N] [--workers N] [--heavy-workers N] [--gzip-threads N] [--gzip-block-size BYTES] [--copy-path sendfile|read]\n"
+            "       [--routing rotation|least-outstanding|p2c] [--walk-threads N] [--index on|off] [--index-snapshot PATH|off]\n"
+            "       [--cache-bytes BYTES] [--io-backend sync|uring]\n"
+            "       %s --walk-bench DIRECTORY [MAX_THREADS]\n"
+            "       %s --name-bench DIRECTORY [ROUNDS]\n"
+            "       %s --search-bench DIRECTORY PATTERN [ROUNDS]\n"
+            "       %s --listing-bench DIRECTORY [ROUNDS]\n", program, program, program, program, program);
+}
 
-int main() {
+int main(int argc, char *argv[]) {
     int sockfd, new_fd;
-    struct sockaddr_in my_addr, their_addr;
+    struct sockaddr_in their_addr;
     socklen_t sin_size;
     int pid;
     int connection_count = 0;
+    enum ServerMode mode = MODE_FORK;
+    int reactor_count = 0;
+    bool use_index = true;
+
+    // Parse command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            const char *value = argv[++i];
+            if (strcmp(value, "fork") == 0) {
+                mode = MODE_FORK;
+            } else if (strcmp(value, "epoll") == 0) {
+                mode = MODE_EPOLL;
+            } else {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            reactor_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            lane_slot_counts[LANE_INTERACTIVE] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--heavy-workers") == 0 && i + 1 < argc) {
+            lane_slot_counts[LANE_HEAVY] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--gzip-threads") == 0 && i + 1 < argc) {
+            gzip_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--gzip-block-size") == 0 && i + 1 < argc) {
+            long block_size = atol(argv[++i]);
+            // Blocks smaller than the dictionary window would cost most of the compression ratio
+            if (block_size < GZIP_DICTIONARY_SIZE) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            gzip_block_size = block_size;
+        } else if (strcmp(argv[i], "--routing") == 0 && i + 1 < argc) {
+            const char *value = argv[++i];
+            if (strcmp(value, "rotation") == 0) {
+                routing_policy = ROUTE_ROTATION;
+            } else if (strcmp(value, "least-outstanding") == 0) {
+                routing_policy = ROUTE_LEAST_OUTSTANDING;
+            } else if (strcmp(value, "p2c") == 0) {
+                routing_policy = ROUTE_P2C;
+            } else {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc) {
+            const char *value = argv[++i];
+            if (strcmp(value, "on") == 0) {
+                use_index = true;
+            } else if (strcmp(value, "off") == 0) {
+                use_index = false;
+            } else {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--index-snapshot") == 0 && i + 1 < argc) {
+            const char *value = argv[++i];
+            index_snapshot_path = strcmp(value, "off") == 0 ? NULL : value;
+        } else if (strcmp(argv[i], "--cache-bytes") == 0 && i + 1 < argc) {
+            long budget = atol(argv[++i]);
+            if (budget < 0) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            result_cache_budget = budget;
+        } else if (strcmp(argv[i], "--walk-threads") == 0 && i + 1 < argc) {
+            walk_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--walk-bench") == 0 && i + 1 < argc) {
+            const char *root = argv[++i];
+            return run_walk_benchmark(root, i + 1 < argc ? atoi(argv[++i]) : walk_thread_count());
+        } else if (strcmp(argv[i], "--name-bench") == 0 && i + 1 < argc) {
+            const char *root = argv[++i];
+            return run_name_benchmark(root, i + 1 < argc ? atoi(argv[++i]) : 10);
+        } else if (strcmp(argv[i], "--search-bench") == 0 && i + 2 < argc) {
+            const char *root = argv[++i];
+            const char *text = argv[++i];
+            return run_search_benchmark(root, text, i + 1 < argc ? atoi(argv[++i]) : 10);
+        } else if (strcmp(argv[i], "--listing-bench") == 0 && i + 1 < argc) {
+            const char *directory = argv[++i];
+            return run_listing_benchmark(directory, i + 1 < argc ? atoi(argv[++i]) : 10);
+        } else if (strcmp(argv[i], "--io-backend") == 0 && i + 1 < argc) {
+            const char *value = argv[++i];
+            if (strcmp(value, "sync") == 0) {
+                uring_enabled = false;
+            } else if (strcmp(value, "uring") == 0) {
+                uring_enabled = true;
+            } else {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--copy-path") == 0 && i + 1 < argc) {
+            const char *value = argv[++i];
+            if (strcmp(value, "sendfile") == 0) {
+                zero_copy_enabled = true;
+            } else if (strcmp(value, "read") == 0) {
+                zero_copy_enabled = false;
+            } else {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
 
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Socket creation failed");
-        exit(1);
+    // Writes to a client that already hung up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // A forked handler starts its own compression pool, so drop any inherited state
+    pthread_atfork(NULL, NULL, gzip_pool_after_fork_child);
+
+    if (uring_enabled && !uring_supported()) {
+        log_message(WARNING, "io_uring is not available (%s); using plain system calls", strerror(errno));
+        uring_enabled = false;
     }
 
-    // Server address setup
-    my_addr.sin_family = AF_INET;
-    my_addr.sin_port = htons(PORT);
-    my_addr.sin_addr.s_addr = INADDR_ANY;
-    memset(&(my_addr.sin_zero), '\0', 8);
+    // Build the metadata index in the background; handlers walk the disk until it is ready,
+    // or for good with --index off
+    if (use_index) {
+        start_file_index(getenv("HOME"));
+    }
+    start_result_cache();
 
-    // Bind socket
-    if (bind(sockfd, (struct sockaddr *)&my_addr, sizeof(struct sockaddr)) == -1) {
-        perror("Bind failed");
+    start_route_stats();
+    start_lanes();
+#ifndef MIRROR_SERVER
+    if (routing_policy != ROUTE_ROTATION) {
+        start_route_monitor();
+    }
+#endif
+
+    if (mode == MODE_EPOLL) {
+        run_epoll_server(reactor_count);
         exit(1);
     }
 
-    // Listen for connections
-    if (listen(sockfd, BACKLOG) == -1) {
-        perror("Listen failed");
+    // Let the kernel reap finished children so they do not pile up as zombies
+    signal(SIGCHLD, SIG_IGN);
+
+    // Create, bind and listen on the server socket
+    if ((sockfd = create_listen_socket(false, BACKLOG)) == -1) {
         exit(1);
     }
 
-    log_message(INFO, "Server started. Listening on port %d", PORT);
+    log_message(INFO, "%s started. Listening on port %d", SERVER_NAME, PORT);
 
     while(1) {  
         sin_size = sizeof(struct sockaddr_in);
@@ -909,11 +8004,6 @@ int main() {
         }
     }
 
-        // Increment connection count
-        connection_count++;
-    
-
     close(sockfd);
     return 0;
 }
-
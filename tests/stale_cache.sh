@@ -0,0 +1,78 @@
+#!/bin/sh
+# Regression tests for stale answers:
+# - a file rewritten with the same size within the same second must not be served
+#   from the result cache;
+# - a file created while a client is connected must be found by that same session,
+#   although its forked handler holds a copy of the index from before.
+# Builds the server and client into a scratch directory and serves a scratch $HOME
+# on the default port.
+set -eu
+
+repo=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+server_pid=
+cleanup() {
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null || true
+    fi
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+gcc -O2 -o "$work/server" "$repo/server.c" -pthread -lz 2>/dev/null
+gcc -O2 -o "$work/client" "$repo/client.c"
+mkdir -p "$work/home/st"
+printf 'A004' > "$work/home/st/z.qqq"
+
+cd "$work"
+HOME="$work/home" ./server --index-snapshot off > server.out 2>&1 &
+server_pid=$!
+
+run() {
+    printf '%s\nquitc\n' "$1" | ./client > client.out
+}
+
+# Wait until the index answers queries, or caching is not in play
+for _ in $(seq 50); do
+    if run w24stats 2>/dev/null && grep -q 'index_ready=1' client.out; then
+        break
+    fi
+    sleep 0.2
+done
+
+archived() {
+    rm -f temp.tar.gz
+    run "w24ft qqq"
+    tar -xzOf temp.tar.gz
+}
+
+status=0
+for version in D004 E004 F004; do
+    printf '%s' "$version" > home/st/z.qqq
+    sleep 0.1 # Let the watcher apply the event
+    got=$(archived)
+    if [ "$got" != "$version" ]; then
+        echo "FAIL: expected $version, archive holds $got"
+        status=1
+    fi
+done
+[ $status -eq 0 ] && echo "PASS: same-second rewrites invalidate the result cache"
+
+# One connection for the whole session, as the bundled client keeps it
+{
+    sleep 0.3
+    echo "w24fn late.qqq"
+    sleep 0.3
+    printf 'L' > home/st/late.qqq
+    sleep 0.3 # Let the watcher apply the event
+    echo "w24fn late.qqq"
+    echo quitc
+} | ./client > session.out
+if [ "$(grep -c 'not found' session.out)" -ne 1 ]; then
+    echo "FAIL: a file created during the session was not found by it"
+    cat session.out
+    status=1
+else
+    echo "PASS: a session sees files created after it connected"
+fi
+exit $status